@@ -0,0 +1,452 @@
+// Benchmarks of the ExpenseManager hot paths on synthetic ledgers, with
+// results written as JSON so runs can be compared between releases.
+//
+// Build and run:
+//   g++ -std=c++17 -O2 -pthread benchmark.c++ -o ExpenseBenchmark
+//   ./ExpenseBenchmark --rows 10000,1000000 --out results.json
+//
+// Operations are driven the way the menu drives them: their prompts are
+// answered from a scripted cin and their output is discarded, so timings
+// include reading input and formatting tables, but not the terminal.
+//
+// Searches print their results as --limit 50 pages, so that at a million
+// rows a search is timed rather than the table it prints. Listings are
+// timed both ways: view_all_by_* is the default full sort of every row,
+// view_page_by_* the 50-row partial sort behind --limit.
+
+#define EXPENSE_TRACKER_NO_MAIN
+#include "project.c++"
+
+#include <chrono>
+#include <filesystem>
+
+// Shape of a synthetic ledger; the same shape always gives the same rows
+struct LedgerShape {
+    size_t rows = 10000;
+    size_t categories = 12;         // Distinct categories
+    size_t payments = 5;            // Distinct payment methods
+    int years = 3;                  // Dates spread over this many years from 2020-01-01
+    size_t textLength = 24;         // Mean description length; lengths vary from half to 1.5x
+    uint64_t seed = 1;
+};
+
+// splitmix64: small, fast and the same sequence on every platform
+class SyntheticRandom {
+private:
+    uint64_t state;
+
+public:
+    explicit SyntheticRandom(uint64_t seed) : state(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    size_t below(size_t bound) { return (size_t)(next() % bound); }
+};
+
+// Writes synthetic ledgers in the original one-row-per-line format, which
+// the tracker converts to segments when it first opens them
+class LedgerGenerator {
+private:
+    static const vector<string>& words() {
+        static const vector<string> list = {
+            "coffee", "lunch", "groceries", "taxi", "train", "fuel", "rent", "power",
+            "water", "internet", "phone", "books", "cinema", "concert", "pharmacy", "doctor",
+            "gym", "shoes", "jacket", "gift", "flowers", "hotel", "flight", "parking",
+            "insurance", "repair", "software", "music", "games", "bakery", "market", "dinner"
+        };
+        return list;
+    }
+
+public:
+    static string category(size_t index) {
+        char name[32];
+        snprintf(name, sizeof(name), "Category%02zu", index);
+        return name;
+    }
+
+    static string payment(size_t index) {
+        static const char* const names[] = {"Cash", "Card", "Online", "Check", "Transfer"};
+        return index < 5 ? names[index] : "Method" + to_string(index);
+    }
+
+    static const string& word(size_t index) { return words()[index % words().size()]; }
+
+    // Day 0 is 2020-01-01
+    static string date(int day) {
+        static const int lengths[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+        int year = 2020, month = 0;
+        while (true) {
+            bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+            int days = leap ? 366 : 365;
+            if (day < days) break;
+            day -= days;
+            year++;
+        }
+        while (true) {
+            bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+            int days = lengths[month] + (month == 1 && leap ? 1 : 0);
+            if (day < days) break;
+            day -= days;
+            month++;
+        }
+        char text[32];
+        snprintf(text, sizeof(text), "%04d-%02d-%02d", year, month + 1, day + 1);
+        return text;
+    }
+
+    static string text(SyntheticRandom& random, size_t meanLength) {
+        size_t length = meanLength / 2 + random.below(meanLength + 1);
+        string value;
+        while (value.size() < length) {
+            if (!value.empty()) value += ' ';
+            value += word(random.below(words().size()));
+        }
+        return value;
+    }
+
+    // Expense IDs run from 1 to shape.rows
+    static bool write(const LedgerShape& shape, const string& file) {
+        ofstream out(file);
+        if (!out.is_open()) return false;
+        SyntheticRandom random(shape.seed);
+        int span = shape.years * 365;
+        for (size_t i = 1; i <= shape.rows; i++) {
+            double amount = 1 + random.below(49900) / 100.0;
+            bool recurring = random.below(10) == 0;
+            out << i << "|" << text(random, shape.textLength) << "|" << fixed << setprecision(2) << amount
+                << "|" << category(random.below(shape.categories)) << "|" << date((int)random.below(span))
+                << "|" << (random.below(4) == 0 ? text(random, shape.textLength) : "")
+                << "|" << (recurring ? "1" : "0") << "|" << payment(random.below(shape.payments))
+                << "|" << (random.below(3) == 0 ? "Store " + to_string(random.below(100)) : "") << "\n";
+        }
+        return out.good();
+    }
+};
+
+// Swallows everything written to it
+class NullBuffer : public streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char*, streamsize count) override { return count; }
+};
+
+// Timings of every operation for one ledger size
+class BenchmarkRun {
+public:
+    struct Result {
+        string operation;
+        vector<double> samples;         // Milliseconds per call
+    };
+
+private:
+    LedgerShape shape;
+    size_t repeat;
+    size_t batch;
+    string directory;
+    string ledger;
+    vector<Result> results;
+
+    Result& result(const string& operation) {
+        for (auto& entry : results) {
+            if (entry.operation == operation) return entry;
+        }
+        results.push_back({operation, {}});
+        return results.back();
+    }
+
+    // Run the operation with the answers on cin and record how long it took
+    template <typename Operation>
+    void timed(const string& operation, const string& answers, Operation run) {
+        istringstream input(answers);
+        streambuf* saved = cin.rdbuf(input.rdbuf());
+        auto start = chrono::steady_clock::now();
+        run();
+        double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cin.rdbuf(saved);
+        result(operation).samples.push_back(elapsed);
+    }
+
+    template <typename Operation>
+    void untimed(const string& answers, Operation run) {
+        istringstream input(answers);
+        streambuf* saved = cin.rdbuf(input.rdbuf());
+        run();
+        cin.rdbuf(saved);
+    }
+
+    // Change the ledger and wait for the write, so the next search or
+    // summary cannot be answered from the query cache
+    void freshRevision(ExpenseManager& manager) {
+        untimed("Benchmark\n1\nBenchmark\n", [&] { manager.quickAddExpense(); });
+        manager.saveToFile();
+    }
+
+    // Distinct existing IDs spread over the ledger
+    int pickId(size_t sample, size_t salt) const {
+        return 1 + (int)((sample * 7919 + salt * 104729) % shape.rows);
+    }
+
+    void searches(ExpenseManager& manager) {
+        for (size_t i = 0; i < repeat; i++) {
+            freshRevision(manager);
+            timed("search_description", LedgerGenerator::word(i) + "\n",
+                  [&] { manager.searchByDescription(); });
+            freshRevision(manager);
+            timed("search_category", LedgerGenerator::category(i % shape.categories) + "\n",
+                  [&] { manager.searchByCategory(); });
+
+            int startDay = (int)(i * 97 % (shape.years * 365));
+            string range = LedgerGenerator::date(startDay) + "\n" + LedgerGenerator::date(startDay + 90) + "\n";
+            freshRevision(manager);
+            timed("search_date_range", range, [&] { manager.searchByDateRange(); });
+
+            string amounts = to_string(10 + i * 7) + "\n" + to_string(60 + i * 7) + "\n";
+            freshRevision(manager);
+            timed("search_amount_range", amounts, [&] { manager.searchByAmountRange(); });
+            freshRevision(manager);
+            timed("search_payment_method", LedgerGenerator::payment(i % shape.payments) + "\n",
+                  [&] { manager.searchByPaymentMethod(); });
+
+            // Description, category, amounts and dates together
+            string advanced = LedgerGenerator::word(i) + "\n" + LedgerGenerator::category(i % shape.categories) +
+                              "\n\n5\n400\n" + range;
+            freshRevision(manager);
+            timed("advanced_search", advanced, [&] { manager.advancedSearch(); });
+
+            freshRevision(manager);
+            timed("generate_summary", "", [&] { manager.generateSummary(); });
+        }
+    }
+
+    void listings(ExpenseManager& manager) {
+        static const char* const sorts[] = {"date", "amount", "category", "id"};
+        ListingOptions full, page;
+        page.limit = 50;
+        for (size_t i = 0; i < repeat; i++) {
+            manager.setListing(full);
+            for (int sort = 1; sort <= 4; sort++) {
+                timed(string("view_all_by_") + sorts[sort - 1], to_string(sort) + "\n",
+                      [&] { manager.viewAllExpenses(); });
+            }
+            manager.setListing(page);
+            for (int sort = 1; sort <= 4; sort++) {
+                timed(string("view_page_by_") + sorts[sort - 1], to_string(sort) + "\n",
+                      [&] { manager.viewAllExpenses(); });
+            }
+            freshRevision(manager);
+            string file = directory + "/export";
+            timed("export_csv", file + "\n", [&] { manager.exportToCSV(); });
+            remove((file + ".csv").c_str());
+        }
+    }
+
+    void mutations(ExpenseManager& manager) {
+        for (size_t i = 0; i < batch; i++) {
+            string answers = "Benchmark add " + to_string(i) + "\n" + to_string(5 + i % 50) + ".25\n" +
+                             LedgerGenerator::category(i % shape.categories) + "\n" +
+                             LedgerGenerator::date((int)(i * 31 % (shape.years * 365))) + "\n\nCard\n\nn\n";
+            timed("add", answers, [&] { manager.addExpense(); });
+        }
+        manager.saveToFile();
+
+        for (size_t i = 0; i < batch; i++) {
+            string answers = to_string(pickId(i, 1)) + "\n2\n" + to_string(12 + i % 40) + ".50\n";
+            timed("update_by_id", answers, [&] { manager.updateExpense(); });
+        }
+        manager.saveToFile();
+
+        // Save after every slice of deletes, so save gets repeat samples like load
+        size_t slice = max((size_t)1, batch / repeat);
+        for (size_t i = 0; i < batch; i++) {
+            timed("delete", to_string(pickId(i, 2)) + "\ny\n", [&] { manager.deleteExpense(); });
+            if ((i + 1) % slice == 0 || i + 1 == batch) timed("save", "", [&] { manager.saveToFile(); });
+        }
+
+        // Step back and forth over the most recent 20 operations: enough samples
+        // per round, and few enough that the ledger stays close to its measured size
+        for (size_t i = 0; i < 20; i++) timed("undo", "", [&] { manager.undoLastOperation(); });
+        for (size_t i = 0; i < 20; i++) timed("redo", "", [&] { manager.redoLastOperation(); });
+        manager.saveToFile();
+    }
+
+public:
+    BenchmarkRun(const LedgerShape& ledgerShape, size_t repeats, size_t mutationBatch, const string& root)
+        : shape(ledgerShape), repeat(repeats), batch(mutationBatch),
+          directory(root + "/" + to_string(ledgerShape.rows)), ledger(directory + "/expenses.txt") {}
+
+    const LedgerShape& ledgerShape() const { return shape; }
+    const vector<Result>& timings() const { return results; }
+
+    bool run() {
+        filesystem::remove_all(directory);
+        filesystem::create_directories(directory);
+        if (!LedgerGenerator::write(shape, ledger)) {
+            cerr << "Error: could not write " << ledger << "\n";
+            return false;
+        }
+
+        AppOptions options;
+        options.listing.limit = 50;
+
+        // First open converts the flat file into segments
+        timed("import", "", [&] { ExpenseManager manager(ledger, options); });
+        for (size_t i = 0; i < repeat; i++) {
+            timed("load", "", [&] { ExpenseManager manager(ledger, options); });
+        }
+
+        ExpenseManager manager(ledger, options);
+        // Opening reads only the manifest; the first full scan loads the rows
+        timed("load_rows", "no such text\n", [&] { manager.searchByDescription(); });
+        searches(manager);
+        listings(manager);
+        mutations(manager);
+        return true;
+    }
+
+    void cleanup() {
+        filesystem::remove_all(directory);
+    }
+};
+
+// Results as JSON: one entry per ledger size, one object per operation
+void writeJson(ostream& out, const vector<BenchmarkRun>& runs) {
+    auto number = [](double value) {
+        ostringstream text;
+        text << fixed << setprecision(4) << value;
+        return text.str();
+    };
+
+    out << "{\n  \"benchmark\": \"expense-tracker\",\n  \"runs\": [";
+    for (size_t r = 0; r < runs.size(); r++) {
+        const LedgerShape& shape = runs[r].ledgerShape();
+        out << (r ? "," : "") << "\n    {\n"
+            << "      \"rows\": " << shape.rows << ",\n"
+            << "      \"categories\": " << shape.categories << ",\n"
+            << "      \"payments\": " << shape.payments << ",\n"
+            << "      \"years\": " << shape.years << ",\n"
+            << "      \"text_length\": " << shape.textLength << ",\n"
+            << "      \"seed\": " << shape.seed << ",\n"
+            << "      \"operations\": [";
+        const auto& timings = runs[r].timings();
+        for (size_t t = 0; t < timings.size(); t++) {
+            vector<double> samples = timings[t].samples;
+            sort(samples.begin(), samples.end());
+            double total = 0;
+            for (double sample : samples) total += sample;
+            out << (t ? "," : "") << "\n        {\"operation\": \"" << timings[t].operation << "\""
+                << ", \"samples\": " << samples.size()
+                << ", \"mean_ms\": " << number(total / samples.size())
+                << ", \"median_ms\": " << number(samples[samples.size() / 2])
+                << ", \"min_ms\": " << number(samples.front())
+                << ", \"max_ms\": " << number(samples.back()) << "}";
+        }
+        out << "\n      ]\n    }";
+    }
+    out << "\n  ]\n}\n";
+}
+
+bool parseList(const string& text, vector<size_t>& values) {
+    values.clear();
+    stringstream list(text);
+    string item;
+    while (getline(list, item, ',')) {
+        try {
+            long value = stol(item);
+            if (value < 1) return false;
+            values.push_back((size_t)value);
+        } catch (const exception&) {
+            return false;
+        }
+    }
+    return !values.empty();
+}
+
+int main(int argc, char* argv[]) {
+    vector<size_t> sizes = {10000, 1000000, 10000000};
+    LedgerShape shape;
+    size_t repeat = 5, batch = 200;
+    string output, directory = "benchmark-data";
+    bool keep = false;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        try {
+            if (arg == "--rows" && hasValue && parseList(argv[++i], sizes)) continue;
+            if (arg == "--categories" && hasValue && (shape.categories = stoul(argv[++i])) > 0) continue;
+            if (arg == "--payments" && hasValue && (shape.payments = stoul(argv[++i])) > 0) continue;
+            if (arg == "--years" && hasValue && (shape.years = stoi(argv[++i])) > 0) continue;
+            if (arg == "--text" && hasValue && (shape.textLength = stoul(argv[++i])) > 0) continue;
+            if (arg == "--seed" && hasValue) {
+                shape.seed = stoull(argv[++i]);
+                continue;
+            }
+            if (arg == "--repeat" && hasValue && (repeat = stoul(argv[++i])) > 0) continue;
+            if (arg == "--batch" && hasValue && (batch = stoul(argv[++i])) > 0) continue;
+        } catch (const exception&) {
+        }
+        if (arg == "--out" && hasValue) {
+            output = argv[++i];
+            continue;
+        }
+        if (arg == "--dir" && hasValue) {
+            directory = argv[++i];
+            continue;
+        }
+        if (arg == "--keep") {
+            keep = true;
+            continue;
+        }
+        cerr << "Usage: " << argv[0] << " [--rows N,N,...] [--categories N] [--payments N] [--years N]"
+             << " [--text N] [--seed N] [--repeat N] [--batch N] [--out FILE] [--dir DIR] [--keep]\n";
+        cerr << "  --rows N,N,...   Ledger sizes to measure (default 10000,1000000,10000000)\n";
+        cerr << "  --categories N   Distinct categories (default 12)\n";
+        cerr << "  --payments N     Distinct payment methods (default 5)\n";
+        cerr << "  --years N        Years the dates span (default 3)\n";
+        cerr << "  --text N         Mean description length (default 24)\n";
+        cerr << "  --seed N         Generator seed (default 1)\n";
+        cerr << "  --repeat N       Samples of each search, report and load (default 5)\n";
+        cerr << "  --batch N        Adds, updates and deletes measured (default 200)\n";
+        cerr << "  --out FILE       Write the JSON results here instead of stdout\n";
+        cerr << "  --dir DIR        Scratch directory for ledgers (default benchmark-data)\n";
+        cerr << "  --keep           Keep the generated ledgers\n";
+        return 1;
+    }
+
+    // The tracker's own output is not part of the results
+    NullBuffer discard;
+    streambuf* console = cout.rdbuf(&discard);
+
+    vector<BenchmarkRun> runs;
+    for (size_t rows : sizes) {
+        shape.rows = rows;
+        cerr << "Benchmarking " << rows << " rows...\n";
+        runs.emplace_back(shape, repeat, batch, directory);
+        bool ok = runs.back().run();
+        if (!keep) runs.back().cleanup();
+        if (!ok) {
+            cout.rdbuf(console);
+            return 1;
+        }
+    }
+    if (!keep) filesystem::remove(directory);
+    cout.rdbuf(console);
+
+    if (output.empty()) {
+        writeJson(cout, runs);
+    } else {
+        ofstream file(output);
+        writeJson(file, runs);
+        if (!file.good()) {
+            cerr << "Error: could not write " << output << "\n";
+            return 1;
+        }
+        cerr << "Results written to " << output << "\n";
+    }
+    return 0;
+}
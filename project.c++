@@ -8,12 +8,49 @@
 #include <limits>
 #include <climits>
 #include <cfloat>
+#include <cmath>
 #include <map>
 #include <ctime>
 #include <regex>
 #include <set>
 #include <queue>
 #include <stack>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <cstdint>
+#include <cstdlib>
+#include <unordered_map>
+#include <unordered_set>
+#include <cerrno>
+#include <atomic>
+#include <new>
+#include <memory_resource>
+#include <string_view>
+#include <charconv>
+#include <chrono>
+#include <tuple>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#endif
+#ifdef __linux__
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#endif
 
 using namespace std;
 
@@ -21,6 +58,554 @@ using namespace std;
 class Expense;
 class ExpenseManager;
 
+// Owners that live heap memory is attributed to. Each block is stamped
+// with the allocating thread's current tag (see MemoryTagScope); blocks
+// that change hands, such as rows kept only by undo snapshots, are retagged.
+enum class MemoryTag : uint32_t {
+    Other, Rows, Index, Snapshots, Cache, Categories, Persistence,
+    Count
+};
+
+// Process-wide heap counters fed by the replaced global operator new.
+// Every block carries a 16-byte header with its size and tag, so frees
+// are charged to the owner that allocated (or was last given) the block.
+// Relaxed atomics: the numbers are statistics, not synchronisation.
+struct AllocationCounters {
+    struct Header {
+        uint64_t size;
+        uint32_t tag;
+        uint32_t offset;        // From the start of the malloc'd block to the user pointer
+    };
+    
+    static inline atomic<unsigned long long> calls{0};
+    static inline atomic<unsigned long long> bytes{0};
+    static inline atomic<long long> live[(size_t)MemoryTag::Count] = {};
+    static inline atomic<long long> liveBlocks{0};
+    static inline thread_local MemoryTag current = MemoryTag::Other;
+    
+    static Header* header(const void* block) {
+        return reinterpret_cast<Header*>(const_cast<char*>(static_cast<const char*>(block))) - 1;
+    }
+    
+    // Write the header in front of the user pointer and count the block
+    static void* stamp(void* raw, size_t size, size_t offset) {
+        char* block = static_cast<char*>(raw) + offset;
+        Header* head = header(block);
+        head->size = size;
+        head->tag = (uint32_t)current;
+        head->offset = (uint32_t)offset;
+        calls.fetch_add(1, memory_order_relaxed);
+        bytes.fetch_add(size, memory_order_relaxed);
+        live[head->tag].fetch_add((long long)size, memory_order_relaxed);
+        liveBlocks.fetch_add(1, memory_order_relaxed);
+        return block;
+    }
+    
+    static void release(void* block) {
+        if (block == nullptr) return;
+        Header* head = header(block);
+        live[head->tag].fetch_sub((long long)head->size, memory_order_relaxed);
+        liveBlocks.fetch_sub(1, memory_order_relaxed);
+        free(static_cast<char*>(block) - head->offset);
+    }
+    
+    static size_t sizeOf(const void* block) { return header(block)->size; }
+    static MemoryTag tagOf(const void* block) { return (MemoryTag)header(block)->tag; }
+    
+    // Charge a live block to another owner. The caller must keep the
+    // block alive meanwhile.
+    static void retag(const void* block, MemoryTag tag) {
+        Header* head = header(block);
+        if (head->tag == (uint32_t)tag) return;
+        live[head->tag].fetch_sub((long long)head->size, memory_order_relaxed);
+        live[(size_t)tag].fetch_add((long long)head->size, memory_order_relaxed);
+        head->tag = (uint32_t)tag;
+    }
+    
+    // True if the string's characters live in a heap block of their own
+    // rather than in the short-string buffer inside the object
+    static bool onHeap(const string& text) {
+        const char* data = text.data();
+        const char* object = reinterpret_cast<const char*>(&text);
+        return data < object || data >= object + sizeof(string);
+    }
+    
+    static long long liveBytes(MemoryTag tag) { return live[(size_t)tag].load(memory_order_relaxed); }
+    
+    static long long liveTotal() {
+        long long total = 0;
+        for (const auto& owner : live) total += owner.load(memory_order_relaxed);
+        return total;
+    }
+};
+
+// Attributes the heap blocks allocated by this thread to an owner until
+// the scope ends
+class MemoryTagScope {
+private:
+    MemoryTag previous;
+    
+public:
+    explicit MemoryTagScope(MemoryTag tag) : previous(AllocationCounters::current) {
+        AllocationCounters::current = tag;
+    }
+    
+    MemoryTagScope(const MemoryTagScope&) = delete;
+    MemoryTagScope& operator=(const MemoryTagScope&) = delete;
+    
+    ~MemoryTagScope() { AllocationCounters::current = previous; }
+};
+
+void* operator new(size_t size) {
+    const size_t offset = sizeof(AllocationCounters::Header);
+    if (void* block = malloc(size + offset)) return AllocationCounters::stamp(block, size, offset);
+    throw bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return ::operator new(size);
+}
+
+// std::pmr's default resource allocates through the aligned forms. The
+// block is over-allocated and the user pointer rounded up by hand (no
+// posix_memalign, so Windows builds too); the header goes in the padding
+// in front of it.
+void* operator new(size_t size, align_val_t alignment) {
+    const size_t align = static_cast<size_t>(alignment);
+    const size_t headerSize = sizeof(AllocationCounters::Header);
+    if (char* block = static_cast<char*>(malloc(size + align + headerSize))) {
+        uintptr_t start = reinterpret_cast<uintptr_t>(block) + headerSize;
+        uintptr_t aligned = (start + align - 1) & ~(uintptr_t)(align - 1);
+        return AllocationCounters::stamp(block, size, (size_t)(aligned - reinterpret_cast<uintptr_t>(block)));
+    }
+    throw bad_alloc();
+}
+
+void* operator new[](size_t size, align_val_t alignment) {
+    return ::operator new(size, alignment);
+}
+
+// Kept out of line so the compiler does not pair the inlined free() with
+// new-expressions and warn about a mismatched deallocation
+[[gnu::noinline]] void operator delete(void* block) noexcept { AllocationCounters::release(block); }
+[[gnu::noinline]] void operator delete[](void* block) noexcept { AllocationCounters::release(block); }
+[[gnu::noinline]] void operator delete(void* block, size_t) noexcept { AllocationCounters::release(block); }
+[[gnu::noinline]] void operator delete[](void* block, size_t) noexcept { AllocationCounters::release(block); }
+[[gnu::noinline]] void operator delete(void* block, align_val_t) noexcept { AllocationCounters::release(block); }
+[[gnu::noinline]] void operator delete[](void* block, align_val_t) noexcept { AllocationCounters::release(block); }
+[[gnu::noinline]] void operator delete(void* block, size_t, align_val_t) noexcept { AllocationCounters::release(block); }
+[[gnu::noinline]] void operator delete[](void* block, size_t, align_val_t) noexcept { AllocationCounters::release(block); }
+
+// Reports the heap traffic of one query when --alloc-stats is given
+class AllocationScope {
+private:
+    const char* label;
+    unsigned long long calls, bytes;
+    
+public:
+    static inline bool enabled = false;
+    
+    explicit AllocationScope(const char* name)
+        : label(name),
+          calls(AllocationCounters::calls.load(memory_order_relaxed)),
+          bytes(AllocationCounters::bytes.load(memory_order_relaxed)) {}
+    
+    AllocationScope(const AllocationScope&) = delete;
+    AllocationScope& operator=(const AllocationScope&) = delete;
+    
+    ~AllocationScope() {
+        if (!enabled) return;
+        cout << "[alloc] " << label << ": "
+             << AllocationCounters::calls.load(memory_order_relaxed) - calls << " allocation(s), "
+             << AllocationCounters::bytes.load(memory_order_relaxed) - bytes << " bytes\n";
+    }
+};
+
+// Scratch memory for one query. Transient result vectors and maps are
+// carved from an inline buffer (spilling into growing upstream blocks) and
+// everything is released at once when the arena goes out of scope.
+class QueryArena {
+private:
+    static const size_t INLINE_BYTES = 64 * 1024;
+    alignas(max_align_t) char buffer[INLINE_BYTES];
+    pmr::monotonic_buffer_resource resource;
+    
+public:
+    QueryArena() : resource(buffer, sizeof(buffer)) {}
+    
+    QueryArena(const QueryArena&) = delete;
+    QueryArena& operator=(const QueryArena&) = delete;
+    
+    pmr::memory_resource* get() { return &resource; }
+};
+
+// Rows matched by a query; they point into the store and stay valid until
+// the next scan may evict their partition
+typedef pmr::vector<const Expense*> ExpenseRefs;
+
+// Latency distribution with bounded relative error, laid out like an HDR
+// histogram: values below 128 ns get a bucket each, and every power of
+// two above is split into 64 equal buckets, so a recorded value is known
+// to within 1/64 (1.6%) in about 20 KB. Recording is lock-free.
+class LatencyHistogram {
+private:
+    static const int PRECISION = 7;                         // Bits kept of each value
+    static const uint64_t LINEAR = 1ULL << PRECISION;
+    static const uint64_t HALF = LINEAR / 2;
+    static const int TOP_BIT = 45;                          // 2^46 ns (19 hours): longer values are clamped
+    static const size_t BUCKETS = LINEAR + (TOP_BIT - PRECISION + 1) * HALF;
+    
+    atomic<uint64_t> buckets[BUCKETS] = {};
+    atomic<uint64_t> sum{0};
+    atomic<uint64_t> peak{0};
+    
+    static size_t bucketOf(uint64_t value) {
+        value = min(value, (uint64_t)(1ULL << (TOP_BIT + 1)) - 1);
+        if (value < LINEAR) return (size_t)value;
+        int shift = 63 - __builtin_clzll(value) - (PRECISION - 1);
+        return (size_t)(LINEAR + (shift - 1) * HALF + ((value >> shift) - HALF));
+    }
+    
+    // Largest value that lands in the bucket
+    static uint64_t highestIn(size_t bucket) {
+        if (bucket < LINEAR) return bucket;
+        uint64_t offset = bucket - LINEAR;
+        int shift = (int)(offset / HALF) + 1;
+        return ((offset % HALF + HALF + 1) << shift) - 1;
+    }
+    
+public:
+    struct Snapshot {
+        vector<uint64_t> counts;
+        uint64_t count = 0, sum = 0, highest = 0;
+        
+        // Value at quantile q (0-1), to within the bucket resolution
+        uint64_t quantile(double q) const {
+            if (count == 0) return 0;
+            uint64_t rank = max((uint64_t)1, (uint64_t)ceil(q * count));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < counts.size(); i++) {
+                seen += counts[i];
+                if (seen >= rank) return min(highestIn(i), highest);
+            }
+            return highest;
+        }
+        
+        double mean() const { return count ? (double)sum / count : 0; }
+    };
+    
+    void record(uint64_t nanos) {
+        buckets[bucketOf(nanos)].fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(nanos, memory_order_relaxed);
+        uint64_t seen = peak.load(memory_order_relaxed);
+        while (nanos > seen && !peak.compare_exchange_weak(seen, nanos, memory_order_relaxed)) {}
+    }
+    
+    // Copy of the counts; recordings made meanwhile may be half included
+    Snapshot snapshot() const {
+        Snapshot copy;
+        copy.counts.resize(BUCKETS);
+        for (size_t i = 0; i < BUCKETS; i++) {
+            copy.counts[i] = buckets[i].load(memory_order_relaxed);
+            copy.count += copy.counts[i];
+        }
+        copy.sum = sum.load(memory_order_relaxed);
+        copy.highest = peak.load(memory_order_relaxed);
+        return copy;
+    }
+};
+
+// Operations whose latency is tracked
+enum class Metric {
+    Load, LoadSegment, Save,
+    SearchDescription, SearchCategory, SearchDateRange, SearchAmountRange, SearchPaymentMethod,
+    AdvancedSearch, Summary, Export, ServerRequest,
+    Count
+};
+
+// Process-wide runtime metrics: a latency histogram per operation, plus
+// counters and gauges. Always collected; the `stats` menu entry shows
+// them and --metrics dumps them in Prometheus text format.
+struct RuntimeMetrics {
+    static inline LatencyHistogram latency[(size_t)Metric::Count];
+    static inline atomic<unsigned long long> rowsScanned{0};    // Rows examined by searches
+    static inline atomic<unsigned long long> rowsReturned{0};   // Rows in search results shown or sent
+    static inline atomic<unsigned long long> bytesWritten{0};   // Ledger, journal, archive and export bytes
+    static inline atomic<unsigned long long> cacheHits{0};
+    static inline atomic<unsigned long long> cacheMisses{0};
+    static inline atomic<unsigned long long> ledgerRows{0};     // Gauge: expenses in the ledger
+    
+    static void add(atomic<unsigned long long>& counter, unsigned long long amount) {
+        counter.fetch_add(amount, memory_order_relaxed);
+    }
+    
+    static const char* name(Metric metric) {
+        static const char* const names[] = {
+            "load", "load_segment", "save",
+            "search_description", "search_category", "search_date_range", "search_amount_range",
+            "search_payment_method", "advanced_search", "summary", "export", "server_request"
+        };
+        return names[(size_t)metric];
+    }
+    
+    // Resident set size now and at its peak, in bytes (0 where unknown)
+    static pair<unsigned long long, unsigned long long> residentBytes() {
+        unsigned long long current = 0, highest = 0;
+#ifndef _WIN32
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) highest = (unsigned long long)usage.ru_maxrss * 1024;
+#endif
+#ifdef __linux__
+        ifstream statm("/proc/self/statm");
+        unsigned long long size, pages;
+        if (statm >> size >> pages) current = pages * (unsigned long long)sysconf(_SC_PAGESIZE);
+#endif
+        return {current, max(current, highest)};
+    }
+    
+    // Everything in Prometheus text exposition format. Latencies are
+    // summaries (quantiles, sum and count) in seconds.
+    static string prometheus() {
+        ostringstream out;
+        out << setprecision(9);
+        out << "# HELP expense_tracker_operation_seconds Latency of tracker operations.\n"
+            << "# TYPE expense_tracker_operation_seconds summary\n";
+        for (size_t m = 0; m < (size_t)Metric::Count; m++) {
+            LatencyHistogram::Snapshot histogram = latency[m].snapshot();
+            string label = string("operation=\"") + name((Metric)m) + "\"";
+            for (double q : {0.5, 0.9, 0.99, 0.999}) {
+                out << "expense_tracker_operation_seconds{" << label << ",quantile=\"" << q << "\"} "
+                    << histogram.quantile(q) / 1e9 << "\n";
+            }
+            out << "expense_tracker_operation_seconds_sum{" << label << "} " << histogram.sum / 1e9 << "\n"
+                << "expense_tracker_operation_seconds_count{" << label << "} " << histogram.count << "\n";
+        }
+        
+        auto counter = [&out](const char* metric, const char* help, unsigned long long value) {
+            out << "# HELP expense_tracker_" << metric << " " << help << "\n"
+                << "# TYPE expense_tracker_" << metric << " counter\n"
+                << "expense_tracker_" << metric << " " << value << "\n";
+        };
+        auto gauge = [&out](const char* metric, const char* help, unsigned long long value) {
+            out << "# HELP expense_tracker_" << metric << " " << help << "\n"
+                << "# TYPE expense_tracker_" << metric << " gauge\n"
+                << "expense_tracker_" << metric << " " << value << "\n";
+        };
+        counter("rows_scanned_total", "Rows examined by searches.", rowsScanned.load(memory_order_relaxed));
+        counter("rows_returned_total", "Rows in search results.", rowsReturned.load(memory_order_relaxed));
+        counter("bytes_written_total", "Bytes written to ledger, journal, archive and export files.",
+                bytesWritten.load(memory_order_relaxed));
+        counter("query_cache_hits_total", "Searches and summaries answered from the cache.",
+                cacheHits.load(memory_order_relaxed));
+        counter("query_cache_misses_total", "Searches and summaries computed.", cacheMisses.load(memory_order_relaxed));
+        counter("heap_allocations_total", "Heap allocations.", AllocationCounters::calls.load(memory_order_relaxed));
+        counter("heap_allocated_bytes_total", "Bytes requested from the heap.",
+                AllocationCounters::bytes.load(memory_order_relaxed));
+        pair<unsigned long long, unsigned long long> resident = residentBytes();
+        gauge("resident_bytes", "Resident set size.", resident.first);
+        gauge("peak_resident_bytes", "Largest resident set size so far.", resident.second);
+        gauge("ledger_rows", "Expenses in the ledger.", ledgerRows.load(memory_order_relaxed));
+        
+        static const char* const owners[] = {"other", "rows", "index", "snapshots", "cache", "categories",
+                                             "persistence"};
+        out << "# HELP expense_tracker_heap_bytes Live heap bytes by owner.\n"
+            << "# TYPE expense_tracker_heap_bytes gauge\n";
+        for (size_t tag = 0; tag < (size_t)MemoryTag::Count; tag++) {
+            out << "expense_tracker_heap_bytes{owner=\"" << owners[tag] << "\"} "
+                << max(0LL, AllocationCounters::liveBytes((MemoryTag)tag)) << "\n";
+        }
+        return out.str();
+    }
+};
+
+// Records the time from construction to destruction in the operation's
+// histogram: two clock reads and a few relaxed atomic adds
+class LatencyScope {
+private:
+    Metric metric;
+    chrono::steady_clock::time_point start;
+    
+public:
+    explicit LatencyScope(Metric operation) : metric(operation), start(chrono::steady_clock::now()) {}
+    
+    LatencyScope(const LatencyScope&) = delete;
+    LatencyScope& operator=(const LatencyScope&) = delete;
+    
+    ~LatencyScope() {
+        auto elapsed = chrono::steady_clock::now() - start;
+        RuntimeMetrics::latency[(size_t)metric].record(
+            (uint64_t)chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+    }
+};
+
+// Rewrites the metrics file every interval (and once more when stopped),
+// via a temporary file and a rename so readers never see a partial dump
+class MetricsExporter {
+private:
+    string path;
+    chrono::seconds interval;
+    mutex lock;
+    condition_variable stopRequested;
+    bool stopping = false;
+    thread worker;
+    
+    void dump() {
+        string temp = path + ".tmp";
+        {
+            ofstream file(temp, ios::binary | ios::trunc);
+            file << RuntimeMetrics::prometheus();
+            if (!file.good()) return;
+        }
+        rename(temp.c_str(), path.c_str());
+    }
+    
+    void run() {
+        unique_lock<mutex> guard(lock);
+        while (!stopRequested.wait_for(guard, interval, [this] { return stopping; })) {
+            dump();
+        }
+        dump();
+    }
+    
+public:
+    MetricsExporter(const string& file, unsigned seconds) : path(file), interval(seconds) {
+        worker = thread(&MetricsExporter::run, this);
+    }
+    
+    ~MetricsExporter() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        stopRequested.notify_one();
+        worker.join();
+    }
+    
+    MetricsExporter(const MetricsExporter&) = delete;
+    MetricsExporter& operator=(const MetricsExporter&) = delete;
+};
+
+// Scoped trace spans. Built with -DEXPENSE_TRACKER_TRACING, each thread
+// records the spans it completes into its own ring buffer, overwriting
+// the oldest when full, and TraceLog::write() dumps all buffers as Chrome
+// trace-event JSON (chrome://tracing, ui.perfetto.dev). Otherwise
+// TRACE_SPAN expands to an empty statement and nothing below exists.
+#ifdef EXPENSE_TRACKER_TRACING
+class TraceLog {
+public:
+    static const size_t CAPACITY = 1 << 15;     // Spans kept per thread
+    
+private:
+    // Fields are atomic so a dump may read a buffer while its thread records
+    struct Event {
+        atomic<const char*> name{nullptr};
+        atomic<uint64_t> start{0}, duration{0};
+    };
+    
+    struct Buffer {
+        uint32_t thread = 0;
+        atomic<uint64_t> head{0};               // Spans ever recorded
+        Event events[CAPACITY];
+    };
+    
+    static inline mutex registryLock;
+    static inline vector<shared_ptr<Buffer>> buffers;   // Outlive their threads
+    static inline const chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+    
+    static Buffer& local() {
+        thread_local shared_ptr<Buffer> buffer = [] {
+            shared_ptr<Buffer> created = make_shared<Buffer>();
+            lock_guard<mutex> guard(registryLock);
+            created->thread = (uint32_t)buffers.size() + 1;
+            buffers.push_back(created);
+            return created;
+        }();
+        return *buffer;
+    }
+    
+public:
+    // Nanoseconds since the process started tracing
+    static uint64_t now() {
+        return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - origin).count();
+    }
+    
+    // name must be a string literal: only the pointer is kept
+    static void record(const char* name, uint64_t start, uint64_t end) {
+        Buffer& buffer = local();
+        uint64_t slot = buffer.head.load(memory_order_relaxed);
+        Event& event = buffer.events[slot % CAPACITY];
+        event.name.store(name, memory_order_relaxed);
+        event.start.store(start, memory_order_relaxed);
+        event.duration.store(end - start, memory_order_relaxed);
+        buffer.head.store(slot + 1, memory_order_release);
+    }
+    
+    // Write every buffered span to path; false if the file could not be
+    // written. Spans overwritten while the dump ran are left out.
+    static bool write(const string& path, size_t& written) {
+        vector<shared_ptr<Buffer>> all;
+        {
+            lock_guard<mutex> guard(registryLock);
+            all = buffers;
+        }
+        
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out.is_open()) return false;
+        long pid = 1;
+#ifndef _WIN32
+        pid = (long)getpid();
+#endif
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        written = 0;
+        out << fixed << setprecision(3);
+        for (const auto& buffer : all) {
+            uint64_t head = buffer->head.load(memory_order_acquire);
+            uint64_t first = head > CAPACITY ? head - CAPACITY : 0;
+            vector<tuple<const char*, uint64_t, uint64_t>> spans;
+            for (uint64_t i = first; i < head; i++) {
+                const Event& event = buffer->events[i % CAPACITY];
+                spans.emplace_back(event.name.load(memory_order_relaxed), event.start.load(memory_order_relaxed),
+                                   event.duration.load(memory_order_relaxed));
+            }
+            // The slot being written now holds span head - CAPACITY
+            uint64_t after = buffer->head.load(memory_order_acquire);
+            uint64_t valid = after >= CAPACITY ? after - CAPACITY + 1 : 0;
+            for (uint64_t i = first; i < head; i++) {
+                if (i < valid) continue;
+                const auto& span = spans[i - first];
+                out << (written++ ? "," : "") << "\n{\"name\":\"" << get<0>(span)
+                    << "\",\"cat\":\"expense-tracker\",\"ph\":\"X\",\"ts\":" << get<1>(span) / 1000.0
+                    << ",\"dur\":" << get<2>(span) / 1000.0 << ",\"pid\":" << pid
+                    << ",\"tid\":" << buffer->thread << "}";
+            }
+        }
+        out << "\n]}\n";
+        return out.good();
+    }
+};
+
+// Records one span from construction to destruction
+class TraceSpan {
+private:
+    const char* name;
+    uint64_t start;
+    
+public:
+    explicit TraceSpan(const char* span) : name(span), start(TraceLog::now()) {}
+    
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+    
+    ~TraceSpan() { TraceLog::record(name, start, TraceLog::now()); }
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+#else
+#define TRACE_SPAN(name) do {} while (false)
+#endif
+
 // Utility class for input validation, formatting, and utility functions
 class Validator {
 public:
@@ -94,6 +679,21 @@ public:
         return result;
     }
     
+    // Case-insensitive comparisons that do not build lowered copies
+    static bool equalsIgnoreCase(string_view a, string_view b) {
+        return a.size() == b.size() &&
+               equal(a.begin(), a.end(), b.begin(), [](unsigned char x, unsigned char y) {
+                   return tolower(x) == tolower(y);
+               });
+    }
+    
+    static bool containsIgnoreCase(string_view text, string_view needle) {
+        return search(text.begin(), text.end(), needle.begin(), needle.end(),
+                      [](unsigned char x, unsigned char y) {
+                          return tolower(x) == tolower(y);
+                      }) != text.end();
+    }
+    
     // Format currency display
     static string formatCurrency(double amount) {
         stringstream ss;
@@ -103,15 +703,196 @@ public:
     
     // Calculate days between two dates
     static int daysBetweenDates(const string& date1, const string& date2) {
-        // Simple implementation - can be enhanced with proper date library
-        return abs(stoi(date1.substr(8, 2)) - stoi(date2.substr(8, 2)));
+        return abs(dayNumber(date1) - dayNumber(date2));
+    }
+    
+    // Days from 1970-01-01 to a valid YYYY-MM-DD date (proleptic Gregorian)
+    static int dayNumber(const string& date) {
+        int year = atoi(date.c_str()), month = atoi(date.c_str() + 5), day = atoi(date.c_str() + 8);
+        return dayNumber(year, month, day);
+    }
+    
+    static int dayNumber(int year, int month, int day) {
+        year -= (month <= 2);
+        int era = (year >= 0 ? year : year - 399) / 400;
+        int yearOfEra = year - era * 400;
+        int dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+        int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+        return era * 146097 + dayOfEra - 719468;
+    }
+    
+    // Year, month and day of a day number
+    static void civilDate(int days, int& year, int& month, int& day) {
+        days += 719468;
+        int era = (days >= 0 ? days : days - 146096) / 146097;
+        int dayOfEra = days - era * 146097;
+        int yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+        int dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+        int shifted = (5 * dayOfYear + 2) / 153;
+        day = dayOfYear - (153 * shifted + 2) / 5 + 1;
+        month = shifted < 10 ? shifted + 3 : shifted - 9;
+        year = yearOfEra + era * 400 + (month <= 2);
+    }
+    
+    // YYYY-MM-DD for a day number
+    static string dateOf(int days) {
+        int year, month, day;
+        civilDate(days, year, month, day);
+        char text[40];
+        snprintf(text, sizeof(text), "%04d-%02d-%02d", year, month, day);
+        return text;
+    }
+    
+    // 0 = Sunday ... 6 = Saturday
+    static int weekday(int days) {
+        return ((days + 4) % 7 + 7) % 7;
+    }
+    
+    static int daysInMonth(int year, int month) {
+        static const int lengths[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+        return (month == 2 && isLeapYear(year)) ? 29 : lengths[month - 1];
+    }
+};
+
+// Buffered table formatter: rows are formatted into a single buffer using
+// column widths fixed up front, and written to the stream with one flush
+class TableRenderer {
+public:
+    struct Column {
+        string title;       // Header text
+        size_t width;       // Padded cell width
+        bool truncate;      // Cut text to width - 1 so columns never touch
+    };
+    
+private:
+    vector<Column> columns;
+    string buffer;          // Formatted output waiting to be flushed
+    size_t lineWidth;       // Sum of column widths (precomputed)
+    size_t current;         // Index of the next cell in the current row
+    size_t rowCount;        // Number of data rows formatted
+    
+    void appendCell(const char* text, size_t length) {
+        const Column& column = columns[current < columns.size() ? current : columns.size() - 1];
+        if (column.truncate && length >= column.width) {
+            length = column.width - 1;
+        }
+        buffer.append(text, length);
+        if (length < column.width) {
+            buffer.append(column.width - length, ' ');
+        }
+        current++;
+    }
+    
+public:
+    TableRenderer(const vector<Column>& cols, size_t expectedRows = 0)
+        : columns(cols), lineWidth(0), current(0), rowCount(0) {
+        for (const auto& column : columns) {
+            lineWidth += column.width;
+        }
+        buffer.reserve((expectedRows + 2) * (lineWidth + 1));
+    }
+    
+    // Header row, followed by a dashed rule when ruleWidth is non-zero
+    void header(size_t ruleWidth = 0) {
+        for (const auto& column : columns) {
+            appendCell(column.title.data(), column.title.size());
+        }
+        buffer += '\n';
+        current = 0;
+        if (ruleWidth > 0) {
+            buffer.append(ruleWidth, '-');
+            buffer += '\n';
+        }
+    }
+    
+    TableRenderer& cell(const string& text) {
+        appendCell(text.data(), text.size());
+        return *this;
+    }
+    
+    TableRenderer& cell(const char* text) {
+        appendCell(text, strlen(text));
+        return *this;
+    }
+    
+    TableRenderer& cell(int value) {
+        char text[16];
+        int length = snprintf(text, sizeof(text), "%d", value);
+        appendCell(text, (size_t)length);
+        return *this;
+    }
+    
+    // Same text as Validator::formatCurrency without a stringstream per cell
+    TableRenderer& currency(double amount) {
+        char text[48];
+        int length = snprintf(text, sizeof(text), "$%.2f", amount);
+        appendCell(text, (size_t)length);
+        return *this;
+    }
+    
+    void endRow() {
+        buffer += '\n';
+        current = 0;
+        rowCount++;
+    }
+    
+    // Append free-form text (section titles, footers) to the buffer
+    void text(const string& line) {
+        buffer += line;
+    }
+    
+    size_t rows() const { return rowCount; }
+    
+    // Write everything formatted so far with a single flush
+    void flush(ostream& out = cout) {
+        out.write(buffer.data(), buffer.size());
+        out.flush();
+        buffer.clear();
+    }
+};
+
+// Paging applied to table listings (--page / --limit on the command line)
+struct ListingOptions {
+    size_t page = 1;        // 1-based page number
+    size_t limit = 0;       // Rows per page, 0 shows everything
+    
+    // Row window [begin, end) of the current page for a listing of total rows
+    pair<size_t, size_t> window(size_t total) const {
+        if (limit == 0) return make_pair((size_t)0, total);
+        // Pages past the end are empty; checked before multiplying so a huge page cannot wrap
+        if (page - 1 > total / limit) return make_pair(total, total);
+        size_t begin = min(total, (page - 1) * limit);
+        return make_pair(begin, begin + min(total - begin, limit));
+    }
+    
+    // Footer describing the visible window, empty when not paging
+    string describe(size_t total) const {
+        if (limit == 0) return "";
+        pair<size_t, size_t> range = window(total);
+        size_t pages = (total + limit - 1) / limit;
+        stringstream ss;
+        if (range.first == range.second) {
+            ss << "Page " << page << " is empty (" << pages << " page(s) of " << limit << " rows)\n";
+        } else {
+            ss << "Showing rows " << (range.first + 1) << "-" << range.second << " of " << total
+               << " (page " << page << " of " << pages << ")\n";
+        }
+        return ss.str();
     }
 };
 
+// Sort orders offered by expense listings
+enum class SortKey {
+    Date,       // Most recent first
+    Amount,     // Highest first
+    Category,   // Alphabetical
+    Id          // Insertion order
+};
+
 // Enhanced Expense class with additional features
 class Expense {
 private:
-    static int nextId;          // Auto-incrementing ID generator
+    static atomic<int> nextId;  // Auto-incrementing ID generator, shared by all threads
     int id;                     // Unique identifier for each expense
     string description;         // Description of the expense
     double amount;              // Amount spent
@@ -139,19 +920,27 @@ public:
             const string& payment = "Cash", const string& loc = "")
         : id(expId), description(desc), amount(amt), category(cat), date(dt),
           notes(nt), isRecurring(recurring), paymentMethod(payment), location(loc) {
-        if (id >= nextId) nextId = id + 1;
+        reserveId(id);
     }
     
     // Getters - provide read access to private members
     int getId() const { return id; }
-    string getDescription() const { return description; }
+    const string& getDescription() const { return description; }
     double getAmount() const { return amount; }
-    string getCategory() const { return category; }
-    string getDate() const { return date; }
-    string getNotes() const { return notes; }
+    const string& getCategory() const { return category; }
+    const string& getDate() const { return date; }
+    const string& getNotes() const { return notes; }
     bool getIsRecurring() const { return isRecurring; }
-    string getPaymentMethod() const { return paymentMethod; }
-    string getLocation() const { return location; }
+    
+    // Visit every text field (memory accounting)
+    template <typename Visit>
+    void forEachText(Visit visit) const {
+        for (const string* text : {&description, &category, &date, &notes, &paymentMethod, &location}) {
+            visit(*text);
+        }
+    }
+    const string& getPaymentMethod() const { return paymentMethod; }
+    const string& getLocation() const { return location; }
     
     // Setters with validation - provide controlled write access
     void setDescription(const string& desc) {
@@ -197,48 +986,54 @@ public:
         return ss.str();
     }
     
-    // Deserialize expense from string (file loading)
-    static Expense fromString(const string& str) {
-        stringstream ss(str);
-        string token;
-        vector<string> tokens;
-        
-        while (getline(ss, token, '|')) {
-            tokens.push_back(token);
+    // Deserialize expense from string (file loading). Fields are sliced out
+    // of the row in place, so the only allocations are the member strings
+    // that do not fit the small-string buffer.
+    static Expense fromString(string_view str) {
+        string_view fields[9];
+        size_t count = 0;
+        while (count < 9) {
+            size_t bar = str.find('|');
+            fields[count++] = str.substr(0, bar);
+            if (bar == string_view::npos) break;
+            str.remove_prefix(bar + 1);
         }
-        
-        if (tokens.size() >= 9) {
-            try {
-                int id = stoi(tokens[0]);
-                double amount = stod(tokens[2]);
-                bool recurring = (tokens[6] == "1");
-                return Expense(id, tokens[1], amount, tokens[3], tokens[4], 
-                             tokens[5], recurring, tokens[7], tokens[8]);
-            } catch (const exception&) {
-                return Expense();
-            }
-        } else if (tokens.size() >= 5) {
+        if (count < 5) return Expense();
+        
+        Expense expense;
+        double amount = 0;
+        const char* amountEnd = fields[2].data() + fields[2].size();
+        if (from_chars(fields[0].data(), fields[0].data() + fields[0].size(), expense.id).ec != errc() ||
+            from_chars(fields[2].data(), amountEnd, amount).ec != errc()) {
+            return Expense();
+        }
+        expense.description.assign(fields[1]);
+        expense.amount = amount;
+        expense.category.assign(fields[3]);
+        expense.date.assign(fields[4]);
+        if (count >= 9) {
+            expense.notes.assign(fields[5]);
+            expense.isRecurring = (fields[6] == "1");
+            expense.paymentMethod.assign(fields[7]);
+            expense.location.assign(fields[8]);
+        } else {
             // Backward compatibility with old format
-            try {
-                int id = stoi(tokens[0]);
-                double amount = stod(tokens[2]);
-                return Expense(id, tokens[1], amount, tokens[3], tokens[4]);
-            } catch (const exception&) {
-                return Expense();
-            }
+            expense.paymentMethod = "Cash";
         }
-        return Expense();
+        reserveId(expense.id);
+        return expense;
     }
     
-    // Display expense in tabular format
-    void display() const {
-        cout << left << setw(5) << id 
-             << setw(20) << description.substr(0, 19)
-             << setw(10) << Validator::formatCurrency(amount)
-             << setw(12) << category.substr(0, 11)
-             << setw(12) << date 
-             << setw(8) << paymentMethod.substr(0, 7)
-             << setw(3) << (isRecurring ? "Y" : "N") << endl;
+    // Append expense as one row of the standard expense table
+    void display(TableRenderer& table) const {
+        table.cell(id)
+             .cell(description)
+             .currency(amount)
+             .cell(category)
+             .cell(date)
+             .cell(paymentMethod)
+             .cell(isRecurring ? "Y" : "N");
+        table.endRow();
     }
     
     // Display detailed expense information
@@ -258,6 +1053,17 @@ public:
         cout << "----------------------\n";
     }
     
+    // Make sure new IDs come after an existing one that was not loaded
+    static void reserveId(int existingId) {
+        int current = nextId.load(memory_order_relaxed);
+        while (existingId >= current && !nextId.compare_exchange_weak(current, existingId + 1)) {}
+    }
+    
+    // Reserve count consecutive new IDs in one step; returns the first
+    static int reserveIds(int count) {
+        return nextId.fetch_add(count) + 1;
+    }
+    
     // Create a copy of the expense (for duplicate feature)
     Expense createCopy() const {
         Expense copy(description + " (Copy)", amount, category, Validator::getCurrentDate());
@@ -269,55 +1075,5162 @@ public:
     }
 };
 
-int Expense::nextId = 1;
+atomic<int> Expense::nextId{1};
 
-// Enhanced ExpenseManager class with advanced features
-class ExpenseManager {
+// CRC-32C (Castagnoli) checksums for ledger blocks. Uses the SSE4.2 crc32
+// instruction when the CPU has it and a lookup table otherwise.
+class Crc32c {
 private:
-    vector<Expense> expenses;           // Main storage for expenses
-    stack<vector<Expense>> undoStack;   // For undo functionality (NEW)
-    stack<vector<Expense>> redoStack;   // For redo functionality (NEW)
-    string filename;                    // File for data persistence
-    set<string> categories;             // Track unique categories (NEW)
-    map<string, int> categoryCount;     // Category usage statistics (NEW)
-    
-    // Enhanced input helper methods
-    string getStringInput(const string& prompt, bool allowEmpty = false) {
-        string input;
-        while (true) {
-            cout << prompt;
-            getline(cin, input);
-            input = Validator::trim(input);
-            
-            if (!input.empty() || allowEmpty) {
-                return input;
+    struct Table {
+        uint32_t entries[256];
+        Table() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t crc = i;
+                for (int bit = 0; bit < 8; bit++) {
+                    crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78u : crc >> 1;
+                }
+                entries[i] = crc;
             }
-            cout << "Error: Input cannot be empty. Please try again.\n";
         }
+    };
+    
+    static const uint32_t* table() {
+        static const Table instance;    // Thread-safe one-time initialisation
+        return instance.entries;
     }
     
-    double getAmountInput(const string& prompt) {
-        string input;
-        while (true) {
-            cout << prompt;
-            getline(cin, input);
-            input = Validator::trim(input);
-            
-            if (Validator::isValidAmount(input)) {
-                return stod(input);
-            }
-            cout << "Error: Please enter a valid positive amount (e.g., 10.50).\n";
+    static uint32_t software(uint32_t crc, const char* data, size_t length) {
+        const uint32_t* entries = table();
+        for (size_t i = 0; i < length; i++) {
+            crc = entries[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
         }
+        return crc;
     }
     
-    string getDateInput(const string& prompt) {
-        string input;
-        while (true) {
-            cout << prompt << " (YYYY-MM-DD) or press Enter for today: ";
-            getline(cin, input);
-            input = Validator::trim(input);
-            
-            if (input.empty()) {
+#if defined(__GNUC__) && defined(__x86_64__)
+    __attribute__((target("sse4.2")))
+    static uint32_t hardware(uint32_t crc, const char* data, size_t length) {
+        uint64_t crc64 = crc;
+        while (length >= 8) {
+            uint64_t word;
+            memcpy(&word, data, 8);
+            crc64 = __builtin_ia32_crc32di(crc64, word);
+            data += 8;
+            length -= 8;
+        }
+        crc = (uint32_t)crc64;
+        while (length > 0) {
+            crc = __builtin_ia32_crc32qi(crc, (unsigned char)*data++);
+            length--;
+        }
+        return crc;
+    }
+    
+    static bool hardwareAvailable() {
+        static const bool available = __builtin_cpu_supports("sse4.2");
+        return available;
+    }
+#endif
+    
+public:
+    static uint32_t compute(const char* data, size_t length) {
+        uint32_t crc = 0xFFFFFFFFu;
+#if defined(__GNUC__) && defined(__x86_64__)
+        if (hardwareAvailable()) {
+            return hardware(crc, data, length) ^ 0xFFFFFFFFu;
+        }
+#endif
+        return software(crc, data, length) ^ 0xFFFFFFFFu;
+    }
+};
+
+// On-disk ledger format. Rows are grouped into checksummed blocks:
+//
+//   #EXPENSES 2
+//   #BLOCK <index> <rows> <crc32c of the rows' bytes, hex>
+//   <rows...>
+//   #END <blocks> <rows>
+//
+// Files without the header are the original one-row-per-line format and
+// are still accepted. Saves go to a temporary file that is fsynced and
+// renamed over the ledger, so a crash leaves either the old or new file.
+class LedgerFile {
+public:
+    static const size_t ROWS_PER_BLOCK = 4096;
+    
+    // A block whose contents could not be verified during load
+    struct BlockFailure {
+        size_t block;           // Block index as written in the file
+        size_t firstLine;       // 1-based line range of the block's rows
+        size_t lastLine;
+        string reason;
+    };
+    
+    // Rows are views into the parsed contents, which must outlive the result
+    struct ReadResult {
+        vector<string_view> rows;           // Rows from verified blocks
+        vector<string_view> rejectedRows;   // Rows from blocks that failed
+        vector<BlockFailure> failures;
+        bool legacy = false;            // File had no block structure
+        bool complete = true;           // #END trailer found and consistent
+    };
+    
+    // Builds the block-structured file contents row by row
+    class Encoder {
+    private:
+        string output;
+        string block;
+        size_t blockRows;
+        size_t blocks;
+        size_t totalRows;
+        
+        void closeBlock() {
+            if (blockRows == 0) return;
+            char marker[64];
+            snprintf(marker, sizeof(marker), "#BLOCK %zu %zu %08x\n", blocks, blockRows,
+                     Crc32c::compute(block.data(), block.size()));
+            output += marker;
+            output += block;
+            block.clear();
+            blockRows = 0;
+            blocks++;
+        }
+        
+    public:
+        Encoder() : output("#EXPENSES 2\n"), blockRows(0), blocks(0), totalRows(0) {}
+        
+        void add(const string& row) {
+            block += row;
+            block += '\n';
+            totalRows++;
+            if (++blockRows == ROWS_PER_BLOCK) closeBlock();
+        }
+        
+        string finish() {
+            closeBlock();
+            output += "#END " + to_string(blocks) + " " + to_string(totalRows) + "\n";
+            return move(output);
+        }
+    };
+    
+    // Write contents to path via temp file + fsync + rename
+    static bool writeAtomic(const string& path, const string& contents) {
+        TRACE_SPAN("file: write");
+        string temp = path + ".tmp";
+        RuntimeMetrics::add(RuntimeMetrics::bytesWritten, contents.size());
+#ifdef _WIN32
+        {
+            ofstream file(temp, ios::binary | ios::trunc);
+            if (!file.is_open()) return false;
+            file.write(contents.data(), contents.size());
+            file.flush();
+            if (file.fail()) return false;
+        }
+        remove(path.c_str());
+        return rename(temp.c_str(), path.c_str()) == 0;
+#else
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        
+        size_t written = 0;
+        while (written < contents.size()) {
+            ssize_t n = ::write(fd, contents.data() + written, contents.size() - written);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                ::close(fd);
+                ::unlink(temp.c_str());
+                return false;
+            }
+            written += (size_t)n;
+        }
+        if (::fsync(fd) != 0) {
+            ::close(fd);
+            ::unlink(temp.c_str());
+            return false;
+        }
+        ::close(fd);
+        
+        if (::rename(temp.c_str(), path.c_str()) != 0) {
+            ::unlink(temp.c_str());
+            return false;
+        }
+        
+        // Make the rename itself durable
+        size_t slash = path.find_last_of('/');
+        string directory = (slash == string::npos) ? "." : path.substr(0, slash + 1);
+        int dirFd = ::open(directory.c_str(), O_RDONLY);
+        if (dirFd >= 0) {
+            ::fsync(dirFd);
+            ::close(dirFd);
+        }
+        return true;
+#endif
+    }
+    
+    // Append contents to path and fsync it. On failure the file is cut
+    // back to its old length so no partial line is left behind.
+    static bool appendDurable(const string& path, const string& contents) {
+        TRACE_SPAN("file: append");
+        RuntimeMetrics::add(RuntimeMetrics::bytesWritten, contents.size());
+#ifdef _WIN32
+        ofstream file(path, ios::app | ios::binary);
+        if (!file.is_open()) return false;
+        file.write(contents.data(), contents.size());
+        file.flush();
+        return !file.fail();
+#else
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) return false;
+        off_t original = ::lseek(fd, 0, SEEK_END);
+        
+        size_t written = 0;
+        bool ok = original >= 0;
+        while (ok && written < contents.size()) {
+            ssize_t n = ::write(fd, contents.data() + written, contents.size() - written);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                ok = false;
+                break;
+            }
+            written += (size_t)n;
+        }
+        if (ok && ::fsync(fd) != 0) ok = false;
+        if (!ok && original >= 0 && ::ftruncate(fd, original) == 0) ::fsync(fd);
+        ::close(fd);
+        return ok;
+#endif
+    }
+    
+    // Read the whole file; returns false if it could not be opened
+    static bool readAll(const string& path, string& contents) {
+        TRACE_SPAN("file: read");
+        ifstream file(path, ios::binary);
+        if (!file.is_open()) return false;
+        stringstream buffer;
+        buffer << file.rdbuf();
+        contents = buffer.str();
+        return true;
+    }
+    
+    // Parse ledger contents, verifying every block checksum
+    static ReadResult parse(const string& contents) {
+        TRACE_SPAN("file: verify blocks");
+        ReadResult result;
+        size_t pos = 0;
+        size_t lineNo = 0;
+        
+        auto nextLine = [&](string_view& line) {
+            if (pos >= contents.size()) return false;
+            size_t end = contents.find('\n', pos);
+            if (end == string::npos) end = contents.size();
+            line = string_view(contents).substr(pos, end - pos);
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            pos = end + 1;
+            lineNo++;
+            return true;
+        };
+        
+        string_view line;
+        if (contents.compare(0, 11, "#EXPENSES 2") != 0) {
+            result.legacy = true;
+            while (nextLine(line)) {
+                if (!line.empty()) result.rows.push_back(line);
+            }
+            return result;
+        }
+        nextLine(line);
+        
+        size_t blocks = 0, rows = 0;
+        bool sawEnd = false;
+        while (pos < contents.size()) {
+            size_t markerLine = lineNo + 1;
+            nextLine(line);
+            if (line.empty()) continue;
+            
+            string marker(line);
+            size_t endBlocks = 0, endRows = 0;
+            if (sscanf(marker.c_str(), "#END %zu %zu", &endBlocks, &endRows) == 2) {
+                sawEnd = true;
+                result.complete = (endBlocks == blocks && endRows == rows);
+                break;
+            }
+            
+            size_t index = 0, count = 0;
+            unsigned int expected = 0;
+            if (sscanf(marker.c_str(), "#BLOCK %zu %zu %x", &index, &count, &expected) != 3) {
+                // Stray line outside any block: resynchronise on the next marker
+                BlockFailure failure = {blocks, markerLine, markerLine, "unexpected data outside a block"};
+                result.failures.push_back(failure);
+                if (line[0] != '#') result.rejectedRows.push_back(line);
+                continue;
+            }
+            
+            // The block's rows run until the next marker line
+            size_t start = pos;
+            vector<string_view> blockRows;
+            while (pos < contents.size() && contents[pos] != '#') {
+                nextLine(line);
+                blockRows.push_back(line);
+            }
+            uint32_t actual = Crc32c::compute(contents.data() + start, pos - start);
+            
+            blocks++;
+            rows += blockRows.size();
+            if (blockRows.size() != count || actual != expected) {
+                BlockFailure failure = {index, markerLine + 1, markerLine + blockRows.size(),
+                    blockRows.size() != count
+                        ? "expected " + to_string(count) + " rows, found " + to_string(blockRows.size())
+                        : "checksum mismatch"};
+                result.failures.push_back(failure);
+                result.rejectedRows.insert(result.rejectedRows.end(), blockRows.begin(), blockRows.end());
+            } else {
+                result.rows.insert(result.rows.end(), blockRows.begin(), blockRows.end());
+            }
+        }
+        
+        if (!sawEnd) result.complete = false;
+        return result;
+    }
+    
+    // Describe blocks that failed verification and keep their raw rows in a
+    // side file so nothing is lost when the ledger is next rewritten
+    static void reportRecovery(const string& source, const ReadResult& result) {
+        if (!result.complete) {
+            cout << "Warning: " << source << " is truncated (missing or inconsistent end marker).\n";
+        }
+        if (result.failures.empty()) return;
+        
+        cout << "Warning: " << source << ": " << result.failures.size() << " block(s) failed verification:\n";
+        for (const auto& failure : result.failures) {
+            cout << "  Block " << failure.block << " (lines " << failure.firstLine
+                 << "-" << failure.lastLine << "): " << failure.reason << "\n";
+        }
+        
+        if (result.rejectedRows.empty()) return;
+        string recoveryFile = source + ".recovered." + to_string(time(0));
+        ofstream recovery(recoveryFile);
+        if (!recovery.is_open()) {
+            cout << "Error: Could not write unverified rows to " << recoveryFile << "\n";
+            return;
+        }
+        for (const auto& row : result.rejectedRows) {
+            recovery << row << '\n';
+        }
+        cout << result.rejectedRows.size() << " unverified row(s) were not loaded; they were saved to "
+             << recoveryFile << " for manual review.\n";
+    }
+};
+
+// Time period each ledger segment covers
+enum class PartitionPeriod {
+    Month,      // 2024-03
+    Quarter,    // 2024-Q1
+    Year        // 2024
+};
+
+// Maps expense dates to partition keys for the configured period
+struct PartitionScheme {
+    PartitionPeriod period = PartitionPeriod::Month;
+    
+    string keyFor(const string& date) const {
+        if (date.size() < 7 || date[4] != '-') return "undated";
+        switch (period) {
+            case PartitionPeriod::Month:
+                return date.substr(0, 7);
+            case PartitionPeriod::Quarter: {
+                int month = atoi(date.c_str() + 5);
+                if (month < 1 || month > 12) return "undated";
+                return date.substr(0, 4) + "-Q" + to_string((month - 1) / 3 + 1);
+            }
+            case PartitionPeriod::Year:
+                return date.substr(0, 4);
+        }
+        return "undated";
+    }
+    
+    string name() const {
+        switch (period) {
+            case PartitionPeriod::Month: return "month";
+            case PartitionPeriod::Quarter: return "quarter";
+            case PartitionPeriod::Year: return "year";
+        }
+        return "month";
+    }
+    
+    static bool parse(const string& text, PartitionScheme& scheme) {
+        string value = Validator::toLower(text);
+        if (value == "month") scheme.period = PartitionPeriod::Month;
+        else if (value == "quarter") scheme.period = PartitionPeriod::Quarter;
+        else if (value == "year") scheme.period = PartitionPeriod::Year;
+        else return false;
+        return true;
+    }
+};
+
+// Per-segment metadata kept in the manifest and used to skip segments
+struct SegmentInfo {
+    string key;
+    unsigned long long file = 0;    // Version in the file name (see LedgerManifest); kept by clear()
+    size_t rows = 0;
+    string minDate, maxDate;
+    double minAmount = 0, maxAmount = 0;
+    double total = 0;
+    int minId = 0, maxId = 0;
+    
+    void clear() {
+        rows = 0;
+        minDate.clear();
+        maxDate.clear();
+        minAmount = maxAmount = total = 0;
+        minId = maxId = 0;
+    }
+    
+    void add(const Expense& expense) {
+        const string& date = expense.getDate();
+        double amount = expense.getAmount();
+        int id = expense.getId();
+        if (rows == 0) {
+            minDate = maxDate = date;
+            minAmount = maxAmount = amount;
+            minId = maxId = id;
+        } else {
+            if (date < minDate) minDate = date;
+            if (date > maxDate) maxDate = date;
+            minAmount = min(minAmount, amount);
+            maxAmount = max(maxAmount, amount);
+            minId = min(minId, id);
+            maxId = max(maxId, id);
+        }
+        total += amount;
+        rows++;
+    }
+    
+    // Take a row out. The date, amount and ID bounds are left as they are:
+    // they only serve to skip segments, and bounds that are too wide never
+    // skip one wrongly, so a removal needs no rescan.
+    void remove(const Expense& expense) {
+        if (--rows == 0) {
+            string segmentKey = key;
+            clear();
+            key = segmentKey;
+            return;
+        }
+        total -= expense.getAmount();
+    }
+    
+    // Could the segment hold this ID? Used to load as few segments as possible
+    bool mayContain(int id) const {
+        return rows > 0 && id >= minId && id <= maxId;
+    }
+};
+
+// Date and amount bounds of a scan; empty dates mean unbounded
+struct ScanBounds {
+    string fromDate, toDate;
+    double minAmount = 0;
+    double maxAmount = DBL_MAX;
+    
+    static ScanBounds dates(const string& from, const string& to) {
+        ScanBounds bounds;
+        bounds.fromDate = from;
+        bounds.toDate = to;
+        return bounds;
+    }
+    
+    static ScanBounds amounts(double low, double high) {
+        ScanBounds bounds;
+        bounds.minAmount = low;
+        bounds.maxAmount = high;
+        return bounds;
+    }
+    
+    // Could any row of the segment fall inside the bounds?
+    bool overlaps(const SegmentInfo& info) const {
+        if (info.rows == 0) return false;
+        if (!fromDate.empty() && info.maxDate < fromDate) return false;
+        if (!toDate.empty() && info.minDate > toDate) return false;
+        return info.maxAmount >= minAmount && info.minAmount <= maxAmount;
+    }
+    
+    bool contains(const Expense& expense) const {
+        if (!fromDate.empty() && expense.getDate() < fromDate) return false;
+        if (!toDate.empty() && expense.getDate() > toDate) return false;
+        return expense.getAmount() >= minAmount && expense.getAmount() <= maxAmount;
+    }
+};
+
+// Totals behind the summary report. Kept per segment in the manifest and
+// per sealed archive in its footer, so summaries and category statistics
+// merge them without loading or decompressing any rows.
+struct LedgerAggregates {
+    struct Bucket {
+        int count = 0;
+        double total = 0;
+    };
+    
+    size_t count = 0;
+    double total = 0;
+    double minAmount = 0, maxAmount = 0;
+    string minDescription, maxDescription;
+    map<string, Bucket> categories;
+    map<string, Bucket> payments;
+    map<string, double> months;             // YYYY-MM -> total
+    int recurringCount = 0;
+    double recurringTotal = 0;
+    
+    void add(const Expense& expense) {
+        double amount = expense.getAmount();
+        if (count == 0 || amount > maxAmount) {
+            maxAmount = amount;
+            maxDescription = expense.getDescription();
+        }
+        if (count == 0 || amount < minAmount) {
+            minAmount = amount;
+            minDescription = expense.getDescription();
+        }
+        count++;
+        total += amount;
+        
+        Bucket& category = categories[expense.getCategory()];
+        category.count++;
+        category.total += amount;
+        Bucket& payment = payments[expense.getPaymentMethod()];
+        payment.count++;
+        payment.total += amount;
+        months[expense.getDate().substr(0, 7)] += amount;
+        
+        if (expense.getIsRecurring()) {
+            recurringCount++;
+            recurringTotal += amount;
+        }
+    }
+    
+    // Take a row out again. Returns false when the row held the lowest or
+    // highest amount, which the caller must then find among the remaining
+    // rows with rescanExtreme().
+    bool remove(const Expense& expense) {
+        double amount = expense.getAmount();
+        if (--count == 0) {
+            *this = LedgerAggregates();
+            return true;
+        }
+        total -= amount;
+        
+        auto takeOut = [amount](map<string, Bucket>& buckets, const string& key) {
+            auto bucket = buckets.find(key);
+            if (bucket == buckets.end()) return;
+            if (--bucket->second.count == 0) buckets.erase(bucket);
+            else bucket->second.total -= amount;
+        };
+        takeOut(categories, expense.getCategory());
+        takeOut(payments, expense.getPaymentMethod());
+        auto month = months.find(expense.getDate().substr(0, 7));
+        if (month != months.end() && fabs(month->second -= amount) < 0.005) months.erase(month);
+        
+        if (expense.getIsRecurring()) {
+            recurringCount--;
+            recurringTotal -= amount;
+        }
+        return amount != minAmount && amount != maxAmount;
+    }
+    
+    // Recompute the lowest and highest amount from the rows, counts intact
+    template <typename Rows>
+    void rescanExtreme(const Rows& rows) {
+        bool first = true;
+        for (const auto& expense : rows) {
+            double amount = expense.getAmount();
+            if (first || amount > maxAmount) {
+                maxAmount = amount;
+                maxDescription = expense.getDescription();
+            }
+            if (first || amount < minAmount) {
+                minAmount = amount;
+                minDescription = expense.getDescription();
+            }
+            first = false;
+        }
+    }
+    
+    void merge(const LedgerAggregates& other) {
+        if (other.count == 0) return;
+        if (count == 0 || other.maxAmount > maxAmount) {
+            maxAmount = other.maxAmount;
+            maxDescription = other.maxDescription;
+        }
+        if (count == 0 || other.minAmount < minAmount) {
+            minAmount = other.minAmount;
+            minDescription = other.minDescription;
+        }
+        count += other.count;
+        total += other.total;
+        for (const auto& entry : other.categories) {
+            categories[entry.first].count += entry.second.count;
+            categories[entry.first].total += entry.second.total;
+        }
+        for (const auto& entry : other.payments) {
+            payments[entry.first].count += entry.second.count;
+            payments[entry.first].total += entry.second.total;
+        }
+        for (const auto& entry : other.months) {
+            months[entry.first] += entry.second;
+        }
+        recurringCount += other.recurringCount;
+        recurringTotal += other.recurringTotal;
+    }
+    
+    // Pipe-separated lines, same conventions as the ledger rows
+    string encode() const {
+        stringstream ss;
+        ss << fixed << setprecision(2);
+        ss << "summary|" << count << "|" << total << "|" << recurringCount << "|" << recurringTotal << "\n";
+        ss << "lowest|" << minAmount << "|" << minDescription << "\n";
+        ss << "highest|" << maxAmount << "|" << maxDescription << "\n";
+        for (const auto& entry : categories) {
+            ss << "category|" << entry.first << "|" << entry.second.count << "|" << entry.second.total << "\n";
+        }
+        for (const auto& entry : payments) {
+            ss << "payment|" << entry.first << "|" << entry.second.count << "|" << entry.second.total << "\n";
+        }
+        for (const auto& entry : months) {
+            ss << "month|" << entry.first << "|" << entry.second << "\n";
+        }
+        return ss.str();
+    }
+    
+    bool decode(const string& text) {
+        *this = LedgerAggregates();
+        stringstream ss(text);
+        string line;
+        try {
+            while (getline(ss, line)) {
+                vector<string> fields;
+                stringstream parts(line);
+                string field;
+                while (getline(parts, field, '|')) fields.push_back(field);
+                if (fields.empty()) continue;
+                
+                if (fields[0] == "summary" && fields.size() >= 5) {
+                    count = (size_t)stoull(fields[1]);
+                    total = stod(fields[2]);
+                    recurringCount = stoi(fields[3]);
+                    recurringTotal = stod(fields[4]);
+                } else if ((fields[0] == "lowest" || fields[0] == "highest") && fields.size() >= 2) {
+                    string description = fields.size() >= 3 ? fields[2] : "";
+                    if (fields[0] == "lowest") {
+                        minAmount = stod(fields[1]);
+                        minDescription = description;
+                    } else {
+                        maxAmount = stod(fields[1]);
+                        maxDescription = description;
+                    }
+                } else if ((fields[0] == "category" || fields[0] == "payment") && fields.size() >= 4) {
+                    Bucket& bucket = (fields[0] == "category") ? categories[fields[1]] : payments[fields[1]];
+                    bucket.count = stoi(fields[2]);
+                    bucket.total = stod(fields[3]);
+                } else if (fields[0] == "month" && fields.size() >= 3) {
+                    months[fields[1]] = stod(fields[2]);
+                }
+            }
+        } catch (const exception&) {
+            return false;
+        }
+        return true;
+    }
+};
+
+// One day-by-day series of amounts. Amounts are kept in cents, so adding
+// and removing rows never drifts. Prefix sums make the total of any range
+// of days two lookups. A change marks the prefix sums stale from its day
+// on, and the next query brings them up to date. A run of changes to
+// recent days therefore costs one short pass.
+class DailySeries {
+private:
+    int first = 0;                          // Day number of totals[0]
+    vector<long long> totals;               // Cents per day
+    mutable vector<long long> prefix;       // prefix[i]: cents on the days before first + i
+    mutable size_t valid = 0;               // prefix[0..valid] are up to date
+    
+    void refresh() const {
+        prefix.resize(totals.size() + 1);
+        prefix[0] = 0;
+        for (size_t i = valid; i < totals.size(); i++) prefix[i + 1] = prefix[i] + totals[i];
+        valid = totals.size();
+    }
+    
+public:
+    void add(int day, long long cents) {
+        if (totals.empty()) {
+            first = day;
+            totals.assign(1, 0);
+        } else if (day < first) {
+            totals.insert(totals.begin(), first - day, 0);
+            first = day;
+            valid = 0;
+        } else if (day - first >= (int)totals.size()) {
+            totals.resize(day - first + 1, 0);
+        }
+        size_t index = day - first;
+        totals[index] += cents;
+        valid = min(valid, index);
+    }
+    
+    // Cents on the days from..to, inclusive
+    long long sum(int from, int to) const {
+        if (totals.empty()) return 0;
+        from = max(from, first);
+        to = min(to, first + (int)totals.size() - 1);
+        if (from > to) return 0;
+        if (valid < totals.size()) refresh();
+        return prefix[to - first + 1] - prefix[from - first];
+    }
+    
+    // Last day with a non-zero total; INT_MIN if there is none
+    int lastDay() const {
+        for (size_t i = totals.size(); i > 0; i--) {
+            if (totals[i - 1] != 0) return first + (int)i - 1;
+        }
+        return INT_MIN;
+    }
+};
+
+// Daily series of the whole ledger, per category and per payment method.
+// The store builds them on first use and applies every later change to
+// them, so range totals, rolling windows and period-over-period changes
+// never rescan rows. Rows whose date is not a valid YYYY-MM-DD are left out.
+struct LedgerTimeSeries {
+    DailySeries total;
+    map<string, DailySeries> categories;
+    map<string, DailySeries> payments;
+    
+    // Day number of a row's date, checked cheaply (no regex: runs per row)
+    static bool dayOf(const string& date, int& day) {
+        if (date.size() != 10 || date[4] != '-' || date[7] != '-') return false;
+        for (size_t i : {0, 1, 2, 3, 5, 6, 8, 9}) {
+            if (date[i] < '0' || date[i] > '9') return false;
+        }
+        int year = atoi(date.c_str()), month = atoi(date.c_str() + 5), monthDay = atoi(date.c_str() + 8);
+        if (month < 1 || month > 12 || monthDay < 1 || monthDay > Validator::daysInMonth(year, month)) {
+            return false;
+        }
+        day = Validator::dayNumber(year, month, monthDay);
+        return true;
+    }
+    
+    // Add a row (sign 1) or take it away again (sign -1)
+    void add(const Expense& expense, int sign) {
+        int day;
+        if (!dayOf(expense.getDate(), day)) return;
+        long long cents = llround(expense.getAmount() * 100) * sign;
+        total.add(day, cents);
+        categories[expense.getCategory()].add(day, cents);
+        payments[expense.getPaymentMethod()].add(day, cents);
+    }
+};
+
+// KLL quantile sketch (Karnin, Lang and Liberty) of amounts. Level h holds
+// values that stand for 2^h rows each. When the sketch outgrows its
+// capacity, the lowest full level is sorted and every other value moves up
+// a level, so it keeps a few hundred values however many rows it has seen,
+// and a quantile's rank is off by about 1% of the count at most. Sketches
+// merge by pooling their levels and compacting again. Which half of a
+// level moves up alternates rather than being random, so a report is the
+// same on every run.
+class QuantileSketch {
+private:
+    static const size_t K = 200;            // Capacity of the top level
+    
+    vector<vector<double>> levels;
+    size_t count = 0;                       // Rows seen
+    size_t stored = 0;                      // Values kept, all levels
+    size_t limit = 0;                       // Values kept before compacting
+    bool odd = false;                       // Half of the next level to move up
+    
+    size_t capacity(size_t level) const {
+        size_t depth = levels.size() - level - 1;
+        return max((size_t)2, (size_t)ceil(K * pow(2.0 / 3.0, (double)depth)));
+    }
+    
+    void grow() {
+        levels.emplace_back();
+        limit = 0;
+        for (size_t level = 0; level < levels.size(); level++) limit += capacity(level);
+    }
+    
+    // Halve the lowest full level into the one above
+    void compact() {
+        size_t level = 0;
+        while (levels[level].size() < capacity(level)) level++;
+        if (level + 1 == levels.size()) grow();
+        
+        vector<double>& values = levels[level];
+        sort(values.begin(), values.end());
+        size_t begin = values.size() % 2;   // An odd value out stays behind
+        vector<double>& above = levels[level + 1];
+        for (size_t i = begin + (odd ? 1 : 0); i < values.size(); i += 2) above.push_back(values[i]);
+        odd = !odd;
+        stored -= (values.size() - begin) / 2;
+        values.resize(begin);
+    }
+    
+public:
+    void add(double value) {
+        if (levels.empty()) grow();
+        levels[0].push_back(value);
+        count++;
+        stored++;
+        if (stored > limit) compact();
+    }
+    
+    void merge(const QuantileSketch& other) {
+        if (other.count == 0) return;
+        while (levels.size() < other.levels.size()) grow();
+        for (size_t level = 0; level < other.levels.size(); level++) {
+            levels[level].insert(levels[level].end(), other.levels[level].begin(), other.levels[level].end());
+        }
+        count += other.count;
+        stored += other.stored;
+        while (stored > limit) compact();
+    }
+    
+    size_t size() const { return count; }
+    
+    // Estimated q-quantile (0.5 is the median); 0 if the sketch is empty
+    double quantile(double q) const {
+        vector<pair<double, size_t>> weighted;
+        weighted.reserve(stored);
+        for (size_t level = 0; level < levels.size(); level++) {
+            for (double value : levels[level]) weighted.push_back(make_pair(value, (size_t)1 << level));
+        }
+        if (weighted.empty()) return 0;
+        sort(weighted.begin(), weighted.end());
+        
+        double rank = q * count;
+        size_t seen = 0;
+        for (const auto& entry : weighted) {
+            seen += entry.second;
+            if (seen >= rank) return entry.first;
+        }
+        return weighted.back().first;
+    }
+    
+    size_t bytes() const {
+        size_t size = sizeof(QuantileSketch);
+        for (const auto& level : levels) size += level.capacity() * sizeof(double) + sizeof(level);
+        return size;
+    }
+};
+
+// HyperLogLog distinct-value counter (Flajolet et al.): 4096 one-byte
+// registers, with a standard error of about 1.6%. A value's 64-bit hash
+// picks a register with its top 12 bits, which keeps the longest run of
+// leading zeros seen in the remaining bits. Counters merge by taking the
+// larger of each pair of registers, so a value present in several segments
+// is still counted once.
+class DistinctCounter {
+private:
+    static const int BITS = 12;
+    vector<uint8_t> registers;              // Empty until the first value
+    
+    // FNV-1a, then the SplitMix64 finalizer to spread the bits
+    static uint64_t hashOf(const string& value) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (unsigned char c : value) {
+            hash ^= c;
+            hash *= 1099511628211ULL;
+        }
+        hash ^= hash >> 30;
+        hash *= 0xbf58476d1ce4e5b9ULL;
+        hash ^= hash >> 27;
+        hash *= 0x94d049bb133111ebULL;
+        return hash ^ (hash >> 31);
+    }
+    
+public:
+    void add(const string& value) {
+        if (registers.empty()) registers.assign((size_t)1 << BITS, 0);
+        uint64_t hash = hashOf(value);
+        uint64_t rest = hash << BITS;
+        uint8_t rank = (rest == 0) ? (uint8_t)(64 - BITS + 1) : (uint8_t)(__builtin_clzll(rest) + 1);
+        uint8_t& slot = registers[hash >> (64 - BITS)];
+        slot = max(slot, rank);
+    }
+    
+    void merge(const DistinctCounter& other) {
+        if (other.registers.empty()) return;
+        if (registers.empty()) {
+            registers = other.registers;
+            return;
+        }
+        for (size_t i = 0; i < registers.size(); i++) registers[i] = max(registers[i], other.registers[i]);
+    }
+    
+    // Estimated number of distinct values added
+    size_t estimate() const {
+        if (registers.empty()) return 0;
+        double slots = (double)registers.size(), sum = 0;
+        size_t zeros = 0;
+        for (uint8_t rank : registers) {
+            sum += ldexp(1.0, -(int)rank);
+            if (rank == 0) zeros++;
+        }
+        double estimate = 0.7213 / (1 + 1.079 / slots) * slots * slots / sum;
+        if (estimate <= 2.5 * slots && zeros > 0) {
+            estimate = slots * log(slots / zeros);   // Few values: linear counting is closer
+        }
+        return (size_t)llround(estimate);
+    }
+    
+    size_t bytes() const { return sizeof(DistinctCounter) + registers.capacity(); }
+};
+
+// Sketches behind the summary's percentiles and distinct counts: amounts
+// overall and per category, and the distinct descriptions (merchants) and
+// locations. Each hot segment and archive gets its own, built from its rows
+// when a summary first needs it. Adds go straight into the segment's
+// sketches. Sketches cannot take a row out again, so an edit or delete
+// drops them and they are rebuilt from that segment alone.
+struct LedgerSketches {
+    QuantileSketch amounts;
+    map<string, QuantileSketch> categories;
+    DistinctCounter descriptions;
+    DistinctCounter locations;
+    
+    void add(const Expense& expense) {
+        amounts.add(expense.getAmount());
+        categories[expense.getCategory()].add(expense.getAmount());
+        descriptions.add(expense.getDescription());
+        if (!expense.getLocation().empty()) locations.add(expense.getLocation());
+    }
+    
+    void merge(const LedgerSketches& other) {
+        amounts.merge(other.amounts);
+        for (const auto& entry : other.categories) categories[entry.first].merge(entry.second);
+        descriptions.merge(other.descriptions);
+        locations.merge(other.locations);
+    }
+    
+    size_t bytes() const {
+        size_t size = sizeof(LedgerSketches) + amounts.bytes() + descriptions.bytes() + locations.bytes();
+        for (const auto& entry : categories) size += entry.first.capacity() + entry.second.bytes() + 64;
+        return size;
+    }
+};
+
+// The partitioned ledger's entry file. It lists every segment with its
+// metadata and summary aggregates, which is all that is read at startup;
+// the rows live in one LedgerFile per segment next to it, and sealed years
+// in one compressed LedgerArchive each:
+//
+//   #MANIFEST 2 <period> <generation>
+//   <key> <rows> <minDate> <maxDate> <minAmount> <maxAmount> <total> <minId> <maxId> <file>
+//   +<LedgerAggregates line of that segment>
+//   #ARCHIVE <year> <rows> <minDate> <maxDate> <minAmount> <maxAmount> <total> <minId> <maxId> <file>
+//   #END <segments + archives> <rows>
+//
+// The generation counts commits and, with the file's checksum, identifies
+// the ledger version that derived files such as the ID index belong to.
+// A segment is written to a new file named after the commit's generation
+// (expenses.txt.2024-02.17.seg) and files are never rewritten in place,
+// so renaming the manifest over the old one is the single commit point:
+// a crash before it leaves the last commit intact. File version 0 is the
+// unversioned name of older ledgers (expenses.txt.2024-02.seg).
+// Version 1 manifests lack the ID ranges and aggregates; their ledgers are
+// loaded whole and rewritten.
+class LedgerManifest {
+private:
+    static string encodeInfo(const SegmentInfo& info) {
+        char line[256];
+        snprintf(line, sizeof(line), "%s %zu %s %s %.2f %.2f %.2f %d %d %llu\n",
+                 info.key.c_str(), info.rows, info.minDate.c_str(), info.maxDate.c_str(),
+                 info.minAmount, info.maxAmount, info.total, info.minId, info.maxId, info.file);
+        return line;
+    }
+    
+    static bool parseInfo(stringstream& fields, SegmentInfo& info) {
+        if (!(fields >> info.key >> info.rows >> info.minDate >> info.maxDate
+                     >> info.minAmount >> info.maxAmount >> info.total)) {
+            return false;
+        }
+        if (!(fields >> info.minId >> info.maxId)) {
+            // Unknown range (version 1): any ID may be in the segment
+            info.minId = 0;
+            info.maxId = INT_MAX;
+        }
+        if (!(fields >> info.file)) info.file = 0;      // Unversioned file name
+        return true;
+    }
+    
+public:
+    static const int VERSION = 2;
+    
+    int version = VERSION;
+    unsigned long long generation = 0;
+    uint32_t checksum = 0;                      // CRC32C of the file as parsed
+    PartitionScheme scheme;
+    map<string, SegmentInfo> segments;
+    map<string, LedgerAggregates> aggregates;   // Per segment
+    map<string, SegmentInfo> archives;
+    
+    static bool isManifest(const string& contents) {
+        return contents.compare(0, 10, "#MANIFEST ") == 0;
+    }
+    
+    static string segmentFile(const string& ledger, const string& key, unsigned long long version) {
+        return ledger + "." + key + (version ? "." + to_string(version) : "") + ".seg";
+    }
+    
+    // Highest ID anywhere in the ledger, from metadata alone
+    int maxId() const {
+        int highest = 0;
+        for (const auto& entry : segments) highest = max(highest, entry.second.maxId);
+        for (const auto& entry : archives) highest = max(highest, entry.second.maxId);
+        return highest;
+    }
+    
+    string encode() const {
+        string out = "#MANIFEST " + to_string(VERSION) + " " + scheme.name() + " "
+                   + to_string(generation) + "\n";
+        size_t rows = 0;
+        for (const auto& entry : segments) {
+            out += encodeInfo(entry.second);
+            auto totals = aggregates.find(entry.first);
+            if (totals != aggregates.end()) {
+                stringstream lines(totals->second.encode());
+                string line;
+                while (getline(lines, line)) {
+                    out += "+" + line + "\n";
+                }
+            }
+            rows += entry.second.rows;
+        }
+        for (const auto& entry : archives) {
+            out += "#ARCHIVE " + encodeInfo(entry.second);
+            rows += entry.second.rows;
+        }
+        out += "#END " + to_string(segments.size() + archives.size()) + " " + to_string(rows) + "\n";
+        return out;
+    }
+    
+    // Returns false when the manifest is damaged or truncated
+    bool parse(const string& contents) {
+        stringstream ss(contents);
+        string line, tag, period;
+        getline(ss, line);
+        stringstream header(line);
+        header >> tag >> version >> period;
+        if (tag != "#MANIFEST" || !PartitionScheme::parse(period, scheme)) return false;
+        if (!(header >> generation)) generation = 0;
+        checksum = Crc32c::compute(contents.data(), contents.size());
+        
+        segments.clear();
+        aggregates.clear();
+        archives.clear();
+        string lastSegment, totals;
+        auto finishSegment = [&]() {
+            if (!lastSegment.empty() && !totals.empty()) aggregates[lastSegment].decode(totals);
+            lastSegment.clear();
+            totals.clear();
+        };
+        while (getline(ss, line)) {
+            if (line.empty()) continue;
+            if (line[0] == '+') {
+                totals += line.substr(1) + "\n";
+                continue;
+            }
+            finishSegment();
+            if (line.compare(0, 5, "#END ") == 0) return true;
+            
+            bool archived = line.compare(0, 9, "#ARCHIVE ") == 0;
+            stringstream fields(archived ? line.substr(9) : line);
+            SegmentInfo info;
+            if (!parseInfo(fields, info)) return false;
+            (archived ? archives : segments)[info.key] = info;
+            if (!archived) lastSegment = info.key;
+        }
+        return false;
+    }
+    
+    // Every segment has its ID range and aggregates (version 2 and later)
+    bool isComplete() const {
+        return version >= VERSION && aggregates.size() == segments.size();
+    }
+};
+
+// Minimal LZ4 block-format codec (raw blocks, no frame header) used to
+// compress sealed archive segments without an external dependency
+class Lz4Block {
+private:
+    static uint32_t read32(const unsigned char* p) {
+        uint32_t value;
+        memcpy(&value, p, 4);
+        return value;
+    }
+    
+    static void writeLength(string& out, size_t length) {
+        while (length >= 255) {
+            out += (char)255;
+            length -= 255;
+        }
+        out += (char)length;
+    }
+    
+    static void emit(string& out, const unsigned char* literals, size_t literalLength,
+                     size_t offset, size_t matchLength) {
+        size_t matchCode = matchLength >= 4 ? matchLength - 4 : 0;
+        unsigned char token = (unsigned char)((min(literalLength, (size_t)15) << 4) |
+                                              (matchLength >= 4 ? min(matchCode, (size_t)15) : 0));
+        out += (char)token;
+        if (literalLength >= 15) writeLength(out, literalLength - 15);
+        out.append((const char*)literals, literalLength);
+        if (matchLength < 4) return;    // Final literal-only sequence
+        out += (char)(offset & 0xFF);
+        out += (char)(offset >> 8);
+        if (matchCode >= 15) writeLength(out, matchCode - 15);
+    }
+    
+public:
+    static string compress(const string& input) {
+        const unsigned char* src = (const unsigned char*)input.data();
+        size_t length = input.size();
+        string out;
+        out.reserve(length / 2 + 16);
+        
+        size_t anchor = 0;
+        if (length >= 13) {
+            // Matches must end 5 bytes before the input and start 12 before it
+            const size_t matchLimit = length - 12;
+            const size_t literalTail = length - 5;
+            vector<uint32_t> table(1 << 16, 0);     // Hash of 4 bytes -> position + 1
+            
+            size_t ip = 0;
+            while (ip < matchLimit) {
+                uint32_t sequence = read32(src + ip);
+                uint32_t hash = (sequence * 2654435761u) >> 16;
+                size_t candidate = table[hash];
+                table[hash] = (uint32_t)(ip + 1);
+                
+                if (candidate == 0 || ip - (candidate - 1) > 65535 || read32(src + candidate - 1) != sequence) {
+                    ip++;
+                    continue;
+                }
+                size_t ref = candidate - 1;
+                size_t matchLength = 4;
+                while (ip + matchLength < literalTail && src[ref + matchLength] == src[ip + matchLength]) {
+                    matchLength++;
+                }
+                emit(out, src + anchor, ip - anchor, ip - ref, matchLength);
+                ip += matchLength;
+                anchor = ip;
+            }
+        }
+        emit(out, src + anchor, length - anchor, 0, 0);
+        return out;
+    }
+    
+    // Returns false on malformed input or when the size does not match
+    static bool decompress(const string& input, size_t rawSize, string& output) {
+        const unsigned char* src = (const unsigned char*)input.data();
+        size_t length = input.size();
+        output.clear();
+        output.reserve(rawSize);
+        
+        size_t ip = 0;
+        auto readLength = [&](size_t& value) {
+            unsigned char byte;
+            do {
+                if (ip >= length) return false;
+                byte = src[ip++];
+                value += byte;
+            } while (byte == 255);
+            return true;
+        };
+        
+        while (ip < length) {
+            unsigned char token = src[ip++];
+            size_t literalLength = token >> 4;
+            if (literalLength == 15 && !readLength(literalLength)) return false;
+            if (literalLength > length - ip || output.size() + literalLength > rawSize) return false;
+            output.append((const char*)src + ip, literalLength);
+            ip += literalLength;
+            if (ip == length) break;    // Last sequence has no match
+            
+            if (length - ip < 2) return false;
+            size_t offset = src[ip] | ((size_t)src[ip + 1] << 8);
+            ip += 2;
+            size_t matchLength = token & 15;
+            if (matchLength == 15 && !readLength(matchLength)) return false;
+            matchLength += 4;
+            if (offset == 0 || offset > output.size() || output.size() + matchLength > rawSize) return false;
+            
+            size_t from = output.size() - offset;
+            for (size_t i = 0; i < matchLength; i++) {
+                output += output[from + i];     // Overlapping copies are allowed
+            }
+        }
+        return output.size() == rawSize;
+    }
+};
+
+// Sealed, immutable archive of one closed year:
+//
+//   #ARCHIVE 1 <raw bytes> <compressed bytes> <crc32c of compressed, hex>
+//   <LZ4-compressed rows>
+//   <LedgerAggregates lines>
+//   #FOOTER <footer bytes, 20 digits> <crc32c of footer, hex>
+//
+// The trailer has a fixed width so the footer can be read by seeking from
+// the end, without touching the compressed rows.
+class LedgerArchive {
+private:
+    static const size_t TRAILER_SIZE = 38;     // "#FOOTER " + 20 digits + " " + 8 hex + "\n"
+    
+public:
+    // Each seal writes a new version, so the archive a committed manifest
+    // names is never overwritten; version 0 is the unversioned older name
+    static string fileFor(const string& ledger, const string& year, unsigned long long version) {
+        return ledger + "." + year + (version ? "." + to_string(version) : "") + ".arc";
+    }
+    
+    // Write the archive, then read it back and check that it decompresses
+    // to exactly the rows given: once sealed it is their only copy
+    static bool write(const string& path, const vector<Expense>& rows, const LedgerAggregates& aggregates,
+                      size_t& rawBytes, size_t& compressedBytes, string& error) {
+        string raw;
+        for (const auto& expense : rows) {
+            raw += expense.toString();
+            raw += '\n';
+        }
+        string compressed = Lz4Block::compress(raw);
+        string footer = aggregates.encode();
+        
+        char header[96];
+        snprintf(header, sizeof(header), "#ARCHIVE 1 %zu %zu %08x\n", raw.size(), compressed.size(),
+                 Crc32c::compute(compressed.data(), compressed.size()));
+        char trailer[TRAILER_SIZE + 1];
+        snprintf(trailer, sizeof(trailer), "#FOOTER %020zu %08x\n", footer.size(),
+                 Crc32c::compute(footer.data(), footer.size()));
+        
+        rawBytes = raw.size();
+        compressedBytes = compressed.size();
+        if (!LedgerFile::writeAtomic(path, header + compressed + footer + trailer)) {
+            error = "could not write " + path;
+            return false;
+        }
+        string stored;
+        if (!readRaw(path, stored, error) || stored != raw) {
+            if (error.empty()) error = path + " does not read back as written";
+            remove(path.c_str());
+            return false;
+        }
+        return true;
+    }
+    
+    // Read only the aggregates footer
+    static bool readFooter(const string& path, LedgerAggregates& aggregates) {
+        ifstream file(path, ios::binary);
+        if (!file.is_open()) return false;
+        file.seekg(0, ios::end);
+        streamoff size = file.tellg();
+        if (size < (streamoff)TRAILER_SIZE) return false;
+        
+        char trailer[TRAILER_SIZE + 1] = {0};
+        file.seekg(size - (streamoff)TRAILER_SIZE);
+        file.read(trailer, TRAILER_SIZE);
+        size_t footerSize = 0;
+        unsigned int expected = 0;
+        if (sscanf(trailer, "#FOOTER %zu %x", &footerSize, &expected) != 2 ||
+            (streamoff)(footerSize + TRAILER_SIZE) > size) {
+            return false;
+        }
+        
+        string footer(footerSize, '\0');
+        file.seekg(size - (streamoff)(TRAILER_SIZE + footerSize));
+        file.read(&footer[0], (streamsize)footerSize);
+        if (!file || Crc32c::compute(footer.data(), footer.size()) != expected) return false;
+        return aggregates.decode(footer);
+    }
+    
+    // Decompress the rows' text
+    static bool readRaw(const string& path, string& raw, string& error) {
+        string contents;
+        if (!LedgerFile::readAll(path, contents)) {
+            error = "cannot open " + path;
+            return false;
+        }
+        size_t rawSize = 0, compressedSize = 0;
+        unsigned int expected = 0;
+        size_t headerEnd = contents.find('\n');
+        if (headerEnd == string::npos ||
+            sscanf(contents.c_str(), "#ARCHIVE 1 %zu %zu %x", &rawSize, &compressedSize, &expected) != 3 ||
+            headerEnd + 1 + compressedSize > contents.size()) {
+            error = path + " has a damaged header";
+            return false;
+        }
+        
+        string compressed = contents.substr(headerEnd + 1, compressedSize);
+        if (Crc32c::compute(compressed.data(), compressed.size()) != expected) {
+            error = path + " failed checksum verification";
+            return false;
+        }
+        if (!Lz4Block::decompress(compressed, rawSize, raw)) {
+            error = path + " could not be decompressed";
+            return false;
+        }
+        return true;
+    }
+    
+    // Decompress and parse every row of the archive
+    static bool readRows(const string& path, vector<Expense>& rows, string& error) {
+        string raw;
+        if (!readRaw(path, raw, error)) return false;
+        
+        rows.clear();
+        string_view text(raw);
+        while (!text.empty()) {
+            size_t end = min(text.find('\n'), text.size());
+            Expense expense = Expense::fromString(text.substr(0, end));
+            if (expense.getId() > 0) rows.push_back(move(expense));
+            text.remove_prefix(min(end + 1, text.size()));
+        }
+        return true;
+    }
+};
+
+// Rows of a segment in ID order, held as a persistent B+-tree. Copying
+// the rows copies the root pointer, and a node is never changed while
+// another copy shares it: a change copies the path from the root to the
+// leaf it touches instead. Undo snapshots and published versions are
+// therefore O(1) to take, and each later change costs O(log n) however
+// large the segment is. Interior nodes count the rows below them, so rows
+// can also be reached by position, which is how selections and morsels
+// address them.
+class ExpenseRows {
+private:
+    static const size_t LEAF_ROWS = 32;
+    static const size_t FANOUT = 32;
+    
+    struct Node {
+        size_t count = 0;                   // Rows in the subtree
+        int maxId = 0;                      // Highest ID in the subtree
+        bool leaf = true;
+        vector<Expense> rows;               // Leaf: rows in ID order
+        vector<shared_ptr<Node>> children;  // Interior: subtrees in ID order
+    };
+    
+    shared_ptr<Node> root;                  // Null while empty
+    
+    static void refresh(Node& node) {
+        if (node.leaf) {
+            node.count = node.rows.size();
+            node.maxId = node.rows.empty() ? 0 : node.rows.back().getId();
+            return;
+        }
+        node.count = 0;
+        for (const auto& child : node.children) node.count += child->count;
+        node.maxId = node.children.empty() ? 0 : node.children.back()->maxId;
+    }
+    
+    // Child whose ID range takes the ID: the first reaching up to it
+    static size_t childFor(const Node& node, int id) {
+        size_t i = 0;
+        while (i + 1 < node.children.size() && node.children[i]->maxId < id) i++;
+        return i;
+    }
+    
+    static vector<Expense>::const_iterator rowFor(const Node& leaf, int id) {
+        return lower_bound(leaf.rows.begin(), leaf.rows.end(), id,
+            [](const Expense& row, int value) { return row.getId() < value; });
+    }
+    
+    // Charge a node, and for a leaf its rows' text, to an owner
+    static void retag(const Node* node, MemoryTag tag) {
+        AllocationCounters::retag(node, tag);
+        if (!node->leaf) {
+            if (node->children.capacity() > 0) AllocationCounters::retag(node->children.data(), tag);
+            return;
+        }
+        if (node->rows.capacity() > 0) AllocationCounters::retag(node->rows.data(), tag);
+        for (const auto& expense : node->rows) {
+            expense.forEachText([tag](const string& text) {
+                if (AllocationCounters::onHeap(text)) AllocationCounters::retag(text.data(), tag);
+            });
+        }
+    }
+    
+    // The node in the slot, copied first if another version shares it.
+    // From then on the original is kept only by those versions.
+    static Node& writable(shared_ptr<Node>& slot) {
+        if (slot.use_count() > 1) {
+            retag(slot.get(), MemoryTag::Snapshots);
+            slot = shared_ptr<Node>(new Node(*slot));
+        }
+        return *slot;
+    }
+    
+    // Split off the entries past keep into a new right sibling
+    static shared_ptr<Node> split(Node& node, size_t keep) {
+        shared_ptr<Node> sibling(new Node());
+        sibling->leaf = node.leaf;
+        if (node.leaf) {
+            sibling->rows.assign(make_move_iterator(node.rows.begin() + keep), make_move_iterator(node.rows.end()));
+            node.rows.erase(node.rows.begin() + keep, node.rows.end());
+        } else {
+            sibling->children.assign(node.children.begin() + keep, node.children.end());
+            node.children.erase(node.children.begin() + keep, node.children.end());
+        }
+        refresh(*sibling);
+        return sibling;
+    }
+    
+    // Insert below the slot; returns the new right sibling if the node split.
+    // An entry added at the end of a node leaves it full, so rows added in
+    // ID order pack the tree.
+    static shared_ptr<Node> insert(shared_ptr<Node>& slot, const Expense& expense) {
+        Node& node = writable(slot);
+        shared_ptr<Node> sibling;
+        if (node.leaf) {
+            auto at = node.rows.begin() + (rowFor(node, expense.getId() + 1) - node.rows.cbegin());
+            bool atEnd = at == node.rows.end();
+            node.rows.insert(at, expense);
+            if (node.rows.size() > LEAF_ROWS) sibling = split(node, atEnd ? LEAF_ROWS : node.rows.size() / 2);
+        } else {
+            size_t i = childFor(node, expense.getId());
+            shared_ptr<Node> added = insert(node.children[i], expense);
+            if (added) node.children.insert(node.children.begin() + i + 1, added);
+            if (node.children.size() > FANOUT) {
+                bool atEnd = added && i + 2 == node.children.size();
+                sibling = split(node, atEnd ? FANOUT : node.children.size() / 2);
+            }
+        }
+        refresh(node);
+        return sibling;
+    }
+    
+    // Remove the row with the ID, which must be present; emptied nodes go
+    static void erase(shared_ptr<Node>& slot, int id) {
+        Node& node = writable(slot);
+        if (node.leaf) {
+            node.rows.erase(node.rows.begin() + (rowFor(node, id) - node.rows.cbegin()));
+        } else {
+            size_t i = childFor(node, id);
+            erase(node.children[i], id);
+            if (node.children[i]->count == 0) node.children.erase(node.children.begin() + i);
+        }
+        refresh(node);
+    }
+    
+    static void replace(shared_ptr<Node>& slot, const Expense& expense) {
+        Node& node = writable(slot);
+        if (node.leaf) {
+            node.rows[rowFor(node, expense.getId()) - node.rows.cbegin()] = expense;
+        } else {
+            replace(node.children[childFor(node, expense.getId())], expense);
+        }
+    }
+    
+    static void collectNodes(const Node* node, unordered_set<const Node*>& nodes) {
+        if (node == nullptr || !nodes.insert(node).second) return;
+        for (const auto& child : node->children) collectNodes(child.get(), nodes);
+    }
+    
+    // Leaf holding the row at a position, and the position of its first row
+    const Node* leafAt(size_t position, size_t& first) const {
+        const Node* node = root.get();
+        first = 0;
+        while (!node->leaf) {
+            size_t i = 0;
+            while (i + 1 < node->children.size() && position >= first + node->children[i]->count) {
+                first += node->children[i++]->count;
+            }
+            node = node->children[i].get();
+        }
+        return node;
+    }
+    
+public:
+    // Walks the rows in order, a leaf at a time
+    class const_iterator {
+    public:
+        typedef forward_iterator_tag iterator_category;
+        typedef Expense value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const Expense* pointer;
+        typedef const Expense& reference;
+        
+    private:
+        const ExpenseRows* owner = nullptr;
+        const Node* leaf = nullptr;
+        size_t first = 0;           // Position of the leaf's first row
+        size_t position = 0;
+        
+        void settle() {
+            if (position >= owner->size()) return;
+            if (leaf == nullptr || position < first || position >= first + leaf->rows.size()) {
+                leaf = owner->leafAt(position, first);
+            }
+        }
+        
+    public:
+        const_iterator() {}
+        const_iterator(const ExpenseRows* rows, size_t at) : owner(rows), position(at) { settle(); }
+        
+        reference operator*() const { return leaf->rows[position - first]; }
+        pointer operator->() const { return &leaf->rows[position - first]; }
+        
+        const_iterator& operator++() {
+            position++;
+            if (position - first >= leaf->rows.size()) settle();
+            return *this;
+        }
+        
+        const_iterator operator++(int) {
+            const_iterator before = *this;
+            ++*this;
+            return before;
+        }
+        
+        // Jump to another position; cheap within the current leaf
+        void seek(size_t at) {
+            position = at;
+            settle();
+        }
+        
+        bool operator==(const const_iterator& other) const { return position == other.position; }
+        bool operator!=(const const_iterator& other) const { return position != other.position; }
+    };
+    
+    ExpenseRows() {}
+    
+    // Bulk load, sorting the rows by ID first
+    explicit ExpenseRows(vector<Expense> rows) {
+        auto byId = [](const Expense& a, const Expense& b) { return a.getId() < b.getId(); };
+        if (!is_sorted(rows.begin(), rows.end(), byId)) stable_sort(rows.begin(), rows.end(), byId);
+        vector<shared_ptr<Node>> level;
+        for (size_t begin = 0; begin < rows.size(); begin += LEAF_ROWS) {
+            shared_ptr<Node> leaf(new Node());
+            size_t end = min(begin + LEAF_ROWS, rows.size());
+            leaf->rows.assign(make_move_iterator(rows.begin() + begin), make_move_iterator(rows.begin() + end));
+            refresh(*leaf);
+            level.push_back(leaf);
+        }
+        while (level.size() > 1) {
+            vector<shared_ptr<Node>> parents;
+            for (size_t begin = 0; begin < level.size(); begin += FANOUT) {
+                shared_ptr<Node> parent(new Node());
+                parent->leaf = false;
+                parent->children.assign(level.begin() + begin, level.begin() + min(begin + FANOUT, level.size()));
+                refresh(*parent);
+                parents.push_back(parent);
+            }
+            level.swap(parents);
+        }
+        if (!level.empty()) root = level[0];
+    }
+    
+    size_t size() const { return root ? root->count : 0; }
+    bool empty() const { return size() == 0; }
+    
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, size()); }
+    const_iterator at(size_t position) const { return const_iterator(this, position); }
+    
+    const Expense& operator[](size_t position) const {
+        size_t first;
+        return leafAt(position, first)->rows[position - first];
+    }
+    
+    // Visit the rows at positions [begin, end) as visit(row, position), a
+    // leaf at a time, so scans run over contiguous rows
+    template <typename Visitor>
+    void forEachInRange(size_t begin, size_t end, Visitor visit) const {
+        end = min(end, size());
+        while (begin < end) {
+            size_t first;
+            const Node* leaf = leafAt(begin, first);
+            size_t stop = min(end, first + leaf->rows.size());
+            for (size_t i = begin; i < stop; i++) visit(leaf->rows[i - first], i);
+            begin = stop;
+        }
+    }
+    
+    const Expense* find(int id) const {
+        const Node* node = root.get();
+        if (node == nullptr) return nullptr;
+        while (!node->leaf) node = node->children[childFor(*node, id)].get();
+        auto row = rowFor(*node, id);
+        return (row != node->rows.end() && row->getId() == id) ? &*row : nullptr;
+    }
+    
+    void insert(const Expense& expense) {
+        if (!root) root.reset(new Node());
+        shared_ptr<Node> sibling = insert(root, expense);
+        if (sibling) {
+            shared_ptr<Node> top(new Node());
+            top->leaf = false;
+            top->children = {root, sibling};
+            refresh(*top);
+            root = top;
+        }
+    }
+    
+    bool erase(int id) {
+        if (find(id) == nullptr) return false;
+        erase(root, id);
+        if (root->count == 0) root.reset();
+        while (root && !root->leaf && root->children.size() == 1) root = root->children[0];
+        return true;
+    }
+    
+    // Replace the row with the same ID; false if there is none
+    bool replace(const Expense& expense) {
+        if (find(expense.getId()) == nullptr) return false;
+        replace(root, expense);
+        return true;
+    }
+    
+    // One version of the rows takes over from another as the current rows:
+    // nodes only the new one has are charged to rows, and nodes only the
+    // old one has to undo history. Shared nodes keep their owner.
+    static void changeOwner(const ExpenseRows* previous, const ExpenseRows* next) {
+        unordered_set<const Node*> before, after;
+        collectNodes(previous ? previous->root.get() : nullptr, before);
+        collectNodes(next ? next->root.get() : nullptr, after);
+        for (const Node* node : before) {
+            if (after.count(node) == 0) retag(node, MemoryTag::Snapshots);
+        }
+        for (const Node* node : after) {
+            if (before.count(node) == 0) retag(node, MemoryTag::Rows);
+        }
+    }
+};
+
+// A sealed year: metadata and aggregates stay in memory, rows are only
+// decompressed when a detail query needs them
+struct ArchiveSegment {
+    SegmentInfo info;
+    LedgerAggregates aggregates;
+    string file;
+    mutable shared_ptr<ExpenseRows> rows;       // Decompressed rows, null until needed
+    mutable shared_ptr<LedgerSketches> sketches;    // Null until a summary needs them
+};
+
+// Persistent ID index: the segment or archive holding every expense ID,
+// sorted by ID. It is mapped read-only at startup, so ID lookups and
+// ID-ordered listings go straight to the right segment without loading any
+// others, and nothing is rebuilt when the ledger is opened. The persistence
+// writer rewrites it when it stops. The header ties it to one manifest
+// (generation and checksum); if they differ the index is stale and is
+// ignored until the next rewrite.
+//
+//   Header   "EXPIDX1\n", generation, manifest CRC32C, key count, entry count
+//   Keys     key count x 16 bytes, NUL padded; archive keys start with '@'
+//   Entries  entry count x {int32 id, uint32 key number}, ascending by ID
+class LedgerIndex {
+public:
+    struct Header {
+        char magic[8];
+        uint64_t generation;
+        uint32_t manifestChecksum;
+        uint32_t keyCount;
+        uint64_t entryCount;
+    };
+    
+    struct Entry {
+        int32_t id;
+        uint32_t key;
+    };
+    
+    static constexpr size_t KEY_SIZE = 16;
+    
+private:
+    const char* data;
+    size_t length;
+    vector<string> keyNames;
+#ifdef _WIN32
+    string buffer;                      // No mmap here: the file is read instead
+#endif
+    
+    const Header& header() const { return *reinterpret_cast<const Header*>(data); }
+    
+    const Entry* entries() const {
+        return reinterpret_cast<const Entry*>(data + sizeof(Header) + keyNames.size() * KEY_SIZE);
+    }
+    
+public:
+    LedgerIndex() : data(nullptr), length(0) {}
+    ~LedgerIndex() { close(); }
+    
+    LedgerIndex(const LedgerIndex&) = delete;
+    LedgerIndex& operator=(const LedgerIndex&) = delete;
+    
+    static string fileFor(const string& ledger) {
+        return ledger + ".idx";
+    }
+    
+    static string archiveKey(const string& year) {
+        return "@" + year;
+    }
+    
+    // Map the index; fails if it is missing, damaged or not for this manifest
+    bool open(const string& path, unsigned long long generation, uint32_t manifestChecksum) {
+        close();
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(Header)) {
+            ::close(fd);
+            return false;
+        }
+        void* mapped = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) return false;
+        data = static_cast<const char*>(mapped);
+        length = (size_t)info.st_size;
+#else
+        if (!LedgerFile::readAll(path, buffer) || buffer.size() < sizeof(Header)) return false;
+        data = buffer.data();
+        length = buffer.size();
+#endif
+        
+        const Header& head = header();
+        size_t expected = sizeof(Header) + (size_t)head.keyCount * KEY_SIZE
+                        + (size_t)head.entryCount * sizeof(Entry);
+        if (memcmp(head.magic, "EXPIDX1\n", 8) != 0 || head.generation != generation ||
+            head.manifestChecksum != manifestChecksum || length != expected) {
+            close();
+            return false;
+        }
+        const char* keys = data + sizeof(Header);
+        for (uint32_t i = 0; i < head.keyCount; i++) {
+            const char* name = keys + i * KEY_SIZE;
+            keyNames.push_back(string(name, strnlen(name, KEY_SIZE)));
+        }
+        return true;
+    }
+    
+    void close() {
+#ifndef _WIN32
+        if (data != nullptr) munmap(const_cast<char*>(data), length);
+#else
+        buffer.clear();
+#endif
+        data = nullptr;
+        length = 0;
+        keyNames.clear();
+    }
+    
+    bool valid() const { return data != nullptr; }
+    size_t size() const { return valid() ? (size_t)header().entryCount : 0; }
+    const Entry& entry(size_t i) const { return entries()[i]; }
+    const vector<string>& keys() const { return keyNames; }
+    
+    // Key of the segment or archive holding the ID, null if not indexed
+    const string* lookup(int id) const {
+        if (!valid()) return nullptr;
+        const Entry* first = entries();
+        const Entry* last = first + size();
+        const Entry* found = lower_bound(first, last, id,
+            [](const Entry& entry, int value) { return entry.id < value; });
+        if (found == last || found->id != id) return nullptr;
+        return &keyNames[found->key];
+    }
+    
+    static string encode(unsigned long long generation, uint32_t manifestChecksum,
+                         const vector<string>& keys, const vector<Entry>& entries) {
+        Header head;
+        memcpy(head.magic, "EXPIDX1\n", 8);
+        head.generation = generation;
+        head.manifestChecksum = manifestChecksum;
+        head.keyCount = (uint32_t)keys.size();
+        head.entryCount = entries.size();
+        
+        string out(reinterpret_cast<const char*>(&head), sizeof(head));
+        for (const auto& key : keys) {
+            char name[KEY_SIZE] = {0};
+            memcpy(name, key.data(), min(key.size(), KEY_SIZE));
+            out.append(name, KEY_SIZE);
+        }
+        out.append(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(Entry));
+        return out;
+    }
+};
+
+// One partition of the hot ledger. Metadata and aggregates are always in
+// memory; the rows are loaded from the segment file on first use and may be
+// dropped again while they match the file. Rows are shared copy-on-write
+// with undo snapshots and the persistence writer.
+struct LedgerPartition {
+    SegmentInfo info;
+    LedgerAggregates aggregates;
+    shared_ptr<ExpenseRows> rows;           // Null while only on disk
+    shared_ptr<LedgerSketches> sketches;    // Null until a summary needs them, or stale
+    unsigned long long lastUse = 0;         // Stamp for least-recently-used eviction
+    
+    // Account for a row taken out of rows, and for the row put in its
+    // place when it was edited. Counts and sums are adjusted in place; only
+    // losing the row with the lowest or highest amount costs a scan.
+    void update(const Expense& removed, const Expense* added = nullptr) {
+        sketches.reset();       // Sketches cannot forget a row; rebuilt on next use
+        info.remove(removed);
+        bool extremeKept = aggregates.remove(removed);
+        if (added != nullptr) {
+            info.add(*added);
+            aggregates.add(*added);
+        }
+        if (!extremeKept) aggregates.rescanExtreme(*rows);
+    }
+    
+    // Recompute metadata from every row
+    void refresh() {
+        string key = info.key;
+        info.clear();
+        info.key = key;
+        aggregates = LedgerAggregates();
+        sketches.reset();
+        for (const auto& expense : *rows) {
+            info.add(expense);
+            aggregates.add(expense);
+        }
+    }
+};
+
+// Work-stealing pool for parallel scans. Each worker has its own task
+// deque: it takes work from the back of its own and steals from the front
+// of the others' once it runs dry. The thread running a batch helps with
+// it instead of blocking, so a pool of N threads has N - 1 workers.
+class ThreadPool {
+private:
+    struct Batch {
+        const function<void(size_t)>* task;
+        atomic<size_t> remaining;
+        mutex lock;
+        condition_variable done;
+        exception_ptr error;
+    };
+    
+    struct Task {
+        Batch* batch;
+        size_t index;
+    };
+    
+    struct Queue {
+        mutex lock;
+        deque<Task> tasks;
+    };
+    
+    vector<unique_ptr<Queue>> queues;   // One per worker
+    vector<thread> workers;
+    mutex idleMutex;
+    condition_variable wake;
+    size_t pending = 0;                 // Queued tasks, guarded by idleMutex
+    bool stopping = false;
+    
+    // Take a task, preferring the back of our own queue
+    bool take(size_t self, Task& task) {
+        for (size_t i = 0; i < queues.size(); i++) {
+            Queue& queue = *queues[(self + i) % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.tasks.empty()) continue;
+            if (i == 0) {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            } else {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            lock_guard<mutex> idle(idleMutex);
+            pending--;
+            return true;
+        }
+        return false;
+    }
+    
+    static void run(const Task& task) {
+        Batch& batch = *task.batch;
+        try {
+            (*batch.task)(task.index);
+        } catch (...) {
+            lock_guard<mutex> guard(batch.lock);
+            if (!batch.error) batch.error = current_exception();
+        }
+        // Decrement under the lock: the caller may destroy the batch as
+        // soon as it sees zero
+        lock_guard<mutex> guard(batch.lock);
+        if (--batch.remaining == 0) batch.done.notify_all();
+    }
+    
+    void workerLoop(size_t self) {
+        Task task;
+        while (true) {
+            if (take(self, task)) {
+                run(task);
+                continue;
+            }
+            unique_lock<mutex> guard(idleMutex);
+            wake.wait(guard, [this] { return stopping || pending > 0; });
+            if (stopping && pending == 0) return;
+        }
+    }
+    
+public:
+    explicit ThreadPool(size_t threads) {
+        size_t count = (threads > 1) ? threads - 1 : 0;
+        for (size_t i = 0; i < count; i++) queues.emplace_back(new Queue());
+        for (size_t i = 0; i < count; i++) workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+    
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> guard(idleMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+    
+    // Threads taking part in a batch, including the caller
+    size_t size() const { return workers.size() + 1; }
+    
+    // Run task(i) for every i in [0, count) and wait until all are done;
+    // the first exception thrown by a task is rethrown here
+    void parallelFor(size_t count, const function<void(size_t)>& task) {
+        if (workers.empty() || count < 2) {
+            for (size_t i = 0; i < count; i++) task(i);
+            return;
+        }
+        
+        Batch batch;
+        batch.task = &task;
+        batch.remaining = count;
+        for (size_t i = 0; i < count; i++) {
+            Queue& queue = *queues[i % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            queue.tasks.push_back({&batch, i});
+        }
+        {
+            lock_guard<mutex> guard(idleMutex);
+            pending += count;
+        }
+        wake.notify_all();
+        
+        // Help until nothing is left to steal, then wait for stragglers
+        Task stolen;
+        while (batch.remaining > 0 && take(0, stolen)) run(stolen);
+        unique_lock<mutex> guard(batch.lock);
+        batch.done.wait(guard, [&batch] { return batch.remaining == 0; });
+        if (batch.error) rethrow_exception(batch.error);
+    }
+};
+
+// Epoch-based reclamation for objects handed to lock-free readers. A
+// reader announces the current epoch in a slot for as long as it holds a
+// Guard; an object retired in epoch E is freed once every announced epoch
+// is later than E. Readers never wait for writers and never touch a shared
+// reference count; freeing happens on the retiring thread.
+class EpochReclaimer {
+private:
+    static const size_t SLOTS = 128;
+    static const uint64_t IDLE = 0;
+    
+    struct alignas(64) Slot {
+        atomic<uint64_t> epoch{IDLE};
+    };
+    
+    Slot slots[SLOTS];
+    atomic<uint64_t> current{1};
+    mutex retiredLock;
+    deque<pair<uint64_t, shared_ptr<const void>>> retired;     // Oldest epoch first
+    
+public:
+    class Guard {
+    private:
+        Slot* slot = nullptr;
+        
+    public:
+        explicit Guard(EpochReclaimer& reclaimer) {
+            static thread_local size_t hint = hash<thread::id>()(this_thread::get_id());
+            for (size_t i = hint % SLOTS;; i = (i + 1) % SLOTS) {
+                uint64_t idle = IDLE;
+                if (reclaimer.slots[i].epoch.compare_exchange_strong(idle, reclaimer.current.load())) {
+                    slot = &reclaimer.slots[i];
+                    hint = i;
+                    return;
+                }
+                if (i % SLOTS == SLOTS - 1) this_thread::yield();
+            }
+        }
+        
+        Guard(Guard&& other) noexcept : slot(other.slot) { other.slot = nullptr; }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+        
+        ~Guard() {
+            if (slot != nullptr) slot->epoch.store(IDLE);
+        }
+    };
+    
+    // Free the object once no reader can still be using it. Must be called
+    // after the object was unpublished.
+    void retire(shared_ptr<const void> object) {
+        uint64_t epoch = current.fetch_add(1);
+        lock_guard<mutex> guard(retiredLock);
+        retired.push_back({epoch, move(object)});
+        
+        uint64_t oldest = UINT64_MAX;
+        for (const auto& slot : slots) {
+            uint64_t announced = slot.epoch.load();
+            if (announced != IDLE) oldest = min(oldest, announced);
+        }
+        while (!retired.empty() && retired.front().first < oldest) retired.pop_front();
+    }
+    
+    // Objects retired but still awaiting readers
+    size_t pending() {
+        lock_guard<mutex> guard(retiredLock);
+        return retired.size();
+    }
+};
+
+// Bounded lock-free queue of expenses for many producers and one consumer,
+// after Vyukov's bounded queue. Every cell carries a sequence number that
+// says whose turn it is: a producer claims a position with one CAS on the
+// tail and the consumer reads positions in order, so neither takes a lock.
+class IngestRing {
+private:
+    struct alignas(64) Cell {
+        atomic<size_t> sequence;
+        Expense expense;
+    };
+    
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> tail{0};     // Next position producers claim
+    alignas(64) size_t head = 0;            // Next position the consumer reads
+    
+public:
+    // capacity must be a power of two
+    explicit IngestRing(size_t capacity) : cells(new Cell[capacity]), mask(capacity - 1) {
+        for (size_t i = 0; i < capacity; i++) cells[i].sequence.store(i, memory_order_relaxed);
+    }
+    
+    // Queue the expense; false if the ring is full. position is the
+    // expense's place in the order the consumer will see.
+    bool tryPush(Expense& expense, size_t& position) {
+        size_t claim = tail.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[claim & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            if (sequence == claim) {
+                if (tail.compare_exchange_weak(claim, claim + 1, memory_order_relaxed)) {
+                    cell.expense = move(expense);
+                    cell.sequence.store(claim + 1, memory_order_release);
+                    position = claim;
+                    return true;
+                }
+            } else if (sequence < claim) {
+                return false;
+            } else {
+                claim = tail.load(memory_order_relaxed);
+            }
+        }
+    }
+    
+    // Consumer only: move up to limit queued expenses out, in order
+    size_t drain(vector<Expense>& out, size_t limit) {
+        size_t count = 0;
+        while (count < limit) {
+            Cell& cell = cells[head & mask];
+            if (cell.sequence.load(memory_order_acquire) != head + 1) break;
+            out.push_back(move(cell.expense));
+            cell.sequence.store(head + mask + 1, memory_order_release);
+            head++;
+            count++;
+        }
+        return count;
+    }
+    
+    // Consumer only: whether the next position has been written
+    bool ready() const {
+        return cells[head & mask].sequence.load(memory_order_acquire) == head + 1;
+    }
+    
+    // Positions claimed so far
+    size_t claimed() const { return tail.load(); }
+};
+
+// Concurrent expense submission. Producers queue expenses on an IngestRing
+// and a single applier thread drains it in batches, handing each batch to
+// apply() in queue order. IDs come from blocks reserved per producer, so
+// producers share nothing but the ring; IDs left in a producer's block
+// when it goes away are never used. While the ring stays empty, apply()
+// is called with an empty batch every IDLE_TICK, so timed work that must
+// run on the writing thread still happens without submissions.
+class ExpenseIngest {
+public:
+    typedef function<void(vector<Expense>&)> Apply;
+    
+    static const size_t CAPACITY = 1 << 16;         // Queued expenses before producers wait
+    static const size_t BATCH = 4096;               // Most expenses applied at once
+    static const int ID_BLOCK = 1024;               // IDs reserved by a producer at a time
+    static constexpr chrono::seconds IDLE_TICK{60}; // Longest wait between apply() calls
+    
+    // Submits expenses from one thread
+    class Producer {
+    private:
+        ExpenseIngest& ingest;
+        int next = 0, end = 0;      // Unused part of the reserved block
+        
+    public:
+        explicit Producer(ExpenseIngest& target) : ingest(target) {}
+        
+        // ID for the next expense this producer submits
+        int allocateId() {
+            if (next == end) {
+                next = Expense::reserveIds(ID_BLOCK);
+                end = next + ID_BLOCK;
+            }
+            return next++;
+        }
+        
+        size_t submit(Expense&& expense) {
+            return ingest.submit(move(expense));
+        }
+    };
+    
+private:
+    IngestRing ring;
+    Apply apply;
+    thread applier;
+    atomic<bool> stopping{false};
+    atomic<bool> idle{false};                       // Applier is waiting for work
+    mutex wakeLock;
+    condition_variable wake;
+    atomic<size_t> applied{0};                      // Positions applied so far
+    mutex appliedLock;
+    condition_variable appliedChanged;
+    
+    void applyLoop() {
+        vector<Expense> batch;
+        batch.reserve(BATCH);
+        while (true) {
+            if (ring.drain(batch, BATCH) > 0) {
+                apply(batch);
+                {
+                    lock_guard<mutex> guard(appliedLock);
+                    applied += batch.size();
+                }
+                appliedChanged.notify_all();
+                batch.clear();
+                continue;
+            }
+            if (stopping && applied.load() == ring.claimed()) return;
+            
+            // Announce idle, then look at the ring once more before sleeping.
+            // A producer either sees idle and notifies under wakeLock, or its
+            // push is visible to the re-check, so no wakeup is lost.
+            unique_lock<mutex> guard(wakeLock);
+            idle.store(true);
+            atomic_thread_fence(memory_order_seq_cst);
+            bool woken = wake.wait_for(guard, IDLE_TICK, [this] { return stopping.load() || ring.ready(); });
+            idle.store(false);
+            if (!woken) {
+                guard.unlock();
+                apply(batch);
+            }
+        }
+    }
+    
+public:
+    explicit ExpenseIngest(Apply applyBatch)
+        : ring(CAPACITY), apply(move(applyBatch)), applier(&ExpenseIngest::applyLoop, this) {}
+    
+    ExpenseIngest(const ExpenseIngest&) = delete;
+    ExpenseIngest& operator=(const ExpenseIngest&) = delete;
+    
+    // Applies everything already queued before returning
+    ~ExpenseIngest() {
+        {
+            lock_guard<mutex> guard(wakeLock);
+            stopping = true;
+        }
+        wake.notify_one();
+        applier.join();
+    }
+    
+    // Queue an expense from any thread, waiting while the ring is full;
+    // returns its position for waitApplied()
+    size_t submit(Expense&& expense) {
+        size_t position;
+        while (!ring.tryPush(expense, position)) this_thread::yield();
+        atomic_thread_fence(memory_order_seq_cst);     // Pairs with the applier's fence
+        if (idle.load()) {
+            lock_guard<mutex> guard(wakeLock);
+            wake.notify_one();
+        }
+        return position;
+    }
+    
+    // Block until the expense at the position has been applied
+    void waitApplied(size_t position) {
+        if (applied.load() > position) return;
+        unique_lock<mutex> guard(appliedLock);
+        appliedChanged.wait(guard, [&] { return applied.load() > position; });
+    }
+};
+
+// Rows picked by a query, recorded as their position inside each segment
+// (4 bytes per row) rather than as copies or pointers. Positions survive
+// partitions being evicted and reloaded, since an unchanged segment always
+// loads in the same order; any change to the store makes them stale.
+class Selection {
+public:
+    struct Span {
+        string key;             // Partition key, or year of an archive
+        bool archived;
+        size_t begin, end;      // Range of positions belonging to the segment
+    };
+    
+private:
+    friend class LedgerStore;
+    pmr::vector<uint32_t> positions;
+    pmr::vector<Span> spans;
+    unsigned long long revision = 0;    // Store revision the positions refer to
+    
+public:
+    explicit Selection(pmr::memory_resource* memory = pmr::get_default_resource())
+        : positions(memory), spans(memory) {}
+    
+    size_t size() const { return positions.size(); }
+    bool empty() const { return positions.empty(); }
+    
+    void clear() {
+        positions.clear();
+        spans.clear();
+    }
+};
+
+// The ledger split into time partitions, plus sealed year archives.
+// Opening a ledger reads only the manifest: partition rows are loaded on
+// demand and kept in a least-recently-used cache, so startup cost does not
+// depend on the number of rows. Scans that carry date or amount bounds skip
+// partitions and archives whose metadata rules them out. ID lookups use the
+// persistent ID index when it is current, and otherwise only load
+// partitions whose ID range covers the ID.
+//
+// Partitions changed during the session stay in memory together with their
+// contents at session start; undo snapshots record only those partitions.
+class LedgerStore {
+public:
+    // Contents of every partition changed this session, keyed by period;
+    // null means the partition does not exist
+    typedef map<string, shared_ptr<const ExpenseRows>> Snapshot;
+    
+private:
+    static const size_t RESIDENT_ROWS = 1000000;       // Unchanged rows kept loaded between scans
+    static const size_t DECOMPRESSED_ARCHIVES = 2;     // Archives kept decompressed between scans
+    static const size_t MORSEL_ROWS = 16384;           // Rows per unit of parallel scan work
+    
+    // A slice of one segment's rows, scanned by a single thread
+    struct Morsel {
+        size_t segment;                 // Ordinal of the segment within the scan
+        const string* key;
+        bool archived;
+        const ExpenseRows* rows;
+        size_t begin, end;
+    };
+    
+public:
+    // The rows at one revision, published for readers that must not wait
+    // for writers (multi-version concurrency). Segments share their rows
+    // with the store, which copies the tree nodes a change touches while a
+    // version still refers to them, so a version never changes once published.
+    struct Version {
+        struct Segment {
+            string key;
+            bool archived;
+            SegmentInfo info;
+            shared_ptr<const ExpenseRows> rows;
+        };
+        
+        unsigned long long revision = 0;
+        vector<Segment> segments;           // Archives, then partitions, each in key order
+        LedgerAggregates totals;
+        
+        const Expense* find(int id) const {
+            for (const auto& segment : segments) {
+                if (!segment.info.mayContain(id)) continue;
+                const Expense* expense = segment.rows->find(id);
+                if (expense != nullptr) return expense;
+            }
+            return nullptr;
+        }
+        
+        const ExpenseRows* spanRows(const Selection::Span& span) const {
+            for (const auto& segment : segments) {
+                if (segment.archived == span.archived && segment.key == span.key) return segment.rows.get();
+            }
+            return nullptr;
+        }
+        
+        vector<Morsel> morsels(const ScanBounds& bounds) const {
+            vector<Morsel> work;
+            for (size_t s = 0; s < segments.size(); s++) {
+                const Segment& segment = segments[s];
+                if (!bounds.overlaps(segment.info)) continue;
+                const ExpenseRows& rows = *segment.rows;
+                for (size_t begin = 0; begin < rows.size(); begin += MORSEL_ROWS) {
+                    work.push_back({s, &segment.key, segment.archived, &rows, begin,
+                                    min(begin + MORSEL_ROWS, rows.size())});
+                }
+            }
+            return work;
+        }
+    };
+    
+    // A published version, kept from being freed while this is held
+    class PinnedVersion {
+    private:
+        EpochReclaimer::Guard guard;    // Announced before the version is read
+        const Version* version;
+        
+    public:
+        PinnedVersion(EpochReclaimer& epochs, const atomic<const Version*>& published)
+            : guard(epochs), version(published.load()) {}
+        
+        const Version& operator*() const { return *version; }
+        const Version* operator->() const { return version; }
+    };
+    
+private:
+    PartitionScheme scheme;
+    string ledgerFile;                                  // Segment files live next to it
+    mutable map<string, LedgerPartition> partitions;    // Ordered by period key
+    mutable unordered_map<int, LedgerPartition*> idIndex;   // Loaded rows only
+    mutable size_t rowCount = 0;                        // Hot rows, loaded or not
+    mutable size_t residentRows = 0;
+    mutable unsigned long long useClock = 0;
+    Snapshot baseline;                                  // Session-start contents of changed partitions
+    LedgerIndex ids;                                    // Persistent ID index, valid for unchanged partitions
+    map<string, ArchiveSegment> archives;               // Sealed years
+    unsigned long long archiveVersion = 0;              // Highest archive file version in use
+    mutable deque<string> decompressed;                 // Archives with rows in memory, oldest first
+    unsigned long long revision = 0;                    // Bumped by every change to the rows
+    unique_ptr<ThreadPool> pool;                        // Parallel scans; null scans inline
+    bool pinned = false;                                // Everything loaded, nothing evicted
+    size_t memoryBudget = 0;                            // Heap bytes to evict unchanged rows down to; 0 = none
+    mutable EpochReclaimer epochs;                      // Frees versions readers have left
+    atomic<const Version*> published{nullptr};          // Latest version, null unless sharing reads
+    mutable LedgerTimeSeries series;                    // Daily totals, once built
+    mutable bool seriesBuilt = false;
+    
+    // Apply a row added (sign 1) or removed (sign -1) to the daily totals
+    void track(const Expense& expense, int sign) const {
+        if (!seriesBuilt) return;
+        MemoryTagScope memory(MemoryTag::Categories);
+        series.add(expense, sign);
+    }
+    
+    void index(LedgerPartition& partition) const {
+        MemoryTagScope memory(MemoryTag::Index);
+        for (const auto& expense : *partition.rows) {
+            idIndex[expense.getId()] = &partition;
+        }
+        residentRows += partition.rows->size();
+    }
+    
+    void unindex(LedgerPartition& partition) const {
+        if (!partition.rows) return;
+        for (const auto& expense : *partition.rows) {
+            // The ID may already belong to another partition (undo of a move)
+            auto it = idIndex.find(expense.getId());
+            if (it != idIndex.end() && it->second == &partition) idIndex.erase(it);
+        }
+        residentRows -= partition.rows->size();
+    }
+    
+    // Rows of a partition, loading its segment file if needed
+    const ExpenseRows& rowsOf(LedgerPartition& partition) const {
+        if (!pinned) partition.lastUse = ++useClock;
+        if (partition.rows) return *partition.rows;
+        
+        LatencyScope latency(Metric::LoadSegment);
+        MemoryTagScope memory(MemoryTag::Rows);
+        vector<Expense> rows;
+        string path = LedgerManifest::segmentFile(ledgerFile, partition.info.key, partition.info.file);
+        if (!readSegment(path, rows, true)) {
+            cout << "Warning: segment " << path << " is missing (" << partition.info.rows << " expenses).\n";
+        }
+        partition.rows = make_shared<ExpenseRows>(move(rows));
+        if (partition.rows->size() != partition.info.rows) {
+            // Damaged or missing rows: describe what was actually loaded
+            size_t listed = partition.info.rows;
+            partition.refresh();
+            rowCount += partition.info.rows;
+            rowCount -= listed;
+        }
+        TRACE_SPAN("segment: index rows");
+        index(partition);
+        return *partition.rows;
+    }
+    
+    // Rows of a partition about to be modified. The session-start contents
+    // are remembered the first time. Rows shared with a snapshot or the
+    // writer are copied before they change; the copy shares the tree, and
+    // only the nodes a change touches are copied (and recharged) later.
+    ExpenseRows& mutableRows(LedgerPartition& partition) {
+        rowsOf(partition);
+        if (baseline.count(partition.info.key) == 0) {
+            baseline[partition.info.key] = partition.rows;
+        }
+        if (partition.rows.use_count() > 1) {
+            MemoryTagScope memory(MemoryTag::Rows);
+            partition.rows = make_shared<ExpenseRows>(*partition.rows);
+        }
+        return *partition.rows;
+    }
+    
+    // Partition holding a hot ID, loading candidate partitions as needed
+    LedgerPartition* locate(int id) const {
+        auto it = idIndex.find(id);
+        if (it != idIndex.end()) return it->second;
+        
+        if (ids.valid()) {
+            // Changed and loaded partitions are all in idIndex; the index
+            // only has to answer for the unchanged ones still on disk
+            const string* key = ids.lookup(id);
+            if (key == nullptr || baseline.count(*key) > 0) return nullptr;
+            auto partition = partitions.find(*key);
+            if (partition == partitions.end() || partition->second.rows) return nullptr;
+            rowsOf(partition->second);
+            it = idIndex.find(id);
+            return (it != idIndex.end()) ? it->second : nullptr;
+        }
+        for (auto& entry : partitions) {
+            if (entry.second.rows || !entry.second.info.mayContain(id)) continue;
+            rowsOf(entry.second);
+            it = idIndex.find(id);
+            if (it != idIndex.end()) return it->second;
+        }
+        return nullptr;
+    }
+    
+    void removePartition(const string& key) {
+        auto it = partitions.find(key);
+        if (it == partitions.end()) return;
+        unindex(it->second);
+        rowCount -= it->second.info.rows;
+        partitions.erase(it);
+    }
+    
+    // Rows of an archive, decompressing them if needed; null on failure
+    const ExpenseRows* archiveRows(const ArchiveSegment& archive) const {
+        if (!archive.rows) {
+            LatencyScope latency(Metric::LoadSegment);
+            MemoryTagScope memory(MemoryTag::Cache);
+            vector<Expense> rows;
+            string error;
+            if (!LedgerArchive::readRows(archive.file, rows, error)) {
+                cout << "Warning: " << error << "\n";
+                return nullptr;
+            }
+            archive.rows = make_shared<ExpenseRows>(move(rows));
+            decompressed.push_back(archive.info.key);
+        }
+        return archive.rows.get();
+    }
+    
+    // Drop cached rows beyond the cache sizes: decompressed archives, then
+    // the least recently used unchanged partitions. Called when a scan or
+    // lookup starts, so rows handed out by the previous one stay valid until then.
+    void trimCaches() const {
+        if (pinned) return;
+        while (decompressed.size() > DECOMPRESSED_ARCHIVES || (!decompressed.empty() && overBudget())) {
+            auto it = archives.find(decompressed.front());
+            if (it != archives.end()) it->second.rows.reset();
+            decompressed.pop_front();
+        }
+        
+        if (residentRows <= RESIDENT_ROWS && !overBudget()) return;
+        vector<LedgerPartition*> evictable;
+        for (auto& entry : partitions) {
+            if (entry.second.rows && baseline.count(entry.first) == 0) evictable.push_back(&entry.second);
+        }
+        sort(evictable.begin(), evictable.end(),
+            [](const LedgerPartition* a, const LedgerPartition* b) { return a->lastUse < b->lastUse; });
+        for (auto partition : evictable) {
+            if (residentRows <= RESIDENT_ROWS && !overBudget()) break;
+            unindex(*partition);
+            partition->rows.reset();
+        }
+    }
+    
+    bool overBudget() const {
+        return memoryBudget > 0 && AllocationCounters::liveTotal() > (long long)memoryBudget;
+    }
+    
+    // Visit the rows of every segment inside the bounds as
+    // visit(key, archived, rows); returns the number of segments skipped
+    template <typename Visitor>
+    size_t forEachSegment(const ScanBounds& bounds, Visitor visit) const {
+        size_t skipped = 0;
+        for (const auto& entry : archives) {
+            const ExpenseRows* rows = nullptr;
+            if (!bounds.overlaps(entry.second.info) || (rows = archiveRows(entry.second)) == nullptr) {
+                skipped++;
+                continue;
+            }
+            visit(entry.first, true, *rows);
+        }
+        for (auto& entry : partitions) {
+            if (!bounds.overlaps(entry.second.info)) {
+                skipped++;
+                continue;
+            }
+            visit(entry.first, false, rowsOf(entry.second));
+        }
+        return skipped;
+    }
+    
+    // Split the segments inside the bounds into morsels. Segments are loaded
+    // here, on the calling thread, because loading updates the store.
+    vector<Morsel> morsels(const ScanBounds& bounds) const {
+        vector<Morsel> work;
+        size_t segment = 0;
+        forEachSegment(bounds, [&](const string& key, bool archived, const ExpenseRows& rows) {
+            for (size_t begin = 0; begin < rows.size(); begin += MORSEL_ROWS) {
+                work.push_back({segment, &key, archived, &rows, begin, min(begin + MORSEL_ROWS, rows.size())});
+            }
+            segment++;
+        });
+        return work;
+    }
+    
+    void runParallel(size_t count, const function<void(size_t)>& task) const {
+        if (pool) {
+            pool->parallelFor(count, task);
+        } else {
+            for (size_t i = 0; i < count; i++) task(i);
+        }
+    }
+    
+    // Rows of the segment a selection span refers to; null if it is gone
+    const ExpenseRows* spanRows(const Selection::Span& span) const {
+        if (span.archived) {
+            auto archive = archives.find(span.key);
+            return (archive != archives.end()) ? archiveRows(archive->second) : nullptr;
+        }
+        auto partition = partitions.find(span.key);
+        return (partition != partitions.end()) ? &rowsOf(partition->second) : nullptr;
+    }
+    
+    // Find without trimming caches, so earlier results stay valid
+    const Expense* lookup(int id) const {
+        LedgerPartition* partition = locate(id);
+        if (partition != nullptr) return partition->rows->find(id);
+        
+        const string* key = ids.lookup(id);
+        if (key != nullptr && (*key)[0] == '@') {
+            auto archive = archives.find(key->substr(1));
+            const ExpenseRows* rows = (archive != archives.end()) ? archiveRows(archive->second) : nullptr;
+            if (rows != nullptr) return rows->find(id);
+        }
+        if (ids.valid()) return nullptr;
+        
+        for (const auto& entry : archives) {
+            if (!entry.second.info.mayContain(id)) continue;
+            const ExpenseRows* rows = archiveRows(entry.second);
+            const Expense* expense = (rows != nullptr) ? rows->find(id) : nullptr;
+            if (expense != nullptr) return expense;
+        }
+        return nullptr;
+    }
+    
+public:
+    explicit LedgerStore(const PartitionScheme& partitioning = PartitionScheme())
+        : scheme(partitioning) {}
+    
+    LedgerStore(const LedgerStore&) = delete;
+    LedgerStore& operator=(const LedgerStore&) = delete;
+    
+    ~LedgerStore() {
+        delete published.load();
+    }
+    
+    // Parse one segment file into rows; damaged blocks are reported when asked
+    static bool readSegment(const string& path, vector<Expense>& rows, bool report) {
+        string contents;
+        if (!LedgerFile::readAll(path, contents)) return false;
+        LedgerFile::ReadResult result = LedgerFile::parse(contents);
+        rows.reserve(result.rows.size());
+        TRACE_SPAN("segment: parse rows");
+        for (const auto& line : result.rows) {
+            Expense expense = Expense::fromString(line);
+            if (expense.getId() > 0) rows.push_back(move(expense));
+        }
+        if (report) LedgerFile::reportRecovery(path, result);
+        return true;
+    }
+    
+    const PartitionScheme& partitioning() const { return scheme; }
+    
+    // Adopt the period of an existing ledger; only valid while empty
+    void setPartitioning(const PartitionScheme& partitioning) {
+        if (rowCount == 0) scheme = partitioning;
+    }
+    
+    // Use the segments listed in a manifest without loading any rows
+    void open(const LedgerManifest& manifest) {
+        for (const auto& entry : manifest.segments) {
+            LedgerPartition& partition = partitions[entry.first];
+            partition.info = entry.second;
+            auto totals = manifest.aggregates.find(entry.first);
+            if (totals != manifest.aggregates.end()) partition.aggregates = totals->second;
+            rowCount += entry.second.rows;
+        }
+    }
+    
+    // Where segment files are read from
+    void setLedgerFile(const string& ledger) { ledgerFile = ledger; }
+    
+    // Take the file names of a manifest just written for the current rows
+    // (after a rewrite), so partitions evicted later load from them
+    void adoptFiles(const LedgerManifest& manifest) {
+        for (auto& entry : partitions) {
+            auto info = manifest.segments.find(entry.first);
+            if (info != manifest.segments.end()) entry.second.info.file = info->second.file;
+        }
+    }
+    
+    // Map the ID index written for this manifest; false if it is stale
+    bool attachIndex(const LedgerManifest& manifest) {
+        return ids.open(LedgerIndex::fileFor(ledgerFile), manifest.generation, manifest.checksum);
+    }
+    
+    // The current contents are what the session started with (after
+    // loading); nothing is pending for undo
+    void markLoaded() { baseline.clear(); }
+    
+    // Total rows, hot and archived
+    size_t size() const {
+        size_t total = rowCount;
+        for (const auto& entry : archives) {
+            total += entry.second.info.rows;
+        }
+        return total;
+    }
+    
+    bool empty() const { return size() == 0; }
+    size_t hotSize() const { return rowCount; }
+    size_t loadedRows() const { return residentRows; }
+    
+    const map<string, LedgerPartition>& allPartitions() const { return partitions; }
+    const map<string, ArchiveSegment>& allArchives() const { return archives; }
+    
+    // Only hot rows can be modified; archived ones are immutable
+    bool isHot(int id) const {
+        return locate(id) != nullptr;
+    }
+    
+    // Period key of the hot partition holding the ID, empty if none
+    string keyOf(int id) const {
+        LedgerPartition* partition = locate(id);
+        return partition ? partition->info.key : "";
+    }
+    
+    const Expense* find(int id) const {
+        trimCaches();
+        return lookup(id);
+    }
+    
+    // One page of expenses in ID order, resolved through the ID index so
+    // only the segments holding the page are loaded. Returns false when
+    // there is no current index and the caller must sort a full scan.
+    bool pageById(size_t offset, size_t limit, vector<const Expense*>& page) const {
+        if (!ids.valid()) return false;
+        trimCaches();
+        
+        // Indexed keys still describing what is on disk
+        vector<char> current(ids.keys().size());
+        for (size_t i = 0; i < current.size(); i++) {
+            const string& key = ids.keys()[i];
+            current[i] = (key[0] == '@') ? archives.count(key.substr(1)) > 0
+                                         : partitions.count(key) > 0 && baseline.count(key) == 0;
+        }
+        // Rows of changed partitions exist only in memory
+        vector<int> changed;
+        for (const auto& entry : baseline) {
+            auto partition = partitions.find(entry.first);
+            if (partition == partitions.end()) continue;
+            for (const auto& expense : *partition->second.rows) changed.push_back(expense.getId());
+        }
+        sort(changed.begin(), changed.end());
+        
+        vector<int> wanted;
+        size_t position = 0, next = 0, indexed = ids.size();
+        auto changedIt = changed.begin();
+        while (wanted.size() < limit) {
+            while (next < indexed && !current[ids.entry(next).key]) next++;
+            bool fromIndex = next < indexed &&
+                             (changedIt == changed.end() || ids.entry(next).id < *changedIt);
+            if (!fromIndex && changedIt == changed.end()) break;
+            int id = fromIndex ? ids.entry(next++).id : *changedIt++;
+            if (position++ >= offset) wanted.push_back(id);
+        }
+        
+        page.clear();
+        for (int id : wanted) {
+            const Expense* expense = lookup(id);
+            if (expense != nullptr) page.push_back(expense);
+        }
+        return true;
+    }
+    
+    void insert(const Expense& expense) {
+        MemoryTagScope memory(MemoryTag::Rows);
+        string key = scheme.keyFor(expense.getDate());
+        auto it = partitions.find(key);
+        if (it == partitions.end()) {
+            // New partition: it did not exist at session start unless recorded otherwise
+            baseline.insert(make_pair(key, shared_ptr<const ExpenseRows>()));
+            it = partitions.insert(make_pair(key, LedgerPartition())).first;
+            it->second.info.key = key;
+            it->second.rows = make_shared<ExpenseRows>();
+        }
+        LedgerPartition& partition = it->second;
+        revision++;
+        mutableRows(partition).insert(expense);
+        track(expense, 1);
+        partition.info.add(expense);
+        partition.aggregates.add(expense);
+        if (partition.sketches) {
+            MemoryTagScope statistics(MemoryTag::Categories);
+            partition.sketches->add(expense);
+        }
+        idIndex[expense.getId()] = &partition;
+        residentRows++;
+        rowCount++;
+    }
+    
+    bool erase(int id) {
+        MemoryTagScope memory(MemoryTag::Rows);
+        LedgerPartition* partition = locate(id);
+        if (partition == nullptr) return false;
+        
+        ExpenseRows& rows = mutableRows(*partition);
+        revision++;
+        Expense removed = *rows.find(id);
+        track(removed, -1);
+        rows.erase(id);
+        idIndex.erase(id);
+        residentRows--;
+        rowCount--;
+        
+        if (rows.empty()) {
+            string key = partition->info.key;
+            partitions.erase(key);
+        } else {
+            partition->update(removed);
+        }
+        return true;
+    }
+    
+    // Replace the stored expense with the same ID; moves it to another
+    // partition when its date changed period
+    bool replace(const Expense& expense) {
+        MemoryTagScope memory(MemoryTag::Rows);
+        LedgerPartition* partition = locate(expense.getId());
+        if (partition == nullptr) return false;
+        
+        if (partition->info.key == scheme.keyFor(expense.getDate())) {
+            revision++;
+            ExpenseRows& rows = mutableRows(*partition);
+            Expense removed = *rows.find(expense.getId());
+            track(removed, -1);
+            rows.replace(expense);
+            track(expense, 1);
+            partition->update(removed, &expense);
+            return true;
+        }
+        erase(expense.getId());
+        insert(expense);
+        return true;
+    }
+    
+    // Remove hot rows and archives alike
+    void clear() {
+        clearHot();
+        archives.clear();
+        decompressed.clear();
+        series = LedgerTimeSeries();    // Nothing is left to total
+        seriesBuilt = true;
+        revision++;
+    }
+    
+    // Remove every hot row. Partitions are loaded first so that their
+    // session-start contents are known to undo.
+    void clearHot() {
+        for (auto& entry : partitions) {
+            for (const auto& expense : mutableRows(entry.second)) track(expense, -1);
+        }
+        vector<string> keys;
+        for (const auto& entry : partitions) keys.push_back(entry.first);
+        for (const auto& key : keys) removePartition(key);
+        revision++;
+    }
+    
+    // Replace the hot rows (restore, unseal); archives are untouched
+    void assignHot(const vector<Expense>& rows) {
+        clearHot();
+        for (const auto& expense : rows) {
+            insert(expense);
+        }
+    }
+    
+    // Copy of the hot rows, loading every partition
+    vector<Expense> hotRows() const {
+        vector<Expense> rows;
+        rows.reserve(rowCount);
+        for (auto& entry : partitions) {
+            const ExpenseRows& partitionRows = rowsOf(entry.second);
+            rows.insert(rows.end(), partitionRows.begin(), partitionRows.end());
+        }
+        return rows;
+    }
+    
+    // Copy of every expense including archived ones
+    vector<Expense> all() const {
+        vector<Expense> rows;
+        rows.reserve(size());
+        forEach([&rows](const Expense& expense) { rows.push_back(expense); });
+        return rows;
+    }
+    
+    // Current contents of the partitions changed this session (for undo)
+    Snapshot snapshot() const {
+        MemoryTagScope memory(MemoryTag::Snapshots);
+        Snapshot state;
+        for (const auto& entry : baseline) {
+            auto it = partitions.find(entry.first);
+            state[entry.first] = (it != partitions.end()) ? it->second.rows : nullptr;
+        }
+        return state;
+    }
+    
+    // The snapshot with the session-start contents of every partition it
+    // does not record filled in, so that it no longer depends on this
+    // session (undo history kept on disk)
+    Snapshot complete(const Snapshot& state) const {
+        MemoryTagScope memory(MemoryTag::Snapshots);
+        Snapshot full = state;
+        for (const auto& entry : baseline) {
+            full.insert(entry);
+        }
+        return full;
+    }
+    
+    // Point the session-start contents of partitions that every kept
+    // snapshot records by itself at the current rows, so that rows only
+    // dropped snapshots could return to are freed. recordedByAll(key)
+    // says whether every kept snapshot records the partition.
+    template <typename Recorded>
+    void releaseHistory(Recorded recordedByAll) {
+        for (auto& entry : baseline) {
+            if (!recordedByAll(entry.first)) continue;
+            auto it = partitions.find(entry.first);
+            entry.second = (it != partitions.end()) ? it->second.rows : nullptr;
+        }
+    }
+    
+    // Return to a snapshot: partitions changed since then go back to the
+    // snapshot contents, or to their session-start contents if the snapshot
+    // predates the change. Returns the new contents of every partition
+    // touched, for the writer.
+    Snapshot restore(const Snapshot& state) {
+        // Partitions unchanged this session (a snapshot from an earlier
+        // one): their contents now are the session-start contents
+        for (const auto& entry : state) {
+            if (baseline.count(entry.first) > 0) continue;
+            auto it = partitions.find(entry.first);
+            if (it != partitions.end()) rowsOf(it->second);
+            baseline[entry.first] = (it != partitions.end()) ? it->second.rows : nullptr;
+        }
+        
+        Snapshot changed;
+        for (const auto& entry : baseline) {
+            auto saved = state.find(entry.first);
+            shared_ptr<const ExpenseRows> target = (saved != state.end()) ? saved->second : entry.second;
+            auto it = partitions.find(entry.first);
+            shared_ptr<const ExpenseRows> current = (it != partitions.end()) ? it->second.rows : nullptr;
+            if (target == current) continue;
+            
+            revision++;
+            ExpenseRows::changeOwner(current.get(), target.get());
+            if (current) {
+                for (const auto& expense : *current) track(expense, -1);
+            }
+            if (target) {
+                for (const auto& expense : *target) track(expense, 1);
+            }
+            removePartition(entry.first);
+            if (target && !target->empty()) {
+                LedgerPartition& partition = partitions[entry.first];
+                partition.info.key = entry.first;
+                partition.rows = const_pointer_cast<ExpenseRows>(target);
+                partition.lastUse = ++useClock;
+                partition.refresh();
+                index(partition);
+                rowCount += partition.info.rows;
+            }
+            changed[entry.first] = target;
+        }
+        return changed;
+    }
+    
+    double totalAmount() const {
+        double total = 0;
+        for (const auto& entry : partitions) {
+            total += entry.second.info.total;
+        }
+        for (const auto& entry : archives) {
+            total += entry.second.info.total;
+        }
+        return total;
+    }
+    
+    // Summary totals from partition and archive aggregates; no rows are read
+    LedgerAggregates aggregates() const {
+        TRACE_SPAN("aggregates: merge");
+        LedgerAggregates totals;
+        for (const auto& entry : archives) {
+            totals.merge(entry.second.aggregates);
+        }
+        for (const auto& entry : partitions) {
+            totals.merge(entry.second.aggregates);
+        }
+        return totals;
+    }
+    
+    // Visit every expense, archived years first, then hot partitions in order
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        forEachInBounds(ScanBounds(), visit);
+    }
+    
+    // Visit expenses inside the bounds, skipping partitions and archives that
+    // cannot contain any; returns the number of segments skipped
+    template <typename Visitor>
+    size_t forEachInBounds(const ScanBounds& bounds, Visitor visit) const {
+        trimCaches();
+        return forEachSegment(bounds, [&](const string&, bool, const ExpenseRows& rows) {
+            rows.forEachInRange(0, rows.size(), [&](const Expense& expense, size_t) {
+                if (bounds.contains(expense)) visit(expense);
+            });
+        });
+    }
+    
+    // Revision of the rows; selections and results taken at an older one are stale
+    unsigned long long currentRevision() const { return revision; }
+    
+    bool isCurrent(const Selection& selection) const {
+        return selection.revision == revision;
+    }
+    
+    // Load every partition and archive, stop evicting them and publish a
+    // version of the rows. Readers then use pin() and never wait for
+    // writers; writers must be serialized and call publish() after each
+    // complete change (server mode).
+    void shareReads() {
+        for (auto& entry : partitions) rowsOf(entry.second);
+        for (auto& entry : archives) archiveRows(entry.second);
+        pinned = true;
+        publish();
+    }
+    
+    // Make the current rows the version new readers see. Takes no rows
+    // copies: the next change to a partition copies it instead.
+    void publish() {
+        if (!pinned) return;
+        MemoryTagScope memory(MemoryTag::Snapshots);
+        unique_ptr<Version> version(new Version());
+        version->revision = revision;
+        for (const auto& entry : archives) {
+            if (archiveRows(entry.second) == nullptr) continue;
+            version->segments.push_back({entry.first, true, entry.second.info, entry.second.rows});
+        }
+        for (auto& entry : partitions) {
+            rowsOf(entry.second);
+            version->segments.push_back({entry.first, false, entry.second.info, entry.second.rows});
+        }
+        version->totals = aggregates();
+        
+        const Version* previous = published.exchange(version.release());
+        if (previous != nullptr) epochs.retire(shared_ptr<const void>(previous));
+    }
+    
+    // The latest published version; only valid after shareReads()
+    PinnedVersion pin() const {
+        return PinnedVersion(epochs, published);
+    }
+    
+    // Versions replaced but still pinned by a reader
+    size_t retiredVersions() const { return epochs.pending(); }
+    
+    // Evict unchanged partitions and decompressed archives while the heap
+    // holds more than this many bytes; 0 for no budget
+    void setMemoryBudget(size_t bytes) { memoryBudget = bytes; }
+    
+    // Drop cached rows now; only between operations, as rows handed out
+    // earlier may go
+    void trimToBudget() const { trimCaches(); }
+    
+    // Heap bytes of the strings of loaded rows, and the number of
+    // partitions loaded
+    pair<size_t, size_t> loadedTextBytes() const {
+        size_t bytes = 0, loaded = 0;
+        for (const auto& entry : partitions) {
+            if (!entry.second.rows) continue;
+            loaded++;
+            for (const auto& expense : *entry.second.rows) {
+                expense.forEachText([&bytes](const string& text) {
+                    if (AllocationCounters::onHeap(text)) bytes += AllocationCounters::sizeOf(text.data());
+                });
+            }
+        }
+        return {bytes, loaded};
+    }
+    
+    // Scan with this many threads (including the caller); 1 scans inline
+    void setScanThreads(size_t threads) {
+        pool.reset(threads > 1 ? new ThreadPool(threads) : nullptr);
+    }
+    
+    size_t scanThreads() const { return pool ? pool->size() : 1; }
+    
+    // Fold the rows inside the bounds into one partial State per morsel, in
+    // parallel, then merge the partials in morsel order: the result is the
+    // same for any number of threads. accumulate(State&, const Expense&)
+    // runs concurrently on different states; merge(State& into, State& from)
+    // runs on the calling thread.
+    template <typename State, typename Accumulate, typename Merge>
+    State parallelScan(const ScanBounds& bounds, Accumulate accumulate, Merge merge) const {
+        trimCaches();
+        vector<Morsel> work = morsels(bounds);
+        vector<State> partials(work.size());
+        runParallel(work.size(), [&](size_t m) {
+            const Morsel& morsel = work[m];
+            morsel.rows->forEachInRange(morsel.begin, morsel.end, [&](const Expense& expense, size_t) {
+                if (bounds.contains(expense)) accumulate(partials[m], expense);
+            });
+        });
+        State result;
+        for (auto& partial : partials) merge(result, partial);
+        return result;
+    }
+    
+    // Totals of the rows inside the bounds, aggregated in parallel
+    LedgerAggregates aggregate(const ScanBounds& bounds) const {
+        return parallelScan<LedgerAggregates>(bounds,
+            [](LedgerAggregates& totals, const Expense& expense) { totals.add(expense); },
+            [](LedgerAggregates& into, const LedgerAggregates& from) { into.merge(from); });
+    }
+    
+    // Replace the selection with the positions of rows inside the bounds
+    // that match. Morsels are filtered in parallel, so match must be safe
+    // to call concurrently; positions come out in segment order regardless.
+    template <typename Predicate>
+    void select(const ScanBounds& bounds, Selection& selection, Predicate match) const {
+        selection.clear();
+        selection.revision = revision;
+        trimCaches();
+        collect(morsels(bounds), bounds, selection, match);
+    }
+    
+    void select(const ScanBounds& bounds, Selection& selection) const {
+        select(bounds, selection, [](const Expense&) { return true; });
+    }
+    
+    // The same over a published version; safe while writers run
+    template <typename Predicate>
+    void select(const Version& version, const ScanBounds& bounds, Selection& selection, Predicate match) const {
+        selection.clear();
+        selection.revision = version.revision;
+        collect(version.morsels(bounds), bounds, selection, match);
+    }
+    
+    void select(const Version& version, const ScanBounds& bounds, Selection& selection) const {
+        select(version, bounds, selection, [](const Expense&) { return true; });
+    }
+    
+    // Narrow a selection in place to the rows that also match; filters
+    // compose by refining the same selection repeatedly. Chunks of the
+    // selection are filtered in parallel, as in select().
+    template <typename Predicate>
+    void refine(Selection& selection, Predicate match) const {
+        if (!isCurrent(selection)) {
+            selection.clear();
+            return;
+        }
+        trimCaches();
+        narrow(selection, match, [this](const Selection::Span& span) { return spanRows(span); });
+    }
+    
+    template <typename Predicate>
+    void refine(const Version& version, Selection& selection, Predicate match) const {
+        if (selection.revision != version.revision) {
+            selection.clear();
+            return;
+        }
+        narrow(selection, match, [&version](const Selection::Span& span) { return version.spanRows(span); });
+    }
+    
+    // Visit the selected rows [from, to) in selection order; false (and
+    // nothing visited) if the store changed since the selection was made
+    template <typename Visitor>
+    bool forEachSelected(const Selection& selection, Visitor visit,
+                         size_t from = 0, size_t to = SIZE_MAX) const {
+        if (!isCurrent(selection)) return false;
+        trimCaches();
+        visitSelected(selection, visit, from, to,
+                      [this](const Selection::Span& span) { return spanRows(span); });
+        return true;
+    }
+    
+    template <typename Visitor>
+    bool forEachSelected(const Version& version, const Selection& selection, Visitor visit,
+                         size_t from = 0, size_t to = SIZE_MAX) const {
+        if (selection.revision != version.revision) return false;
+        visitSelected(selection, visit, from, to,
+                      [&version](const Selection::Span& span) { return version.spanRows(span); });
+        return true;
+    }
+    
+private:
+    // Record the positions of matching rows of the morsels, filtered in
+    // parallel; positions come out in segment order regardless
+    template <typename Predicate>
+    void collect(const vector<Morsel>& work, const ScanBounds& bounds, Selection& selection,
+                 Predicate match) const {
+        TRACE_SPAN("scan: select");
+        vector<vector<uint32_t>> found(work.size());
+        size_t scanned = 0;
+        for (const auto& morsel : work) scanned += morsel.end - morsel.begin;
+        RuntimeMetrics::add(RuntimeMetrics::rowsScanned, scanned);
+        runParallel(work.size(), [&](size_t m) {
+            TRACE_SPAN("scan: morsel");
+            const Morsel& morsel = work[m];
+            morsel.rows->forEachInRange(morsel.begin, morsel.end, [&](const Expense& expense, size_t i) {
+                if (bounds.contains(expense) && match(expense)) found[m].push_back((uint32_t)i);
+            });
+        });
+        
+        size_t total = 0;
+        for (const auto& positions : found) total += positions.size();
+        selection.positions.reserve(total);
+        size_t spanSegment = SIZE_MAX;
+        for (size_t m = 0; m < work.size(); m++) {
+            if (found[m].empty()) continue;
+            selection.positions.insert(selection.positions.end(), found[m].begin(), found[m].end());
+            if (work[m].segment == spanSegment) {
+                selection.spans.back().end = selection.positions.size();
+            } else {
+                selection.spans.push_back({*work[m].key, work[m].archived,
+                                           selection.positions.size() - found[m].size(),
+                                           selection.positions.size()});
+                spanSegment = work[m].segment;
+            }
+        }
+    }
+    
+    // Narrow a selection to the rows that also match, in parallel chunks;
+    // resolve(span) gives the rows a span refers to
+    template <typename Predicate, typename Resolve>
+    void narrow(Selection& selection, Predicate match, Resolve resolve) const {
+        TRACE_SPAN("scan: refine");
+        struct Chunk {
+            size_t span, begin, end;
+        };
+        vector<const ExpenseRows*> rows(selection.spans.size());
+        vector<Chunk> chunks;
+        for (size_t s = 0; s < selection.spans.size(); s++) {
+            const Selection::Span& span = selection.spans[s];
+            rows[s] = resolve(span);
+            for (size_t begin = span.begin; rows[s] != nullptr && begin < span.end; begin += MORSEL_ROWS) {
+                chunks.push_back({s, begin, min(begin + MORSEL_ROWS, span.end)});
+            }
+        }
+        vector<vector<uint32_t>> kept(chunks.size());
+        RuntimeMetrics::add(RuntimeMetrics::rowsScanned, selection.positions.size());
+        runParallel(chunks.size(), [&](size_t c) {
+            TRACE_SPAN("scan: refine chunk");
+            const Chunk& chunk = chunks[c];
+            auto row = rows[chunk.span]->at(selection.positions[chunk.begin]);
+            for (size_t i = chunk.begin; i < chunk.end; i++) {
+                uint32_t position = selection.positions[i];
+                row.seek(position);
+                if (match(*row)) kept[c].push_back(position);
+            }
+        });
+        
+        // Compact in place: survivors never move past their old position
+        size_t count = 0, spansKept = 0;
+        size_t c = 0;
+        for (size_t s = 0; s < selection.spans.size(); s++) {
+            size_t begin = count;
+            for (; c < chunks.size() && chunks[c].span == s; c++) {
+                copy(kept[c].begin(), kept[c].end(), selection.positions.begin() + count);
+                count += kept[c].size();
+            }
+            if (count > begin) {
+                Selection::Span span = selection.spans[s];
+                span.begin = begin;
+                span.end = count;
+                selection.spans[spansKept++] = span;
+            }
+        }
+        selection.positions.resize(count);
+        selection.spans.resize(spansKept);
+    }
+    
+    template <typename Visitor, typename Resolve>
+    void visitSelected(const Selection& selection, Visitor visit, size_t from, size_t to,
+                       Resolve resolve) const {
+        for (const auto& span : selection.spans) {
+            if (span.end <= from) continue;
+            if (span.begin >= to) break;
+            const ExpenseRows* rows = resolve(span);
+            if (rows == nullptr) continue;
+            size_t begin = max(span.begin, from), end = min(span.end, to);
+            auto row = rows->at(selection.positions[begin]);
+            for (size_t i = begin; i < end; i++) {
+                row.seek(selection.positions[i]);
+                visit(*row);
+            }
+        }
+    }
+    
+public:
+    // Register an archive found in the manifest (rows stay on disk)
+    void addArchive(const ArchiveSegment& archive) {
+        archives[archive.info.key] = archive;
+        archiveVersion = max(archiveVersion, archive.info.file);
+        seriesBuilt = false;
+        revision++;
+    }
+    
+    // Daily totals of every expense, hot and archived. The first call
+    // scans the ledger; from then on every change is applied to them.
+    const LedgerTimeSeries& timeSeries() const {
+        if (!seriesBuilt) {
+            TRACE_SPAN("series: build");
+            series = LedgerTimeSeries();
+            seriesBuilt = true;
+            MemoryTagScope memory(MemoryTag::Categories);
+            forEach([this](const Expense& expense) { series.add(expense, 1); });
+        }
+        return series;
+    }
+    
+    // Quantile and distinct-count sketches of every expense, hot and
+    // archived, merged from those of each segment. Segments without
+    // sketches (never summarized, or changed since other than by adds) are
+    // loaded here and sketched in parallel, one segment per task.
+    LedgerSketches sketches() const {
+        TRACE_SPAN("sketches: merge");
+        trimCaches();
+        vector<pair<shared_ptr<const ExpenseRows>, shared_ptr<LedgerSketches>*>> stale;
+        for (const auto& entry : archives) {
+            if (entry.second.sketches) continue;
+            if (archiveRows(entry.second) == nullptr) continue;
+            stale.push_back(make_pair(entry.second.rows, &entry.second.sketches));
+        }
+        for (auto& entry : partitions) {
+            if (entry.second.sketches) continue;
+            rowsOf(entry.second);
+            stale.push_back(make_pair(entry.second.rows, &entry.second.sketches));
+        }
+        runParallel(stale.size(), [&](size_t s) {
+            TRACE_SPAN("sketches: build");
+            MemoryTagScope memory(MemoryTag::Categories);
+            auto sketch = make_shared<LedgerSketches>();
+            stale[s].first->forEachInRange(0, stale[s].first->size(),
+                [&](const Expense& expense, size_t) { sketch->add(expense); });
+            *stale[s].second = sketch;
+        });
+        
+        LedgerSketches merged;
+        for (const auto& entry : archives) {
+            if (entry.second.sketches) merged.merge(*entry.second.sketches);
+        }
+        for (const auto& entry : partitions) {
+            if (entry.second.sketches) merged.merge(*entry.second.sketches);
+        }
+        return merged;
+    }
+    
+    // Years that have hot partitions older than the given year
+    set<string> hotYearsBefore(int year) const {
+        set<string> years;
+        for (const auto& entry : partitions) {
+            if (entry.first == "undated") continue;
+            if (atoi(entry.first.c_str()) < year) years.insert(entry.first.substr(0, 4));
+        }
+        return years;
+    }
+    
+    // Move every hot row of the year into its compressed archive (merging
+    // with an existing archive of that year). On success info describes the
+    // new archive and the hot partitions of the year are gone; snapshots
+    // taken before no longer apply.
+    bool seal(const string& year, SegmentInfo& info, size_t& rawBytes, size_t& compressedBytes,
+              string& error) {
+        vector<Expense> rows;
+        auto existing = archives.find(year);
+        if (existing != archives.end()) {
+            const ExpenseRows* sealed = archiveRows(existing->second);
+            if (sealed == nullptr) {
+                error = "existing archive for " + year + " is unreadable";
+                return false;
+            }
+            rows.assign(sealed->begin(), sealed->end());
+        }
+        
+        vector<string> keys;
+        for (auto& entry : partitions) {
+            if (entry.first != "undated" && entry.first.compare(0, 4, year) == 0) {
+                keys.push_back(entry.first);
+                const ExpenseRows& partitionRows = rowsOf(entry.second);
+                rows.insert(rows.end(), partitionRows.begin(), partitionRows.end());
+            }
+        }
+        if (keys.empty()) {
+            error = "no unarchived expenses in " + year;
+            return false;
+        }
+        sort(rows.begin(), rows.end(),
+            [](const Expense& a, const Expense& b) { return a.getId() < b.getId(); });
+        
+        // A new file: until the writer commits, the manifest on disk still
+        // names the old archive and the partitions being sealed
+        ArchiveSegment archive;
+        archive.info.key = year;
+        archive.info.file = ++archiveVersion;
+        archive.file = LedgerArchive::fileFor(ledgerFile, year, archive.info.file);
+        for (const auto& expense : rows) {
+            archive.info.add(expense);
+            archive.aggregates.add(expense);
+        }
+        if (!LedgerArchive::write(archive.file, rows, archive.aggregates, rawBytes, compressedBytes, error)) {
+            return false;
+        }
+        
+        for (const auto& key : keys) {
+            removePartition(key);
+            baseline.erase(key);
+        }
+        ids.close();        // The index does not know the new archive
+        auto cached = std::find(decompressed.begin(), decompressed.end(), year);
+        if (cached != decompressed.end()) decompressed.erase(cached);
+        archives[year] = archive;
+        info = archive.info;
+        revision++;
+        return true;
+    }
+};
+
+// Outcome of a search or report, shared between the cache and its users
+struct QueryResult {
+    Selection rows;             // Matching rows (searches)
+    double total = 0;           // Sum of their amounts
+    LedgerAggregates totals;    // Summary reports
+    LedgerSketches sketches;    // Summary percentiles and distinct counts
+    
+    // Rough heap footprint, for the cache budget
+    size_t bytes() const {
+        size_t size = sizeof(QueryResult) + rows.size() * sizeof(uint32_t);
+        size += (totals.categories.size() + totals.payments.size() + totals.months.size()) * 64;
+        size += sketches.bytes();
+        return size;
+    }
+};
+
+// Recent query results keyed by a normalized query descriptor. Each entry
+// remembers the store revision it was computed at and is only returned
+// while the store is still at that revision. Entries are evicted least
+// recently used first once the count or byte budget is exceeded.
+class QueryCache {
+public:
+    struct Stats {
+        unsigned long long hits = 0, misses = 0, evictions = 0;
+        size_t entries = 0, bytes = 0;
+    };
+    
+private:
+    static const size_t MAX_ENTRIES = 64;
+    static const size_t MAX_BYTES = 64 * 1024 * 1024;
+    
+    struct Entry {
+        string key;
+        unsigned long long revision;
+        shared_ptr<const QueryResult> result;
+        size_t bytes;
+    };
+    
+    list<Entry> entries;                                // Most recently used first
+    unordered_map<string, list<Entry>::iterator> byKey;
+    Stats counters;
+    mutable mutex lock;                                 // Concurrent readers in server mode
+    unsigned long long latest = 0;                      // Newest revision cached
+    
+    void drop(list<Entry>::iterator entry) {
+        counters.bytes -= entry->bytes;
+        byKey.erase(entry->key);
+        entries.erase(entry);
+    }
+    
+public:
+    // Cached result for the query at this revision, or null
+    shared_ptr<const QueryResult> find(const string& key, unsigned long long revision) {
+        lock_guard<mutex> guard(lock);
+        auto it = byKey.find(key);
+        if (it == byKey.end() || it->second->revision != revision) {
+            counters.misses++;
+            return nullptr;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+        counters.hits++;
+        return it->second->result;
+    }
+    
+    void insert(const string& key, unsigned long long revision, shared_ptr<const QueryResult> result) {
+        lock_guard<mutex> guard(lock);
+        // Revisions only grow, so entries from older ones can never hit
+        // again; a reader still on an older version leaves newer ones alone
+        if (revision < latest) return;
+        latest = revision;
+        for (auto it = entries.begin(); it != entries.end();) {
+            auto next = std::next(it);
+            if (it->revision != revision || it->key == key) drop(it);
+            it = next;
+        }
+        
+        size_t bytes = result->bytes();
+        if (bytes > MAX_BYTES) return;
+        entries.push_front({key, revision, move(result), bytes});
+        byKey[key] = entries.begin();
+        counters.bytes += bytes;
+        
+        while (entries.size() > MAX_ENTRIES || counters.bytes > MAX_BYTES) {
+            drop(std::prev(entries.end()));
+            counters.evictions++;
+        }
+    }
+    
+    // Drop the least recently used entry; false if there was none
+    bool evictOldest() {
+        lock_guard<mutex> guard(lock);
+        if (entries.empty()) return false;
+        drop(std::prev(entries.end()));
+        counters.evictions++;
+        return true;
+    }
+    
+    Stats stats() const {
+        lock_guard<mutex> guard(lock);
+        Stats current = counters;
+        current.entries = entries.size();
+        return current;
+    }
+};
+
+// One change to the persisted ledger, produced by each mutation
+struct ChangeRecord {
+    enum Type {
+        Upsert,     // Add or replace the expense with row.getId(); key is its previous segment
+        Erase,      // Remove the expense with the given id from segment key
+        Reset,      // Replace the hot ledger (clear all, restore)
+        Seed,       // Manifest read at startup, nothing to write
+        Rewrite,    // Initial contents that must be rewritten (format migration)
+        Seal,       // A year was moved into the archive described by sealed[0]
+        Unseal,     // Archives were dropped; rows is the complete hot ledger
+        Replace     // New contents of some segments (undo, redo)
+    };
+    
+    Type type;
+    int id;
+    string key;                     // Segment holding the expense before the change, if any
+    Expense row;
+    vector<Expense> rows;
+    vector<SegmentInfo> sealed;     // Archives on disk (Rewrite) or the new one (Seal)
+    LedgerStore::Snapshot segments; // Replace: segment contents, null when removed
+    LedgerManifest manifest;        // Seed; Rewrite: the ledger being rewritten, if any
+    
+    static ChangeRecord upsert(const Expense& expense, const string& previousKey = "") {
+        ChangeRecord record;
+        record.type = Upsert;
+        record.id = expense.getId();
+        record.key = previousKey;
+        record.row = expense;
+        return record;
+    }
+    
+    static ChangeRecord erase(int expenseId, const string& segmentKey) {
+        ChangeRecord record;
+        record.type = Erase;
+        record.id = expenseId;
+        record.key = segmentKey;
+        return record;
+    }
+    
+    static ChangeRecord reset(const vector<Expense>& all, Type type = Reset) {
+        ChangeRecord record;
+        record.type = type;
+        record.id = 0;
+        record.rows = all;
+        return record;
+    }
+    
+    static ChangeRecord seed(const LedgerManifest& onDisk) {
+        ChangeRecord record;
+        record.type = Seed;
+        record.id = 0;
+        record.manifest = onDisk;
+        return record;
+    }
+    
+    static ChangeRecord seal(const SegmentInfo& archive) {
+        ChangeRecord record;
+        record.type = Seal;
+        record.id = 0;
+        record.sealed.push_back(archive);
+        return record;
+    }
+    
+    static ChangeRecord replace(const LedgerStore::Snapshot& contents) {
+        ChangeRecord record;
+        record.type = Replace;
+        record.id = 0;
+        record.segments = contents;
+        return record;
+    }
+};
+
+// Undo history that does not fit in memory. The oldest undo and redo
+// steps are moved here, and at exit the rest follow, so that undo and
+// redo survive a restart. A step lists, for each partition it restores,
+// where those rows are in the file; rows shared by several steps are
+// written once.
+//
+//   #UNDO 1
+//   #ROWS <key> <raw bytes> <compressed bytes> <crc32c, hex>   per version of a partition,
+//   <LZ4-compressed rows>                                        appended as steps move here
+//   #STEPS <undo count> <redo count> <bytes> <crc32c, hex>    written at exit: one line per
+//   <key> <offset> <key> <offset> ...                           step, oldest undo step first
+//   #LEDGER <generation, 20 digits> <manifest crc32c> <#STEPS offset, 20 digits>
+//
+// Offset 0 means the step removes the partition. Like the ID index, the
+// trailer ties the steps to one manifest: if the ledger was written since,
+// or the tracker did not exit cleanly, the history is discarded.
+class UndoLog {
+public:
+    typedef map<string, uint64_t> Step;     // Partition key -> offset of its #ROWS record, 0 if absent
+    
+private:
+    static const size_t TRAILER_SIZE = 59;  // "#LEDGER " + 20 digits + " " + 8 hex + " " + 20 digits + "\n"
+    
+    string path;
+    uint64_t length = 0;                    // File size; 0 until the first record is written
+    deque<Step> undoSteps;                  // Oldest first
+    deque<Step> redoSteps;                  // Farthest from being redone first
+    // Rows in the file that are also in memory, both ways round, so a
+    // version is written once and read back once however many steps share it
+    map<const ExpenseRows*, pair<weak_ptr<const ExpenseRows>, uint64_t>> offsets;
+    map<uint64_t, weak_ptr<const ExpenseRows>> versions;
+    
+    void remember(const shared_ptr<const ExpenseRows>& rows, uint64_t offset) {
+        for (auto it = offsets.begin(); it != offsets.end();) {
+            it = it->second.first.expired() ? offsets.erase(it) : next(it);
+        }
+        for (auto it = versions.begin(); it != versions.end();) {
+            it = it->second.expired() ? versions.erase(it) : next(it);
+        }
+        offsets[rows.get()] = make_pair(weak_ptr<const ExpenseRows>(rows), offset);
+        versions[offset] = rows;
+    }
+    
+    bool append(const string& bytes) {
+        if (length == 0) {
+            // A new file, replacing any stale one
+            ofstream file(path, ios::binary | ios::trunc);
+            file << "#UNDO 1\n";
+            if (!file) return false;
+            length = 8;
+        }
+        ofstream file(path, ios::binary | ios::app);
+        if (!file.is_open()) return false;
+        file.write(bytes.data(), bytes.size());
+        file.flush();
+        if (file.fail()) return false;
+        length += bytes.size();
+        RuntimeMetrics::add(RuntimeMetrics::bytesWritten, bytes.size());
+        return true;
+    }
+    
+    // Offset of the rows in the file, writing them there if needed
+    bool write(const string& key, const shared_ptr<const ExpenseRows>& rows, uint64_t& offset) {
+        offset = 0;
+        if (!rows || rows->empty()) return true;
+        auto known = offsets.find(rows.get());
+        if (known != offsets.end() && known->second.first.lock() == rows) {
+            offset = known->second.second;
+            return true;
+        }
+        
+        string raw;
+        for (const auto& expense : *rows) {
+            raw += expense.toString();
+            raw += '\n';
+        }
+        string compressed = Lz4Block::compress(raw);
+        char header[96];
+        snprintf(header, sizeof(header), "#ROWS %s %zu %zu %08x\n", key.c_str(), raw.size(), compressed.size(),
+                 Crc32c::compute(compressed.data(), compressed.size()));
+        if (length == 0 && !append("")) return false;
+        uint64_t at = length;
+        if (!append(header + compressed)) return false;
+        offset = at;
+        remember(rows, offset);
+        return true;
+    }
+    
+    // Read a #ROWS record: its header and compressed rows
+    bool readRecord(ifstream& file, uint64_t offset, string& header, string& compressed,
+                    size_t& rawSize, uint32_t& expected) const {
+        file.clear();
+        file.seekg((streamoff)offset);
+        char key[32];
+        size_t compressedSize = 0;
+        unsigned int crc = 0;
+        if (!getline(file, header) ||
+            sscanf(header.c_str(), "#ROWS %31s %zu %zu %x", key, &rawSize, &compressedSize, &crc) != 4 ||
+            offset + header.size() + 1 + compressedSize > length) {
+            return false;
+        }
+        compressed.assign(compressedSize, '\0');
+        file.read(&compressed[0], (streamsize)compressedSize);
+        expected = crc;
+        return (bool)file;
+    }
+    
+    bool read(uint64_t offset, shared_ptr<const ExpenseRows>& rows) {
+        rows.reset();
+        if (offset == 0) return true;
+        auto known = versions.find(offset);
+        if (known != versions.end() && (rows = known->second.lock())) return true;
+        
+        ifstream file(path, ios::binary);
+        string header, compressed, raw;
+        size_t rawSize = 0;
+        uint32_t expected = 0;
+        if (!file.is_open() || !readRecord(file, offset, header, compressed, rawSize, expected) ||
+            Crc32c::compute(compressed.data(), compressed.size()) != expected ||
+            !Lz4Block::decompress(compressed, rawSize, raw)) {
+            return false;
+        }
+        
+        MemoryTagScope memory(MemoryTag::Snapshots);
+        vector<Expense> parsed;
+        string_view text(raw);
+        while (!text.empty()) {
+            size_t end = min(text.find('\n'), text.size());
+            Expense expense = Expense::fromString(text.substr(0, end));
+            if (expense.getId() > 0) parsed.push_back(move(expense));
+            text.remove_prefix(min(end + 1, text.size()));
+        }
+        rows = make_shared<ExpenseRows>(move(parsed));
+        remember(rows, offset);
+        return true;
+    }
+    
+    bool push(deque<Step>& steps, const LedgerStore::Snapshot& state) {
+        Step step;
+        for (const auto& entry : state) {
+            if (!write(entry.first, entry.second, step[entry.first])) return false;
+        }
+        steps.push_back(move(step));
+        return true;
+    }
+    
+    // Newest step back in memory. An unreadable step takes the older ones
+    // with it: they could only be reached through it.
+    bool pop(deque<Step>& steps, LedgerStore::Snapshot& state) {
+        MemoryTagScope memory(MemoryTag::Snapshots);
+        state.clear();
+        for (const auto& entry : steps.back()) {
+            if (!read(entry.second, state[entry.first])) {
+                steps.clear();
+                return false;
+            }
+        }
+        steps.pop_back();
+        return true;
+    }
+    
+    static string encodeSteps(const deque<Step>& steps) {
+        string out;
+        for (const auto& step : steps) {
+            string line;
+            for (const auto& entry : step) {
+                line += (line.empty() ? "" : " ") + entry.first + " " + to_string(entry.second);
+            }
+            out += line + "\n";
+        }
+        return out;
+    }
+    
+    bool decodeSteps(stringstream& lines, size_t count, uint64_t limit, deque<Step>& steps) {
+        string line;
+        for (size_t i = 0; i < count; i++) {
+            if (!getline(lines, line)) return false;
+            stringstream fields(line);
+            Step step;
+            string key;
+            uint64_t offset;
+            while (fields >> key) {
+                if (!(fields >> offset) || (offset != 0 && (offset < 8 || offset >= limit))) return false;
+                step[key] = offset;
+            }
+            steps.push_back(move(step));
+        }
+        return true;
+    }
+    
+    // Copy the records the steps still use to a fresh file, dropping the
+    // ones only discarded steps used
+    bool compact() {
+        ifstream file(path, ios::binary);
+        string temp = path + ".tmp";
+        ofstream out(temp, ios::binary | ios::trunc);
+        if (!file.is_open() || !out.is_open()) return false;
+        
+        map<uint64_t, uint64_t> moved;
+        uint64_t position = 8;
+        out << "#UNDO 1\n";
+        for (auto* steps : {&undoSteps, &redoSteps}) {
+            for (auto& step : *steps) {
+                for (auto& entry : step) {
+                    if (entry.second == 0) continue;
+                    auto done = moved.find(entry.second);
+                    if (done == moved.end()) {
+                        string header, compressed;
+                        size_t rawSize = 0;
+                        uint32_t expected = 0;
+                        if (!readRecord(file, entry.second, header, compressed, rawSize, expected)) return false;
+                        out << header << '\n' << compressed;
+                        done = moved.insert(make_pair(entry.second, position)).first;
+                        position += header.size() + 1 + compressed.size();
+                    }
+                    entry.second = done->second;
+                }
+            }
+        }
+        out.close();
+        if (out.fail() || rename(temp.c_str(), path.c_str()) != 0) return false;
+        length = position;
+        offsets.clear();
+        versions.clear();
+        return true;
+    }
+    
+public:
+    static string fileFor(const string& ledger) {
+        return ledger + ".undo";
+    }
+    
+    // Take over the steps saved by the last exit if they were saved with
+    // this manifest. Returns false if a history was there but is stale or
+    // damaged; it is deleted.
+    bool open(const string& file, unsigned long long generation, uint32_t manifestChecksum) {
+        path = file;
+        undoSteps.clear();
+        redoSteps.clear();
+        offsets.clear();
+        versions.clear();
+        length = 0;
+        
+        fstream in(path, ios::binary | ios::in | ios::out);
+        if (!in.is_open()) return true;
+        in.seekg(0, ios::end);
+        uint64_t size = (uint64_t)in.tellg();
+        char trailer[TRAILER_SIZE + 1] = {0};
+        unsigned long long savedGeneration = 0;
+        unsigned int savedChecksum = 0;
+        size_t stepsAt = 0;
+        if (size >= 8 + TRAILER_SIZE) {
+            in.seekg((streamoff)(size - TRAILER_SIZE));
+            in.read(trailer, TRAILER_SIZE);
+        }
+        bool current = sscanf(trailer, "#LEDGER %llu %x %zu", &savedGeneration, &savedChecksum, &stepsAt) == 3 &&
+                       savedGeneration == generation && savedChecksum == manifestChecksum &&
+                       stepsAt >= 8 && stepsAt < size - TRAILER_SIZE;
+        
+        string steps;
+        size_t undoCount = 0, redoCount = 0, bytes = 0;
+        unsigned int expected = 0;
+        if (current) {
+            in.seekg((streamoff)stepsAt);
+            string header;
+            getline(in, header);
+            current = sscanf(header.c_str(), "#STEPS %zu %zu %zu %x", &undoCount, &redoCount, &bytes, &expected) == 4 &&
+                      stepsAt + header.size() + 1 + bytes + TRAILER_SIZE == size;
+        }
+        if (current) {
+            steps.assign(bytes, '\0');
+            in.read(&steps[0], (streamsize)bytes);
+            stringstream lines(steps);
+            current = in && Crc32c::compute(steps.data(), steps.size()) == expected &&
+                      decodeSteps(lines, undoCount, stepsAt, undoSteps) &&
+                      decodeSteps(lines, redoCount, stepsAt, redoSteps);
+        }
+        if (!current) {
+            in.close();
+            clear();
+            return false;
+        }
+        
+        // Until the next clean exit the steps live only in memory
+        in.seekp((streamoff)(size - TRAILER_SIZE));
+        in.write("#STALE ", 7);
+        length = size;
+        return true;
+    }
+    
+    size_t undoCount() const { return undoSteps.size(); }
+    size_t redoCount() const { return redoSteps.size(); }
+    
+    bool pushUndo(const LedgerStore::Snapshot& state) { return push(undoSteps, state); }
+    bool pushRedo(const LedgerStore::Snapshot& state) { return push(redoSteps, state); }
+    bool popUndo(LedgerStore::Snapshot& state) { return pop(undoSteps, state); }
+    bool popRedo(LedgerStore::Snapshot& state) { return pop(redoSteps, state); }
+    void dropOldestUndo() { undoSteps.pop_front(); }
+    void clearRedo() { redoSteps.clear(); }
+    
+    // Whether every step here records the partition
+    bool recordedByAll(const string& key) const {
+        for (const auto* steps : {&undoSteps, &redoSteps}) {
+            for (const auto& step : *steps) {
+                if (step.count(key) == 0) return false;
+            }
+        }
+        return true;
+    }
+    
+    // Forget every step and delete the file
+    void clear() {
+        undoSteps.clear();
+        redoSteps.clear();
+        offsets.clear();
+        versions.clear();
+        length = 0;
+        if (!path.empty()) remove(path.c_str());
+    }
+    
+    // Add the session-start contents of partitions changed after a step
+    // was written to the step, so that it no longer needs them in memory
+    // (or, after a restart, from a session that is gone)
+    bool complete(const LedgerStore::Snapshot& sessionStart) {
+        for (auto* steps : {&undoSteps, &redoSteps}) {
+            for (auto& step : *steps) {
+                for (const auto& entry : sessionStart) {
+                    if (step.count(entry.first) > 0) continue;
+                    uint64_t offset;
+                    if (!write(entry.first, entry.second, offset)) return false;
+                    step[entry.first] = offset;
+                }
+            }
+        }
+        return true;
+    }
+    
+    // Write the steps, completed, and seal them to the manifest now on disk
+    bool close(const LedgerStore::Snapshot& sessionStart, unsigned long long generation, uint32_t manifestChecksum) {
+        if (undoSteps.empty() && redoSteps.empty()) {
+            clear();
+            return true;
+        }
+        if (!complete(sessionStart)) return false;
+        
+        // Rewrite once more than half the file belongs to discarded steps
+        set<uint64_t> used;
+        for (const auto* steps : {&undoSteps, &redoSteps}) {
+            for (const auto& step : *steps) {
+                for (const auto& entry : step) {
+                    if (entry.second != 0) used.insert(entry.second);
+                }
+            }
+        }
+        uint64_t usedBytes = 0;
+        {
+            ifstream file(path, ios::binary);
+            for (uint64_t offset : used) {
+                string header, compressed;
+                size_t rawSize = 0;
+                uint32_t expected = 0;
+                if (readRecord(file, offset, header, compressed, rawSize, expected)) {
+                    usedBytes += header.size() + 1 + compressed.size();
+                }
+            }
+        }
+        if (length > 2 * usedBytes + (1 << 20) && !compact()) return false;
+        if (length == 0 && !append("")) return false;     // Steps that restore no rows wrote no header yet
+        
+        string steps = encodeSteps(undoSteps) + encodeSteps(redoSteps);
+        char header[96];
+        snprintf(header, sizeof(header), "#STEPS %zu %zu %zu %08x\n", undoSteps.size(), redoSteps.size(),
+                 steps.size(), Crc32c::compute(steps.data(), steps.size()));
+        char trailer[TRAILER_SIZE + 1];
+        snprintf(trailer, sizeof(trailer), "#LEDGER %020llu %08x %020llu\n", generation,
+                 (unsigned int)manifestChecksum, (unsigned long long)length);
+        return append(header + steps + trailer);
+    }
+};
+
+// Point-in-time backups built from the change journal. The first backup of
+// a chain is a full copy of the ledger; each later one is just the journal
+// of changes made since the previous backup, so backing up a large ledger
+// after a few edits costs a file rename. A catalog file lists every backup
+// in order, and old chains are pruned once enough newer ones exist.
+//
+// Journal lines:  U|<expense row>   add or replace
+//                 D|<id>            delete
+//                 R|                clear (followed by U lines for a reset)
+class BackupStore {
+public:
+    static const size_t INCREMENTALS_PER_FULL = 10;     // Chain length before a new full backup
+    static const size_t RETAINED_CHAINS = 3;            // Full backups kept, with their increments
+    
+    struct Entry {
+        int sequence;           // Increasing backup number
+        time_t created;
+        bool full;              // Full copy or journal increment
+        size_t records;         // Rows (full) or journal records (increment)
+        string file;
+    };
+    
+private:
+    string ledger;
+    string catalogFile;
+    vector<Entry> entries;
+    
+    void load() {
+        ifstream catalog(catalogFile);
+        string line;
+        while (getline(catalog, line)) {
+            stringstream ss(line);
+            Entry entry;
+            string type;
+            long long created;
+            if (ss >> entry.sequence >> created >> type >> entry.records >> entry.file) {
+                entry.created = (time_t)created;
+                entry.full = (type == "full");
+                entries.push_back(entry);
+            }
+        }
+    }
+    
+    static string describe(const Entry& entry) {
+        return to_string(entry.sequence) + " " + to_string((long long)entry.created) + " " +
+               (entry.full ? "full" : "inc") + " " + to_string(entry.records) + " " + entry.file;
+    }
+    
+    bool saveCatalog() const {
+        string contents;
+        for (const auto& entry : entries) {
+            contents += describe(entry) + "\n";
+        }
+        return LedgerFile::writeAtomic(catalogFile, contents);
+    }
+    
+public:
+    explicit BackupStore(const string& ledgerFile)
+        : ledger(ledgerFile), catalogFile(ledgerFile + ".backups") {
+        load();
+    }
+    
+    const vector<Entry>& list() const { return entries; }
+    
+    static string journalFile(const string& ledgerFile) {
+        return ledgerFile + ".journal";
+    }
+    
+    // A new chain starts on the first backup and after every few increments
+    bool needsFullBackup() const {
+        size_t sinceFull = 0;
+        for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+            if (it->full) return sinceFull >= INCREMENTALS_PER_FULL;
+            sinceFull++;
+        }
+        return true;
+    }
+    
+    // File name for the next backup of the given kind
+    Entry prepare(bool full) const {
+        Entry entry;
+        entry.sequence = entries.empty() ? 1 : entries.back().sequence + 1;
+        entry.created = time(0);
+        entry.full = full;
+        entry.records = 0;
+        entry.file = ledger + ".backup." + to_string(entry.sequence) + (full ? ".full" : ".inc");
+        return entry;
+    }
+    
+    bool commit(const Entry& entry) {
+        entries.push_back(entry);
+        return saveCatalog();
+    }
+    
+    // Delete whole chains older than the newest RETAINED_CHAINS full backups;
+    // returns the number of backup files removed
+    size_t prune() {
+        size_t fulls = 0, cut = 0;
+        for (size_t i = entries.size(); i-- > 0;) {
+            if (entries[i].full && ++fulls == RETAINED_CHAINS) {
+                cut = i;
+                break;
+            }
+        }
+        if (cut == 0) return 0;
+        
+        for (size_t i = 0; i < cut; i++) {
+            remove(entries[i].file.c_str());
+        }
+        entries.erase(entries.begin(), entries.begin() + cut);
+        saveCatalog();
+        return cut;
+    }
+    
+    // Apply journal contents to rows keyed by expense ID
+    static void replay(const string& journal, map<int, string>& rows) {
+        stringstream ss(journal);
+        string line;
+        while (getline(ss, line)) {
+            if (line.size() < 2 || line[1] != '|') continue;
+            string body = line.substr(2);
+            try {
+                switch (line[0]) {
+                    case 'U':
+                        rows[stoi(body)] = body;
+                        break;
+                    case 'D':
+                        rows.erase(stoi(body));
+                        break;
+                    case 'R':
+                        rows.clear();
+                        break;
+                }
+            } catch (const exception&) {
+                // Damaged journal line: skip it, the rest still applies
+            }
+        }
+    }
+    
+    // Rebuild the ledger as of backup index (position in list())
+    bool rebuild(size_t index, map<int, string>& rows, string& error) const {
+        size_t base = index + 1;
+        while (base-- > 0 && !entries[base].full) {}
+        if (base > index) {
+            error = "no full backup precedes the selected point";
+            return false;
+        }
+        
+        rows.clear();
+        for (size_t i = base; i <= index; i++) {
+            string contents;
+            if (!LedgerFile::readAll(entries[i].file, contents)) {
+                error = "missing backup file " + entries[i].file;
+                return false;
+            }
+            if (entries[i].full) {
+                LedgerFile::ReadResult result = LedgerFile::parse(contents);
+                if (!result.failures.empty() || !result.complete) {
+                    error = "backup file " + entries[i].file + " failed verification";
+                    return false;
+                }
+                for (const auto& row : result.rows) {
+                    int id = 0;
+                    if (from_chars(row.data(), row.data() + row.size(), id).ec == errc()) {
+                        rows[id] = string(row);
+                    }
+                }
+            } else {
+                replay(contents, rows);
+            }
+        }
+        return true;
+    }
+};
+
+// Background persistence: mutations enqueue change records and return
+// immediately. The writer thread drains everything queued since its last
+// pass, applies it to the segments it touches (read from disk on first use
+// in the pass) and commits the burst at once (group commit), writing new
+// files for only those segments and then the manifest that names them.
+// Files the new manifest no longer names are deleted after it is in
+// place. Every committed change is
+// also appended to the journal that incremental backups are cut from.
+// When the writer stops it brings the ID index up to date, reusing the
+// entries of every segment it did not touch.
+class PersistenceWriter {
+private:
+    string filename;
+    string journalFile;
+    PartitionScheme scheme;
+    map<string, map<int, Expense>> segments;    // Segments touched by the current pass
+    LedgerManifest manifest;                    // Metadata as last written
+    set<string> dirty;                          // Segments changed since last commit; absent ones are removed
+    bool manifestDirty;                         // Archive list changed since last commit
+    set<string> files;                          // Segment and archive files on disk: those the
+                                                // manifest names, plus any from failed commits
+    LedgerIndex baseIndex;                      // ID index as of startup, if it was current
+    set<string> touched;                        // Index keys rewritten since startup
+    bool indexStale;                            // ID index must be rewritten on stop
+    bool manifestOnDisk;                        // There is a ledger to index
+    deque<ChangeRecord> pending;                // Records not yet applied
+    string journal;                             // Journal lines of the current batch
+    mutex queueMutex;
+    mutex journalMutex;                 // Held while appending to or rotating the journal
+    condition_variable workReady;       // Signalled when records are queued
+    condition_variable commitDone;      // Signalled after each group commit
+    unsigned long long enqueued;        // Sequence number of the last record queued
+    unsigned long long committed;       // Sequence number of the last record on disk
+    bool stopping;
+    vector<string> failures;            // Write errors not yet reported by the UI thread
+    thread worker;
+    
+    // Rows of a segment as committed, read from its file the first time
+    // the pass needs it. Segments already replaced or removed in this pass
+    // are not read back.
+    map<int, Expense>& segmentRows(const string& key) {
+        auto it = segments.find(key);
+        if (it != segments.end()) return it->second;
+        
+        map<int, Expense>& rows = segments[key];
+        auto info = manifest.segments.find(key);
+        if (dirty.count(key) == 0 && info != manifest.segments.end()) {
+            vector<Expense> stored;
+            LedgerStore::readSegment(LedgerManifest::segmentFile(filename, key, info->second.file), stored, false);
+            for (const auto& expense : stored) {
+                rows[expense.getId()] = expense;
+            }
+        }
+        return rows;
+    }
+    
+    // Mark every segment on disk or in this pass as rewritten, then start
+    // from an empty ledger
+    void discardAll() {
+        for (const auto& segment : manifest.segments) {
+            dirty.insert(segment.first);
+        }
+        for (const auto& segment : segments) {
+            dirty.insert(segment.first);
+        }
+        segments.clear();
+    }
+    
+    // Files the manifest as it stands refers to
+    set<string> namedFiles() const {
+        set<string> named;
+        for (const auto& segment : manifest.segments) {
+            named.insert(LedgerManifest::segmentFile(filename, segment.first, segment.second.file));
+        }
+        for (const auto& archive : manifest.archives) {
+            named.insert(LedgerArchive::fileFor(filename, archive.first, archive.second.file));
+        }
+        return named;
+    }
+    
+    void apply(const ChangeRecord& record) {
+        switch (record.type) {
+            case ChangeRecord::Upsert: {
+                string key = scheme.keyFor(record.row.getDate());
+                if (!record.key.empty() && record.key != key) {
+                    segmentRows(record.key).erase(record.id);
+                    dirty.insert(record.key);
+                }
+                segmentRows(key)[record.id] = record.row;
+                dirty.insert(key);
+                journal += "U|" + record.row.toString() + "\n";
+                break;
+            }
+            case ChangeRecord::Erase:
+                segmentRows(record.key).erase(record.id);
+                dirty.insert(record.key);
+                journal += "D|" + to_string(record.id) + "\n";
+                break;
+            case ChangeRecord::Seed:
+                // Startup contents are already on disk: only learn their metadata
+                manifest = record.manifest;
+                files = namedFiles();
+                manifestOnDisk = manifest.checksum != 0;
+                indexStale = manifestOnDisk &&
+                    !baseIndex.open(LedgerIndex::fileFor(filename), manifest.generation, manifest.checksum);
+                break;
+            case ChangeRecord::Reset:
+            case ChangeRecord::Rewrite:
+            case ChangeRecord::Unseal:
+                if (record.type == ChangeRecord::Rewrite) {
+                    // Carry on from the ledger being rewritten, so new file
+                    // names follow its generation and its files are cleaned up
+                    manifest = record.manifest;
+                    files = namedFiles();
+                }
+                discardAll();
+                if (record.type == ChangeRecord::Reset) journal += "R|\n";
+                for (const auto& expense : record.rows) {
+                    string key = scheme.keyFor(expense.getDate());
+                    segments[key][expense.getId()] = expense;
+                    dirty.insert(key);
+                    if (record.type == ChangeRecord::Reset) journal += "U|" + expense.toString() + "\n";
+                }
+                if (record.type == ChangeRecord::Rewrite) {
+                    manifest.archives.clear();
+                    for (const auto& archive : record.sealed) {
+                        manifest.archives[archive.key] = archive;
+                    }
+                    manifestDirty = true;
+                }
+                if (record.type == ChangeRecord::Unseal) {
+                    manifest.archives.clear();      // Their files go after the commit
+                    manifestDirty = true;
+                }
+                break;
+            case ChangeRecord::Replace: {
+                // Journal the difference: deletions first, so a row that moved
+                // between segments is not deleted after being re-added
+                set<int> kept;
+                for (const auto& entry : record.segments) {
+                    if (!entry.second) continue;
+                    for (const auto& expense : *entry.second) kept.insert(expense.getId());
+                }
+                for (const auto& entry : record.segments) {
+                    for (const auto& row : segmentRows(entry.first)) {
+                        if (kept.count(row.first) == 0) journal += "D|" + to_string(row.first) + "\n";
+                    }
+                }
+                for (const auto& entry : record.segments) {
+                    map<int, Expense>& previous = segmentRows(entry.first);
+                    map<int, Expense> rows;
+                    if (entry.second) {
+                        for (const auto& expense : *entry.second) {
+                            string line = expense.toString();
+                            auto old = previous.find(expense.getId());
+                            if (old == previous.end() || old->second.toString() != line) {
+                                journal += "U|" + line + "\n";
+                            }
+                            rows[expense.getId()] = expense;
+                        }
+                    }
+                    previous.swap(rows);
+                    dirty.insert(entry.first);
+                }
+                break;
+            }
+            case ChangeRecord::Seal: {
+                // The archive file is already written; drop the year's hot segments
+                const SegmentInfo& archive = record.sealed[0];
+                set<string> keys;
+                for (const auto& segment : manifest.segments) keys.insert(segment.first);
+                for (const auto& segment : segments) keys.insert(segment.first);
+                for (const auto& key : keys) {
+                    if (key != "undated" && key.compare(0, 4, archive.key) == 0) {
+                        segments.erase(key);
+                        dirty.insert(key);
+                    }
+                }
+                manifest.archives[archive.key] = archive;
+                files.insert(LedgerArchive::fileFor(filename, archive.key, archive.file));
+                touched.insert(LedgerIndex::archiveKey(archive.key));
+                manifestDirty = true;
+                break;
+            }
+        }
+    }
+    
+    // Refresh the entry of a segment in the manifest about to be committed,
+    // whose generation names the segment's new file
+    static void summarize(LedgerManifest& target, const string& key, const map<int, Expense>& rows) {
+        SegmentInfo info;
+        LedgerAggregates totals;
+        info.key = key;
+        info.file = target.generation;
+        for (const auto& row : rows) {
+            info.add(row.second);
+            totals.add(row.second);
+        }
+        target.segments[key] = info;
+        target.aggregates[key] = totals;
+    }
+    
+    // Make the batch's journal lines durable. They stay queued on failure
+    // and go out with the next commit.
+    bool appendJournal() {
+        if (journal.empty()) return true;
+        TRACE_SPAN("save: append journal");
+        lock_guard<mutex> guard(journalMutex);
+        if (!LedgerFile::appendDurable(journalFile, journal)) return false;
+        journal.clear();
+        return true;
+    }
+    
+    // Write dirty segments to new files, append the journal, then commit
+    // the manifest that names the new files. The journal goes first so a
+    // crash after the commit cannot leave changes missing from the backup
+    // chain. On failure the manifest and the files it names are as they
+    // were, and the next pass tries again.
+    bool writeLedger(string& error) {
+        TRACE_SPAN("save: write segments");
+        LedgerManifest next = manifest;
+        next.generation++;
+        for (const auto& key : dirty) {
+            auto segment = segments.find(key);
+            if (segment == segments.end() || segment->second.empty()) {
+                next.segments.erase(key);
+                next.aggregates.erase(key);
+                continue;
+            }
+            
+            LedgerFile::Encoder encoder;
+            for (const auto& row : segment->second) {
+                encoder.add(row.second.toString());
+            }
+            string path = LedgerManifest::segmentFile(filename, key, next.generation);
+            files.insert(path);
+            if (!LedgerFile::writeAtomic(path, encoder.finish())) {
+                error = "Could not save to file " + filename;
+                return false;
+            }
+            summarize(next, key, segment->second);
+        }
+        
+        if (!appendJournal()) {
+            error = "Could not append to " + journalFile + "; the ledger was not saved";
+            return false;
+        }
+        
+        next.scheme = scheme;
+        string text = next.encode();
+        if (!LedgerFile::writeAtomic(filename, text)) {
+            error = "Could not save to file " + filename;
+            return false;
+        }
+        manifest = move(next);
+        manifest.checksum = Crc32c::compute(text.data(), text.size());
+        touched.insert(dirty.begin(), dirty.end());
+        indexStale = manifestOnDisk = true;
+        
+        // Committed: files of replaced segments and dropped archives can go
+        set<string> named = namedFiles();
+        for (const auto& file : files) {
+            if (named.count(file) == 0) remove(file.c_str());
+        }
+        files.swap(named);
+        dirty.clear();
+        manifestDirty = false;
+        segments.clear();       // The next pass reads what it needs from disk
+        return true;
+    }
+    
+    // Write the ID index for the manifest as last written. Entries of
+    // segments and archives untouched since startup come from the mapped
+    // index; the others are read from their files.
+    void writeIndex() {
+        TRACE_SPAN("save: write index");
+        vector<string> keys;
+        map<string, uint32_t> numbers;
+        for (const auto& segment : manifest.segments) {
+            numbers[segment.first] = (uint32_t)keys.size();
+            keys.push_back(segment.first);
+        }
+        for (const auto& archive : manifest.archives) {
+            string key = LedgerIndex::archiveKey(archive.first);
+            numbers[key] = (uint32_t)keys.size();
+            keys.push_back(key);
+        }
+        
+        vector<LedgerIndex::Entry> reused, fresh;
+        set<string> reusable;
+        if (baseIndex.valid()) {
+            vector<int64_t> renumber;
+            for (const auto& key : baseIndex.keys()) {
+                auto number = numbers.find(key);
+                bool keep = number != numbers.end() && touched.count(key) == 0;
+                renumber.push_back(keep ? (int64_t)number->second : -1);
+                if (keep) reusable.insert(key);
+            }
+            reused.reserve(baseIndex.size());
+            for (size_t i = 0; i < baseIndex.size(); i++) {
+                const LedgerIndex::Entry& entry = baseIndex.entry(i);
+                if (renumber[entry.key] >= 0) {
+                    LedgerIndex::Entry copy = {entry.id, (uint32_t)renumber[entry.key]};
+                    reused.push_back(copy);
+                }
+            }
+        }
+        for (const auto& key : keys) {
+            if (reusable.count(key)) continue;
+            vector<Expense> rows;
+            string error;
+            if (key[0] == '@') {
+                const string year = key.substr(1);
+                LedgerArchive::readRows(LedgerArchive::fileFor(filename, year, manifest.archives.at(year).file),
+                                        rows, error);
+            } else {
+                const SegmentInfo& info = manifest.segments.at(key);
+                LedgerStore::readSegment(LedgerManifest::segmentFile(filename, key, info.file), rows, false);
+            }
+            for (const auto& expense : rows) {
+                LedgerIndex::Entry entry = {expense.getId(), numbers[key]};
+                fresh.push_back(entry);
+            }
+        }
+        
+        auto byId = [](const LedgerIndex::Entry& a, const LedgerIndex::Entry& b) { return a.id < b.id; };
+        sort(fresh.begin(), fresh.end(), byId);
+        vector<LedgerIndex::Entry> entries(reused.size() + fresh.size());
+        merge(reused.begin(), reused.end(), fresh.begin(), fresh.end(), entries.begin(), byId);
+        
+        baseIndex.close();
+        LedgerFile::writeAtomic(LedgerIndex::fileFor(filename),
+                                LedgerIndex::encode(manifest.generation, manifest.checksum, keys, entries));
+    }
+    
+    void run() {
+        MemoryTagScope memory(MemoryTag::Persistence);
+        unique_lock<mutex> guard(queueMutex);
+        while (true) {
+            workReady.wait(guard, [this] { return stopping || !pending.empty(); });
+            if (pending.empty() && stopping) break;
+            
+            // Take the whole burst; producers keep queueing while we write
+            deque<ChangeRecord> batch;
+            batch.swap(pending);
+            unsigned long long batchEnd = enqueued;
+            guard.unlock();
+            string error;
+            
+            {
+                LatencyScope latency(Metric::Save);
+                TRACE_SPAN("save: commit");
+                {
+                    TRACE_SPAN("save: apply changes");
+                    for (const auto& record : batch) {
+                        apply(record);
+                    }
+                }
+                if (!dirty.empty() || manifestDirty) writeLedger(error);
+                else if (!appendJournal()) error = "Could not append to " + journalFile;
+            }
+            
+            guard.lock();
+            if (!error.empty()) failures.push_back(error);
+            committed = batchEnd;
+            commitDone.notify_all();
+        }
+        
+        if (indexStale && manifestOnDisk) writeIndex();
+    }
+    
+public:
+    PersistenceWriter(const string& file, const PartitionScheme& partitioning)
+        : filename(file), journalFile(BackupStore::journalFile(file)), scheme(partitioning),
+          manifestDirty(false), indexStale(false), manifestOnDisk(false),
+          enqueued(0), committed(0), stopping(false) {
+        worker = thread(&PersistenceWriter::run, this);
+    }
+    
+    ~PersistenceWriter() {
+        {
+            lock_guard<mutex> guard(queueMutex);
+            stopping = true;
+        }
+        workReady.notify_one();
+        worker.join();
+    }
+    
+    PersistenceWriter(const PersistenceWriter&) = delete;
+    PersistenceWriter& operator=(const PersistenceWriter&) = delete;
+    
+    void enqueue(ChangeRecord record) {
+        {
+            MemoryTagScope memory(MemoryTag::Persistence);
+            lock_guard<mutex> guard(queueMutex);
+            pending.push_back(move(record));
+            enqueued++;
+        }
+        workReady.notify_one();
+    }
+    
+    // Barrier: block until every record queued before the call is on disk
+    void flush() {
+        unique_lock<mutex> guard(queueMutex);
+        unsigned long long target = enqueued;
+        commitDone.wait(guard, [this, target] { return committed >= target; });
+    }
+    
+    // Write errors since the last call. The writer thread only records
+    // them, so its messages never land in the middle of a menu prompt.
+    vector<string> takeFailures() {
+        lock_guard<mutex> guard(queueMutex);
+        vector<string> taken;
+        taken.swap(failures);
+        return taken;
+    }
+    
+    // Flush, then run action with the journal file quiescent so it can be
+    // copied, renamed or truncated without racing the writer thread
+    template <typename Action>
+    void withJournal(Action action) {
+        flush();
+        lock_guard<mutex> guard(journalMutex);
+        action(journalFile);
+    }
+};
+
+// When a recurring expense falls due, to the day. The calendar rules
+// repeat every N days, weeks, months or years from the start date; a
+// monthly rule started on the 31st falls on the last day of shorter
+// months. The cron rule takes cron's three day fields, each "*", a
+// number, a range "a-b" or a list of them, optionally with a step "/s":
+//
+//   daily  weekly/2  monthly  monthly/3  yearly  cron 1,15 * *  cron * * 1-5
+//
+// As in cron, when both day of month and day of week are restricted a
+// day matching either is due.
+struct RecurrenceRule {
+    enum Kind { Daily, Weekly, Monthly, Yearly, Cron };
+    
+    Kind kind = Monthly;
+    int interval = 1;                   // Calendar rules: every N periods
+    vector<bool> monthDays, months, weekdays;   // Cron: allowed values, indexed by value
+    bool anyMonthDay = true, anyWeekday = true;
+    string cronFields;                  // Cron: the fields as given
+    
+    static bool parse(const string& text, RecurrenceRule& rule, string& error) {
+        stringstream ss(Validator::toLower(Validator::trim(text)));
+        string word;
+        ss >> word;
+        rule = RecurrenceRule();
+        if (word == "cron") {
+            rule.kind = Cron;
+            string monthDay, month, weekday, extra;
+            if (!(ss >> monthDay >> month >> weekday) || (ss >> extra)) {
+                error = "a cron rule takes three fields: day of month, month, day of week";
+                return false;
+            }
+            rule.cronFields = monthDay + " " + month + " " + weekday;
+            if (!parseField(monthDay, 1, 31, rule.monthDays) || !parseField(month, 1, 12, rule.months) ||
+                !parseField(weekday, 0, 7, rule.weekdays)) {
+                error = "cron fields must be *, numbers, ranges or lists in range, with optional /step";
+                return false;
+            }
+            if (rule.weekdays[7]) rule.weekdays[0] = true;     // 7 is Sunday too
+            rule.anyMonthDay = (monthDay == "*");
+            rule.anyWeekday = (weekday == "*");
+            return true;
+        }
+        
+        size_t slash = word.find('/');
+        string name = word.substr(0, slash);
+        if (name == "daily") rule.kind = Daily;
+        else if (name == "weekly") rule.kind = Weekly;
+        else if (name == "monthly") rule.kind = Monthly;
+        else if (name == "yearly") rule.kind = Yearly;
+        else {
+            error = "repeat daily, weekly, monthly, yearly or cron";
+            return false;
+        }
+        if (slash != string::npos) {
+            string count = word.substr(slash + 1);
+            if (count.empty() || count.size() > 4 || count.find_first_not_of("0123456789") != string::npos ||
+                (rule.interval = stoi(count)) < 1) {
+                error = "the interval after '/' must be a positive number";
+                return false;
+            }
+        }
+        string extra;
+        if (ss >> extra) {
+            error = "unexpected '" + extra + "' after the rule";
+            return false;
+        }
+        return true;
+    }
+    
+    // Canonical text, as parse() reads it back
+    string toString() const {
+        if (kind == Cron) return "cron " + cronFields;
+        static const char* names[] = {"daily", "weekly", "monthly", "yearly"};
+        return string(names[kind]) + (interval > 1 ? "/" + to_string(interval) : "");
+    }
+    
+    string describe() const {
+        if (kind == Cron) return "cron " + cronFields;
+        static const char* single[] = {"Daily", "Weekly", "Monthly", "Yearly"};
+        static const char* plural[] = {"days", "weeks", "months", "years"};
+        if (interval == 1) return single[kind];
+        return "Every " + to_string(interval) + " " + plural[kind];
+    }
+    
+    // First day due after the given day, for a schedule starting on start
+    // (day numbers); INT_MAX if the rule never falls due again
+    int next(int start, int after) const {
+        int from = max(start, after + 1);
+        switch (kind) {
+            case Daily:
+            case Weekly: {
+                int step = interval * (kind == Weekly ? 7 : 1);
+                return start + (from - start + step - 1) / step * step;
+            }
+            case Monthly:
+            case Yearly: {
+                int step = interval * (kind == Yearly ? 12 : 1);
+                int startYear, startMonth, startDay, fromYear, fromMonth, fromDay;
+                Validator::civilDate(start, startYear, startMonth, startDay);
+                Validator::civilDate(from, fromYear, fromMonth, fromDay);
+                int elapsed = (fromYear - startYear) * 12 + (fromMonth - startMonth);
+                for (int k = max(0, elapsed / step);; k++) {
+                    int month = startMonth - 1 + k * step;
+                    int year = startYear + month / 12;
+                    month = month % 12 + 1;
+                    if (year > 9999) return INT_MAX;
+                    int day = Validator::dayNumber(year, month, min(startDay, Validator::daysInMonth(year, month)));
+                    if (day >= from) return day;
+                }
+            }
+            case Cron: {
+                // Any satisfiable pattern recurs within one 28-year calendar cycle
+                for (int day = from; day < from + 28 * 366; day++) {
+                    if (matches(day)) return day;
+                }
+                return INT_MAX;
+            }
+        }
+        return INT_MAX;
+    }
+    
+private:
+    bool matches(int day) const {
+        int year, month, monthDay;
+        Validator::civilDate(day, year, month, monthDay);
+        if (!months[month]) return false;
+        bool dayMatch = monthDays[monthDay], weekdayMatch = weekdays[Validator::weekday(day)];
+        if (!anyMonthDay && !anyWeekday) return dayMatch || weekdayMatch;
+        return dayMatch && weekdayMatch;
+    }
+    
+    // One cron field: items separated by commas, each *, n or a-b with an
+    // optional /step
+    static bool parseField(const string& field, int low, int high, vector<bool>& allowed) {
+        allowed.assign(high + 1, false);
+        stringstream items(field);
+        string item;
+        while (getline(items, item, ',')) {
+            int step = 1;
+            size_t slash = item.find('/');
+            if (slash != string::npos) {
+                if (!parseNumber(item.substr(slash + 1), step) || step < 1) return false;
+                item = item.substr(0, slash);
+            }
+            int first = low, last = high;
+            size_t dash = item.find('-');
+            if (item == "*") {
+                // The whole range
+            } else if (dash != string::npos) {
+                if (!parseNumber(item.substr(0, dash), first) || !parseNumber(item.substr(dash + 1), last)) {
+                    return false;
+                }
+            } else {
+                if (!parseNumber(item, first)) return false;
+                if (slash == string::npos) last = first;
+            }
+            if (first < low || last > high || first > last) return false;
+            for (int value = first; value <= last; value += step) allowed[value] = true;
+        }
+        return !field.empty() && field.back() != ',';
+    }
+    
+    static bool parseNumber(const string& text, int& value) {
+        if (text.empty() || text.size() > 2 || text.find_first_not_of("0123456789") != string::npos) return false;
+        value = stoi(text);
+        return true;
+    }
+};
+
+// Recurring expenses as schedules, and the engine that records their
+// occurrences in the ledger. Each schedule keeps the day of its next
+// occurrence not yet recorded. A min-heap of (day, schedule) orders the
+// schedules by that day, so catching up after months away costs
+// O(occurrences * log k) for k schedules. Projections replay the same
+// walk on a copy, so they count every future occurrence exactly.
+// Entries left behind when a schedule stops are skipped when they reach
+// the top.
+//
+// expenses.txt.schedules:  #SCHEDULES 1
+//                          id|rule|until|next due|<template expense row>
+// The template is the expense the schedule was created from; its date
+// is the start date. Until and next due are empty for "none".
+//
+// A schedule lives as long as that expense. When undo, clear or restore
+// takes it out of the ledger the schedule is withdrawn: kept, marked with
+// a leading '~', but never due. If the expense comes back (redo, undo of
+// the delete) the schedule resumes from the day it had reached.
+class RecurringSchedules {
+public:
+    struct Schedule {
+        int id = 0;
+        RecurrenceRule rule;
+        Expense pattern;                // Copied into every occurrence
+        int start = 0;                  // Day numbers
+        int until = INT_MAX;            // Last day an occurrence may fall on
+        int nextDue = INT_MAX;          // Next occurrence not yet recorded; INT_MAX once ended
+    };
+    
+private:
+    typedef pair<int, int> Due;         // Day, schedule ID
+    typedef priority_queue<Due, vector<Due>, greater<Due>> DueQueue;
+    
+    string path;
+    map<int, Schedule> schedules;
+    map<int, Schedule> withdrawn;       // Schedules whose first expense is not in the ledger
+    DueQueue due;
+    int nextId = 1;
+    
+    static int following(const Schedule& schedule, int after) {
+        int day = schedule.rule.next(schedule.start, after);
+        return day > schedule.until ? INT_MAX : day;
+    }
+    
+    void enqueue(const Schedule& schedule) {
+        if (schedule.nextDue != INT_MAX) due.push(Due(schedule.nextDue, schedule.id));
+    }
+    
+    // Pop entries of stopped schedules and of days already recorded
+    void dropStale() {
+        while (!due.empty()) {
+            auto it = schedules.find(due.top().second);
+            if (it != schedules.end() && it->second.nextDue == due.top().first) return;
+            due.pop();
+        }
+    }
+    
+    static string dateField(int day) {
+        return day == INT_MAX ? "" : Validator::dateOf(day);
+    }
+    
+public:
+    static string fileFor(const string& ledger) {
+        return ledger + ".schedules";
+    }
+    
+    // Load the schedules kept next to the ledger; a missing file is an
+    // empty list. False with error set if lines had to be skipped.
+    bool open(const string& file, string& error) {
+        path = file;
+        schedules.clear();
+        withdrawn.clear();
+        due = DueQueue();
+        string contents;
+        if (!LedgerFile::readAll(path, contents)) return true;
+        
+        stringstream lines(contents);
+        string line;
+        size_t skipped = 0;
+        if (!getline(lines, line) || line != "#SCHEDULES 1") {
+            error = path + " is not a schedule file; recurring schedules were not loaded";
+            return false;
+        }
+        while (getline(lines, line)) {
+            if (line.empty()) continue;
+            bool isWithdrawn = line[0] == '~';
+            string fields[4];
+            size_t at = isWithdrawn ? 1 : 0;
+            bool complete = true;
+            for (auto& field : fields) {
+                size_t bar = line.find('|', at);
+                if (bar == string::npos) {
+                    complete = false;
+                    break;
+                }
+                field = line.substr(at, bar - at);
+                at = bar + 1;
+            }
+            Schedule schedule;
+            string ruleError;
+            if (!complete || (schedule.id = atoi(fields[0].c_str())) <= 0 ||
+                !RecurrenceRule::parse(fields[1], schedule.rule, ruleError) ||
+                (!fields[2].empty() && !Validator::isValidDate(fields[2])) ||
+                (!fields[3].empty() && !Validator::isValidDate(fields[3])) ||
+                (schedule.pattern = Expense::fromString(string_view(line).substr(at))).getId() <= 0 ||
+                !Validator::isValidDate(schedule.pattern.getDate())) {
+                skipped++;
+                continue;
+            }
+            schedule.start = Validator::dayNumber(schedule.pattern.getDate());
+            schedule.until = fields[2].empty() ? INT_MAX : Validator::dayNumber(fields[2]);
+            schedule.nextDue = fields[3].empty() ? INT_MAX : Validator::dayNumber(fields[3]);
+            if (isWithdrawn) {
+                withdrawn[schedule.id] = schedule;
+            } else {
+                schedules[schedule.id] = schedule;
+                enqueue(schedule);
+            }
+            nextId = max(nextId, schedule.id + 1);
+        }
+        if (skipped > 0) {
+            error = to_string(skipped) + " damaged line(s) in " + path + " were skipped";
+            return false;
+        }
+        return true;
+    }
+    
+    bool save() const {
+        string contents = "#SCHEDULES 1\n";
+        for (const auto* list : {&schedules, &withdrawn}) {
+            for (const auto& entry : *list) {
+                const Schedule& schedule = entry.second;
+                contents += (list == &withdrawn ? "~" : "") + to_string(schedule.id) + "|" +
+                            schedule.rule.toString() + "|" + dateField(schedule.until) + "|" +
+                            dateField(schedule.nextDue) + "|" + schedule.pattern.toString() + "\n";
+            }
+        }
+        return LedgerFile::writeAtomic(path, contents);
+    }
+    
+    const map<int, Schedule>& all() const { return schedules; }
+    
+    // Start a schedule whose first occurrence is the given expense (already
+    // in the ledger); until is a day number or INT_MAX. Returns its ID.
+    int add(const Expense& first, const RecurrenceRule& rule, int until) {
+        Schedule schedule;
+        schedule.id = nextId++;
+        schedule.rule = rule;
+        schedule.pattern = first;
+        schedule.start = Validator::dayNumber(first.getDate());
+        schedule.until = until;
+        schedule.nextDue = following(schedule, schedule.start);
+        schedules[schedule.id] = schedule;
+        enqueue(schedule);
+        return schedule.id;
+    }
+    
+    // Stop a schedule; occurrences already recorded stay in the ledger
+    bool remove(int id) {
+        return schedules.erase(id) > 0;
+    }
+    
+    // Withdraw the schedules whose first expense is gone and reinstate the
+    // withdrawn ones whose expense is back; inLedger(id) says whether an
+    // expense ID is in the ledger. Counts what moved each way.
+    template <typename InLedger>
+    void reconcile(InLedger inLedger, size_t& withdrawnCount, size_t& reinstatedCount) {
+        withdrawnCount = reinstatedCount = 0;
+        vector<int> gone, back;
+        for (const auto& entry : schedules) {
+            if (!inLedger(entry.second.pattern.getId())) gone.push_back(entry.first);
+        }
+        for (const auto& entry : withdrawn) {
+            if (inLedger(entry.second.pattern.getId())) back.push_back(entry.first);
+        }
+        for (int id : gone) {
+            withdrawn[id] = schedules[id];
+            schedules.erase(id);        // Its heap entry is dropped when it reaches the top
+        }
+        for (int id : back) {
+            schedules[id] = withdrawn[id];
+            withdrawn.erase(id);
+            enqueue(schedules[id]);
+        }
+        withdrawnCount = gone.size();
+        reinstatedCount = back.size();
+    }
+    
+    // Drop withdrawn schedules once no undo step can bring their expense back
+    bool forgetWithdrawn() {
+        if (withdrawn.empty()) return false;
+        withdrawn.clear();
+        return true;
+    }
+    
+    // Day of the earliest occurrence not yet recorded; INT_MAX if none
+    int nextDueDay() {
+        dropStale();
+        return due.empty() ? INT_MAX : due.top().first;
+    }
+    
+    // Hand every occurrence due on or before today to record(expense), in
+    // date order across schedules; returns how many there were
+    template <typename Record>
+    size_t materialize(int today, Record record) {
+        size_t count = 0;
+        while (nextDueDay() <= today) {
+            Schedule& schedule = schedules[due.top().second];
+            due.pop();
+            const Expense& pattern = schedule.pattern;
+            Expense occurrence(pattern.getDescription(), pattern.getAmount(), pattern.getCategory(),
+                               Validator::dateOf(schedule.nextDue));
+            occurrence.setNotes(pattern.getNotes());
+            occurrence.setPaymentMethod(pattern.getPaymentMethod());
+            occurrence.setLocation(pattern.getLocation());
+            occurrence.setIsRecurring(true);
+            record(occurrence);
+            count++;
+            schedule.nextDue = following(schedule, schedule.nextDue);
+            enqueue(schedule);
+        }
+        return count;
+    }
+    
+    // Visit every occurrence not yet recorded that falls in [from, to] as
+    // visit(schedule, day), in date order. Nothing is recorded.
+    template <typename Visitor>
+    void project(int from, int to, Visitor visit) const {
+        vector<Due> pending;
+        for (const auto& entry : schedules) {
+            if (entry.second.nextDue != INT_MAX) pending.push_back(Due(entry.second.nextDue, entry.first));
+        }
+        DueQueue walk(greater<Due>(), move(pending));
+        while (!walk.empty() && walk.top().first <= to) {
+            Due next = walk.top();
+            walk.pop();
+            const Schedule& schedule = schedules.at(next.second);
+            if (next.first >= from) visit(schedule, next.first);
+            int day = following(schedule, next.first);
+            if (day != INT_MAX) walk.push(Due(day, next.second));
+        }
+    }
+};
+
+// Command line options for the application
+struct AppOptions {
+    ListingOptions listing;
+    PartitionScheme partitioning;       // Period for new or repartitioned ledgers
+    bool repartition = false;           // --partition given: rewrite if it differs
+    bool allocationStats = false;       // --alloc-stats: report heap traffic per query
+    bool cacheStats = false;            // --cache-stats: report query cache lookups
+    size_t threads = 0;                 // --threads: scan threads, 0 = one per core
+    string socketPath;                  // --serve: serve the ledger on this socket
+    bool selfCheck = false;             // --self-check: run the codec and concurrency tests
+    string traceFile;                   // --trace: write trace spans here on exit (tracing builds)
+    size_t memoryBudget = 0;            // --memory-budget: heap bytes caches and undo evict down to
+    size_t undoDepth = 1000;            // --undo-depth: undo steps kept
+    size_t undoMemory = 64 << 20;       // --undo-memory: undo history bytes kept in memory
+    string metricsFile;                 // --metrics: dump runtime metrics here periodically
+    unsigned metricsInterval = 10;      // --metrics-interval: seconds between dumps
+};
+
+// Criteria of an advanced search; empty fields are not checked
+struct SearchCriteria {
+    string description;         // Substring, case-insensitive
+    string category;            // Exact, case-insensitive
+    string paymentMethod;
+    double minAmount = 0, maxAmount = DBL_MAX;
+    string startDate, endDate;
+    
+    ScanBounds bounds() const {
+        ScanBounds scan = ScanBounds::dates(startDate, endDate);
+        scan.minAmount = minAmount;
+        scan.maxAmount = maxAmount;
+        return scan;
+    }
+    
+    // Normalized descriptor for the query cache
+    string key() const {
+        return "advanced:" + Validator::toLower(description) + "|" + Validator::toLower(category) +
+               "|" + Validator::toLower(paymentMethod) + "|" + Validator::formatCurrency(minAmount) +
+               "|" + (maxAmount < DBL_MAX ? Validator::formatCurrency(maxAmount) : "") +
+               "|" + startDate + "|" + endDate;
+    }
+};
+
+// Enhanced ExpenseManager class with advanced features
+class ExpenseManager {
+private:
+    LedgerStore store;                  // Main storage for expenses, partitioned by period
+    deque<LedgerStore::Snapshot> undoStack;     // For undo functionality, newest last (NEW)
+    deque<LedgerStore::Snapshot> redoStack;     // For redo functionality, newest last (NEW)
+    UndoLog undoLog;                    // Older undo and redo steps, and all of them between runs
+    size_t undoDepth;                   // --undo-depth: undo steps kept in memory and on disk
+    size_t undoMemory;                  // --undo-memory: bytes of undo history kept in memory
+    string filename;                    // File for data persistence
+    RecurringSchedules schedules;       // Recurring expenses, recorded as they fall due
+    set<string> categories;             // Track unique categories (NEW)
+    map<string, int> categoryCount;     // Category usage statistics (NEW)
+    ListingOptions listing;             // Paging for table listings
+    unique_ptr<PersistenceWriter> writer;   // Background saves, started once loaded
+    unique_ptr<ExpenseIngest> ingest;   // Concurrent submissions (server mode)
+    QueryCache queryCache;              // Search and summary results until the ledger changes
+    bool cacheStats = false;            // --cache-stats: report each cache lookup
+    shared_ptr<const QueryResult> lastSearch;   // Most recent search, for export
+    string lastCriteria;
+    unique_ptr<MetricsExporter> metrics;        // --metrics: periodic Prometheus dump
+    string traceFile;                   // --trace: trace written on exit; else on request to trace.json
+    size_t memoryBudget;                // --memory-budget in bytes; 0 = none
+    
+    // Standard expense table layout shared by all listings
+    static TableRenderer expenseTable(size_t expectedRows) {
+        return TableRenderer({
+            {"ID", 5, false},
+            {"Description", 20, true},
+            {"Amount", 10, false},
+            {"Category", 12, true},
+            {"Date", 12, false},
+            {"Payment", 8, true},
+            {"Rec", 3, false}
+        }, expectedRows);
+    }
+    
+    // Format only the rows of the current page and flush them in one write
+    void renderSelection(const Selection& rows) {
+        TRACE_SPAN("render: table");
+        pair<size_t, size_t> range = listing.window(rows.size());
+        TableRenderer table = expenseTable(range.second - range.first);
+        table.header(70);
+        store.forEachSelected(rows, [&table](const Expense& expense) {
+            expense.display(table);
+        }, range.first, range.second);
+        table.text(listing.describe(rows.size()));
+        table.flush();
+    }
+    
+    // Result of the query described by key, computed by compute() unless
+    // the cache holds one from the current revision of the ledger
+    template <typename Compute>
+    shared_ptr<const QueryResult> cachedQuery(const string& key, Compute compute,
+                                              const LedgerStore::Version* version = nullptr) {
+        unsigned long long revision = version ? version->revision : store.currentRevision();
+        shared_ptr<const QueryResult> result = queryCache.find(key, revision);
+        bool hit = (result != nullptr);
+        RuntimeMetrics::add(hit ? RuntimeMetrics::cacheHits : RuntimeMetrics::cacheMisses, 1);
+        if (!hit) {
+            MemoryTagScope memory(MemoryTag::Cache);
+            shared_ptr<QueryResult> fresh = make_shared<QueryResult>();
+            compute(*fresh);
+            queryCache.insert(key, revision, fresh);
+            result = fresh;
+        }
+        if (cacheStats) {
+            QueryCache::Stats stats = queryCache.stats();
+            cout << "[cache] " << (hit ? "hit " : "miss ") << key << ": " << stats.hits << " hit(s), "
+                 << stats.misses << " miss(es), " << stats.evictions << " eviction(s), "
+                 << stats.entries << " entries, " << stats.bytes << " bytes\n";
+        }
+        return result;
+    }
+    
+    // Cached selection of the rows chosen by select(), with their total;
+    // taken from the given version instead of the live store if there is one
+    template <typename Select>
+    shared_ptr<const QueryResult> cachedSearch(const string& key, Select select,
+                                               const LedgerStore::Version* version = nullptr) {
+        return cachedQuery(key, [&](QueryResult& result) {
+            select(result.rows);
+            auto add = [&result](const Expense& expense) { result.total += expense.getAmount(); };
+            if (version) store.forEachSelected(*version, result.rows, add);
+            else store.forEachSelected(result.rows, add);
+        }, version);
+    }
+    
+    // Rows matching every given criterion. Date and amount criteria prune
+    // whole partitions; each remaining criterion narrows the selection.
+    shared_ptr<const QueryResult> runSearch(const SearchCriteria& search,
+                                            const LedgerStore::Version* version = nullptr) {
+        return cachedSearch(search.key(), [&](Selection& rows) {
+            auto refine = [&](auto match) {
+                if (version) store.refine(*version, rows, match);
+                else store.refine(rows, match);
+            };
+            if (version) store.select(*version, search.bounds(), rows);
+            else store.select(search.bounds(), rows);
+            if (!search.description.empty()) {
+                refine([&](const Expense& expense) {
+                    return Validator::containsIgnoreCase(expense.getDescription(), search.description);
+                });
+            }
+            if (!search.category.empty()) {
+                refine([&](const Expense& expense) {
+                    return Validator::equalsIgnoreCase(expense.getCategory(), search.category);
+                });
+            }
+            if (!search.paymentMethod.empty()) {
+                refine([&](const Expense& expense) {
+                    return Validator::equalsIgnoreCase(expense.getPaymentMethod(), search.paymentMethod);
+                });
+            }
+        }, version);
+    }
+    
+    // Partition and archive totals and sketches, merged once per revision
+    // of the ledger
+    shared_ptr<const QueryResult> summaryTotals() {
+        return cachedQuery("summary", [this](QueryResult& result) {
+            result.totals = store.aggregates();
+            result.sketches = store.sketches();
+        });
+    }
+    
+    // Render a page produced by listExpenses out of a listing of total rows
+    void renderPage(const vector<const Expense*>& page, size_t total) {
+        TRACE_SPAN("render: table");
+        TableRenderer table = expenseTable(page.size());
+        table.header(70);
+        for (const Expense* expense : page) {
+            expense->display(table);
+        }
+        table.text(listing.describe(total));
+        table.flush();
+    }
+    
+    // Enhanced input helper methods
+    string getStringInput(const string& prompt, bool allowEmpty = false) {
+        string input;
+        while (true) {
+            cout << prompt;
+            getline(cin, input);
+            input = Validator::trim(input);
+            
+            if (!input.empty() || allowEmpty) {
+                return input;
+            }
+            cout << "Error: Input cannot be empty. Please try again.\n";
+        }
+    }
+    
+    double getAmountInput(const string& prompt) {
+        string input;
+        while (true) {
+            cout << prompt;
+            getline(cin, input);
+            input = Validator::trim(input);
+            
+            if (Validator::isValidAmount(input)) {
+                return stod(input);
+            }
+            cout << "Error: Please enter a valid positive amount (e.g., 10.50).\n";
+        }
+    }
+    
+    string getDateInput(const string& prompt) {
+        string input;
+        while (true) {
+            cout << prompt << " (YYYY-MM-DD) or press Enter for today: ";
+            getline(cin, input);
+            input = Validator::trim(input);
+            
+            if (input.empty()) {
                 return Validator::getCurrentDate();
             }
             
@@ -361,36 +6274,192 @@ private:
         }
     }
     
+    // A date, or empty if Enter was pressed
+    string getOptionalDateInput(const string& prompt) {
+        string input;
+        while (true) {
+            cout << prompt << " (YYYY-MM-DD): ";
+            getline(cin, input);
+            input = Validator::trim(input);
+            
+            if (input.empty() || Validator::isValidDate(input)) return input;
+            cout << "Error: Please enter date in YYYY-MM-DD format.\n";
+        }
+    }
+    
+    RecurrenceRule getRecurrenceInput() {
+        cout << "Repeats: daily, weekly, monthly or yearly, every N with /N (e.g. weekly/2),\n"
+             << "or cron day fields: cron <day of month> <month> <day of week> (e.g. cron 1,15 * *)\n";
+        while (true) {
+            string input = getStringInput("Repeats (default monthly): ", true);
+            RecurrenceRule rule;
+            string error;
+            if (input.empty() || RecurrenceRule::parse(input, rule, error)) return rule;
+            cout << "Error: " << error << ".\n";
+        }
+    }
+    
+    // Last day a schedule starting on start may fall due; INT_MAX for none
+    int getEndDateInput(const string& start) {
+        string input;
+        while (true) {
+            cout << "End date (YYYY-MM-DD) or press Enter for none: ";
+            getline(cin, input);
+            input = Validator::trim(input);
+            
+            if (input.empty()) return INT_MAX;
+            if (Validator::isValidDate(input) && input >= start) return Validator::dayNumber(input);
+            cout << "Error: Please enter a date in YYYY-MM-DD format, on or after " << start << ".\n";
+        }
+    }
+    
+    // Start a schedule from an expense just marked recurring, and record
+    // the occurrences it has already missed
+    void startSchedule(const Expense& first, const RecurrenceRule& rule, int until) {
+        int id = schedules.add(first, rule, until);
+        size_t missed = recordDueOccurrences();
+        if (!schedules.save()) {
+            cout << "Warning: Could not write " << RecurringSchedules::fileFor(filename) << ".\n";
+        }
+        const RecurringSchedules::Schedule& schedule = schedules.all().at(id);
+        cout << "* Schedule " << id << ": " << schedule.rule.describe();
+        if (schedule.nextDue != INT_MAX) cout << ", next due " << Validator::dateOf(schedule.nextDue);
+        cout << ".\n";
+        if (missed > 0) cout << "* " << missed << " earlier occurrence(s) recorded.\n";
+    }
+    
+    // Withdraw schedules whose first expense just left the ledger, and
+    // reinstate those whose expense came back, after undo, redo, clear,
+    // restore or delete
+    void reconcileSchedules() {
+        size_t withdrawn, reinstated;
+        schedules.reconcile([this](int id) { return store.find(id) != nullptr; }, withdrawn, reinstated);
+        if (withdrawn + reinstated == 0) return;
+        if (!schedules.save()) {
+            cout << "Warning: Could not write " << RecurringSchedules::fileFor(filename) << ".\n";
+        }
+        if (withdrawn > 0) {
+            cout << "* " << withdrawn << " recurring schedule(s) withdrawn with the expense that started them.\n";
+        }
+        if (reinstated > 0) {
+            cout << "* " << reinstated << " recurring schedule(s) resumed with the expense that started them.\n";
+        }
+    }
+    
+    // Record every scheduled occurrence due by today; returns the count
+    size_t recordDueOccurrences() {
+        int today = Validator::dayNumber(Validator::getCurrentDate());
+        size_t added = schedules.materialize(today, [this](const Expense& occurrence) {
+            store.insert(occurrence);
+            persistExpense(occurrence);
+        });
+        if (added > 0) updateCategoryStats();
+        return added;
+    }
+    
     // Save current state for undo functionality
     void saveState() {
-        undoStack.push(expenses);
+        undoStack.push_back(store.snapshot());
         // Clear redo stack when new action is performed
-        while (!redoStack.empty()) redoStack.pop();
-        
-        // Limit undo stack size to prevent memory issues
-        if (undoStack.size() > 20) {
-            stack<vector<Expense>> temp;
-            for (int i = 0; i < 19; i++) {
-                temp.push(undoStack.top());
-                undoStack.pop();
+        redoStack.clear();
+        undoLog.clearRedo();
+        
+        // Limit undo history to --undo-depth steps, dropping the oldest
+        if (undoStack.size() + undoLog.undoCount() > undoDepth) {
+            while (undoStack.size() + undoLog.undoCount() > undoDepth) {
+                if (undoLog.undoCount() > 0) undoLog.dropOldestUndo();
+                else undoStack.pop_front();
+            }
+            releaseHistory();
+        }
+        spillHistory(undoMemory);
+    }
+    
+    // Move the oldest steps to the undo file while rows kept only for
+    // undo and redo take more than limit bytes. The session-start rows of
+    // changed partitions go last, into the steps on disk that need them.
+    void spillHistory(size_t limit) {
+        auto over = [limit] { return AllocationCounters::liveBytes(MemoryTag::Snapshots) > (long long)limit; };
+        while (over() && spillOldest()) {}
+        if (over() && undoLog.undoCount() + undoLog.redoCount() > 0 &&
+            undoLog.complete(store.complete(LedgerStore::Snapshot()))) {
+            releaseHistory();
+        }
+    }
+    
+    // Move the oldest undo step, or failing that the farthest redo step,
+    // to the undo file. If it cannot be written it is dropped instead.
+    bool spillOldest() {
+        deque<LedgerStore::Snapshot>& steps = !undoStack.empty() ? undoStack : redoStack;
+        if (steps.empty()) return false;
+        
+        LedgerStore::Snapshot step = store.complete(steps.front());
+        bool written = (&steps == &undoStack) ? undoLog.pushUndo(step) : undoLog.pushRedo(step);
+        if (!written) {
+            cout << "Warning: Could not write " << UndoLog::fileFor(filename) << "; the oldest "
+                 << (&steps == &undoStack ? "undo" : "redo") << " step was dropped.\n";
+        }
+        steps.pop_front();
+        releaseHistory();
+        return true;
+    }
+    
+    // Let the store free rows that only dropped undo entries referred to
+    void releaseHistory() {
+        store.releaseHistory([this](const string& key) {
+            for (const auto& state : undoStack) {
+                if (state.count(key) == 0) return false;
             }
-            while (!undoStack.empty()) undoStack.pop();
-            while (!temp.empty()) {
-                undoStack.push(temp.top());
-                temp.pop();
+            for (const auto& state : redoStack) {
+                if (state.count(key) == 0) return false;
             }
+            return undoLog.recordedByAll(key);
+        });
+    }
+    
+    // Forget undo and redo history, on disk too. Withdrawn schedules go
+    // with it: nothing can bring their expenses back any more.
+    void clearHistory() {
+        undoStack.clear();
+        redoStack.clear();
+        undoLog.clear();
+        if (schedules.forgetWithdrawn() && !schedules.save()) {
+            cout << "Warning: Could not write " << RecurringSchedules::fileFor(filename) << ".\n";
+        }
+    }
+    
+    // Write every remaining step to the undo file, tied to the ledger as
+    // now on disk, so that undo and redo carry over to the next run
+    void saveHistory() {
+        while (spillOldest()) {}
+        
+        LedgerManifest onDisk;
+        string contents;
+        if (!LedgerFile::readAll(filename, contents) || !LedgerManifest::isManifest(contents) ||
+            !onDisk.parse(contents)) {
+            undoLog.clear();
+            return;
+        }
+        if (!undoLog.close(store.complete(LedgerStore::Snapshot()), onDisk.generation, onDisk.checksum)) {
+            cout << "Warning: Could not save undo history to " << UndoLog::fileFor(filename) << ".\n";
+            undoLog.clear();
         }
     }
     
     // Update category tracking
     void updateCategoryStats() {
+        MemoryTagScope memory(MemoryTag::Categories);
         categories.clear();
         categoryCount.clear();
         
-        for (const auto& expense : expenses) {
-            categories.insert(expense.getCategory());
-            categoryCount[expense.getCategory()]++;
+        // Counted from segment and archive aggregates, without loading rows
+        size_t rows = 0;
+        for (const auto& category : store.aggregates().categories) {
+            categories.insert(category.first);
+            categoryCount[category.first] = category.second.count;
+            rows += category.second.count;
         }
+        RuntimeMetrics::ledgerRows.store(rows, memory_order_relaxed);
     }
     
     // Display category suggestions based on usage
@@ -408,57 +6477,332 @@ private:
     }
     
 public:
-    ExpenseManager(const string& file = "expenses.txt") : filename(file) {
-        loadFromFile();
+    ExpenseManager(const string& file = "expenses.txt", const AppOptions& options = AppOptions())
+        : store(options.partitioning), undoDepth(options.undoDepth), undoMemory(options.undoMemory),
+          filename(file), listing(options.listing), cacheStats(options.cacheStats),
+          traceFile(options.traceFile), memoryBudget(options.memoryBudget) {
+        AllocationScope::enabled = options.allocationStats;
+        store.setScanThreads(options.threads ? options.threads : max(1u, thread::hardware_concurrency()));
+        store.setMemoryBudget(memoryBudget);
+        LedgerManifest manifest;
+        store.setLedgerFile(filename);
+        bool rewrite;
+        {
+            AllocationScope allocations("load ledger");
+            LatencyScope latency(Metric::Load);
+            TRACE_SPAN("load");
+            rewrite = loadFromFile(options.repartition, manifest);
+        }
         updateCategoryStats();
+        
+        writer.reset(new PersistenceWriter(filename, store.partitioning()));
+        if (!rewrite) {
+            writer->enqueue(ChangeRecord::seed(manifest));
+        } else {
+            ChangeRecord seed = ChangeRecord::reset(store.hotRows(), ChangeRecord::Rewrite);
+            seed.manifest = manifest;
+            for (const auto& archive : store.allArchives()) {
+                seed.sealed.push_back(archive.second.info);
+            }
+            writer->enqueue(seed);
+            saveToFile();
+            
+            // The writer deleted the old files once the new manifest was in
+            // place; rows evicted from now on are read back from the new files
+            LedgerManifest written;
+            string contents;
+            if (LedgerFile::readAll(filename, contents) && written.parse(contents)) store.adoptFiles(written);
+            
+            cout << "Ledger stored as " << store.allPartitions().size() << " "
+                 << store.partitioning().name() << " segment(s).\n\n";
+        }
+        
+        // Undo history from the last run, if it was saved with this ledger
+        if (rewrite) {
+            undoLog.open(UndoLog::fileFor(filename), 0, 0);
+            undoLog.clear();
+        } else if (!undoLog.open(UndoLog::fileFor(filename), manifest.generation, manifest.checksum)) {
+            cout << "Warning: " << UndoLog::fileFor(filename)
+                 << " does not match the ledger; undo history from the last run was discarded.\n\n";
+        } else if (undoLog.undoCount() + undoLog.redoCount() > 0) {
+            cout << "* Undo history restored: " << undoLog.undoCount() << " step(s) to undo, "
+                 << undoLog.redoCount() << " to redo.\n\n";
+        }
+        
+        string error;
+        if (!schedules.open(RecurringSchedules::fileFor(filename), error)) {
+            cout << "Warning: " << error << ".\n\n";
+        }
+        if (undoLog.undoCount() + undoLog.redoCount() == 0 && schedules.forgetWithdrawn()) {
+            schedules.save();
+        }
+        catchUpSchedules();
+        if (!options.metricsFile.empty()) {
+            metrics.reset(new MetricsExporter(options.metricsFile, options.metricsInterval));
+        }
     }
     
+    // Queued changes must reach the disk before the manager goes away
     ~ExpenseManager() {
+        ingest.reset();
         saveToFile();
+        saveHistory();
+        metrics.reset();        // Final dump includes the last save
+        if (!traceFile.empty()) writeTrace();
+    }
+    
+    // Record the scheduled occurrences that have fallen due since the last
+    // check, as one undo step. Cheap when none have: one look at the heap.
+    void catchUpSchedules() {
+        if (schedules.nextDueDay() > Validator::dayNumber(Validator::getCurrentDate())) return;
+        saveState();
+        size_t added = recordDueOccurrences();
+        if (!schedules.save()) {
+            cout << "Warning: Could not write " << RecurringSchedules::fileFor(filename) << ".\n";
+        }
+        cout << "* " << added << " scheduled recurring expense(s) fell due and were recorded.\n\n";
     }
     
-    // Enhanced file operations with error handling
+    // Wait until every change queued so far has been written to the file
     void saveToFile() {
-        ofstream file(filename);
-        if (!file.is_open()) {
-            cout << "Warning: Could not save to file " << filename << endl;
-            return;
+        writer->flush();
+        reportSaveErrors();
+    }
+    
+    // Print the background writer's failures; called from the UI thread
+    void reportSaveErrors() {
+        for (const auto& failure : writer->takeFailures()) {
+            cout << "Warning: " << failure << endl;
+        }
+    }
+    
+    // Paging of table listings from now on, as --page/--limit set it
+    void setListing(const ListingOptions& options) {
+        listing = options;
+    }
+    
+    // Non-interactive access for server mode. After shareReads(), readers
+    // pin a published version and search it while writes go ahead; writes
+    // must still be serialized with each other.
+    
+    void shareReads() {
+        store.shareReads();
+    }
+    
+    LedgerStore::PinnedVersion pinVersion() const {
+        return store.pin();
+    }
+    
+    // Validate an expense submitted from outside the menu and build it
+    // with the given ID; false with error set if it is rejected
+    static bool makeExpense(int id, const string& description, double amount, const string& category,
+                            const string& date, const string& notes, const string& paymentMethod,
+                            const string& location, bool recurring, Expense& expense, string& error) {
+        if (Validator::trim(description).empty() || Validator::trim(category).empty()) {
+            error = "description and category are required";
+            return false;
+        }
+        if (!(amount > 0)) {
+            error = "amount must be positive";
+            return false;
+        }
+        if (!date.empty() && !Validator::isValidDate(date)) {
+            error = "date must be a valid YYYY-MM-DD date";
+            return false;
         }
         
-        for (const auto& expense : expenses) {
-            file << expense.toString() << endl;
+        string payment = Validator::trim(paymentMethod);
+        expense = Expense(id, Validator::trim(description), amount, Validator::trim(category),
+                          date.empty() ? Validator::getCurrentDate() : date, notes, recurring,
+                          payment.empty() ? "Cash" : payment, location);
+        return true;
+    }
+    
+    // Start applying expenses submitted through the returned ingest queue.
+    // Each batch is inserted, published to readers and queued for the
+    // file in one step. No undo snapshots are taken: submitters have no
+    // undo, and a snapshot would only hold on to rows nobody can return to.
+    // A recurring expense starts a monthly schedule, as an empty answer to
+    // the menu's question does. The applier is the only thread writing the
+    // store, so it also records the occurrences that fall due, checking
+    // after each batch and at least every IDLE_TICK.
+    ExpenseIngest& startIngest() {
+        if (!ingest) {
+            clearHistory();     // It could not be undone past these adds
+            ingest.reset(new ExpenseIngest([this](vector<Expense>& batch) {
+                size_t started = 0;
+                for (const auto& expense : batch) {
+                    store.insert(expense);
+                    persistExpense(expense);
+                    if (expense.getIsRecurring()) {
+                        schedules.add(expense, RecurrenceRule(), INT_MAX);
+                        started++;
+                    }
+                }
+                int today = Validator::dayNumber(Validator::getCurrentDate());
+                size_t due = schedules.materialize(today, [this](const Expense& occurrence) {
+                    store.insert(occurrence);
+                    persistExpense(occurrence);
+                });
+                if (batch.empty() && due == 0) return;
+                store.publish();
+                updateCategoryStats();
+                if (started + due > 0 && !schedules.save()) {
+                    cout << "Warning: Could not write " << RecurringSchedules::fileFor(filename) << ".\n";
+                }
+            }));
         }
-        file.close();
+        return *ingest;
+    }
+    
+    shared_ptr<const QueryResult> search(const LedgerStore::Version& version, const SearchCriteria& criteria) {
+        return runSearch(criteria, &version);
+    }
+    
+    // Visit rows [from, to) of a search result taken from the version
+    template <typename Visitor>
+    void forEachResult(const LedgerStore::Version& version, const QueryResult& result,
+                       size_t from, size_t to, Visitor visit) const {
+        store.forEachSelected(version, result.rows, visit, from, to);
+    }
+    
+    // Queue persistence of an added or modified expense; previousKey is
+    // the segment that held it before the change (empty for new expenses)
+    void persistExpense(const Expense& expense, const string& previousKey = "") {
+        writer->enqueue(ChangeRecord::upsert(expense, previousKey));
+    }
+    
+    // Queue a rewrite of the whole hot ledger (clear all, restore)
+    void persistAll() {
+        writer->enqueue(ChangeRecord::reset(store.hotRows()));
+    }
+    
+    // Bring sealed archives back into the hot ledger so that whole-ledger
+    // operations (clear all, restore) remain undoable
+    void unsealArchives() {
+        if (store.allArchives().empty()) return;
+        vector<Expense> rows = store.all();
+        store.clear();
+        store.assignHot(rows);
+        writer->enqueue(ChangeRecord::reset(rows, ChangeRecord::Unseal));
     }
     
-    void loadFromFile() {
-        ifstream file(filename);
-        if (!file.is_open()) {
+    // Open the ledger. A current manifest is all that is read: segment rows
+    // are loaded when first needed. Single-file ledgers from earlier
+    // versions, older or damaged manifests and --partition changes load
+    // every row instead and return true: the ledger must then be rewritten
+    // as segments, and manifest is what the rewrite replaces.
+    bool loadFromFile(bool repartition, LedgerManifest& manifest) {
+        string contents;
+        if (!LedgerFile::readAll(filename, contents)) {
             cout << "Starting with empty expense list (no existing file found).\n\n";
-            return;
+            return false;
         }
         
-        string line;
-        int loaded = 0, skipped = 0;
-        
-        while (getline(file, line)) {
-            if (!line.empty()) {
-                Expense expense = Expense::fromString(line);
-                if (expense.getId() > 0) {
-                    expenses.push_back(expense);
-                    loaded++;
-                } else {
-                    skipped++;
+        size_t loaded = 0, skipped = 0;
+        bool rewrite = false;
+        int highestId = 0;
+        // Rows are parsed and indexed a chunk at a time so that the two
+        // phases show up separately in traces
+        auto loadRows = [&](const vector<string_view>& rows) {
+            const size_t CHUNK = 4096;
+            vector<Expense> parsed;
+            parsed.reserve(min(rows.size(), CHUNK));
+            for (size_t begin = 0; begin < rows.size(); begin += CHUNK) {
+                parsed.clear();
+                {
+                    TRACE_SPAN("load: parse rows");
+                    for (size_t i = begin; i < min(begin + CHUNK, rows.size()); i++) {
+                        Expense expense = Expense::fromString(rows[i]);
+                        if (expense.getId() > 0) parsed.push_back(move(expense));
+                        else skipped++;
+                    }
+                }
+                TRACE_SPAN("load: index rows");
+                for (const auto& expense : parsed) store.insert(expense);
+                loaded += parsed.size();
+            }
+        };
+        
+        cout << "\n";
+        if (LedgerManifest::isManifest(contents)) {
+            bool intact;
+            {
+                TRACE_SPAN("load: parse manifest");
+                intact = manifest.parse(contents);
+            }
+            if (!intact) {
+                cout << "Warning: " << filename << " manifest is damaged; loading the segments it lists.\n";
+            }
+            bool repartitioned = repartition && manifest.scheme.period != store.partitioning().period;
+            if (!repartition) {
+                store.setPartitioning(manifest.scheme);
+            }
+            rewrite = repartitioned || !intact || !manifest.isComplete();
+            
+            if (!rewrite) {
+                store.open(manifest);
+                TRACE_SPAN("load: attach index");
+                store.attachIndex(manifest);
+                loaded += store.hotSize();
+                highestId = manifest.maxId();
+            } else {
+                for (const auto& entry : manifest.segments) {
+                    string segmentFile = LedgerManifest::segmentFile(filename, entry.first, entry.second.file);
+                    
+                    string segment;
+                    if (!LedgerFile::readAll(segmentFile, segment)) {
+                        cout << "Warning: segment " << segmentFile << " is missing ("
+                             << entry.second.rows << " expenses).\n";
+                        continue;
+                    }
+                    LedgerFile::ReadResult result = LedgerFile::parse(segment);
+                    loadRows(result.rows);
+                    LedgerFile::reportRecovery(segmentFile, result);
+                }
+            }
+            
+            // Archives stay compressed; only their footers are read
+            TRACE_SPAN("load: archive footers");
+            for (const auto& entry : manifest.archives) {
+                ArchiveSegment archive;
+                archive.info = entry.second;
+                archive.file = LedgerArchive::fileFor(filename, entry.first, entry.second.file);
+                if (!LedgerArchive::readFooter(archive.file, archive.aggregates)) {
+                    cout << "Warning: archive " << archive.file << " footer failed verification; "
+                         << "its totals are missing from summaries.\n";
                 }
+                if (archive.info.maxId == INT_MAX) {
+                    // Written without an ID range: recover it once from the rows
+                    vector<Expense> rows;
+                    string error;
+                    if (LedgerArchive::readRows(archive.file, rows, error)) {
+                        archive.info.clear();
+                        archive.info.key = entry.first;
+                        for (const auto& expense : rows) archive.info.add(expense);
+                    }
+                }
+                highestId = max(highestId, archive.info.maxId);
+                store.addArchive(archive);
+                loaded += entry.second.rows;
             }
+        } else {
+            LedgerFile::ReadResult result = LedgerFile::parse(contents);
+            loadRows(result.rows);
+            LedgerFile::reportRecovery(filename, result);
+            rewrite = true;
         }
-        file.close();
         
-        cout << "\nLoaded " << loaded << " expenses from file";
+        // New IDs must follow rows that were not loaded
+        if (highestId != INT_MAX) Expense::reserveId(highestId);
+        store.markLoaded();
+        
+        cout << "Loaded " << loaded << " expenses from file";
         if (skipped > 0) {
             cout << " (" << skipped << " corrupted entries skipped)";
         }
         cout << ".\n\n";
+        return rewrite;
     }
     
     // Enhanced add expense with more fields
@@ -481,6 +6825,12 @@ public:
         
         string location = getStringInput("Enter location (optional): ", true);
         bool isRecurring = getBoolInput("Is this a recurring expense?");
+        RecurrenceRule rule;
+        int until = INT_MAX;
+        if (isRecurring) {
+            rule = getRecurrenceInput();
+            until = getEndDateInput(date);
+        }
         
         Expense expense(description, amount, category, date);
         expense.setNotes(notes);
@@ -488,16 +6838,18 @@ public:
         expense.setLocation(location);
         expense.setIsRecurring(isRecurring);
         
-        expenses.push_back(expense);
+        store.insert(expense);
         updateCategoryStats();
         
         cout << "\n* Expense added successfully! ID: " << expense.getId();
         if (isRecurring) {
             cout << " (Marked as recurring)";
         }
-        cout << "\n\n";
+        cout << "\n";
         
-        saveToFile();
+        persistExpense(expense);
+        if (isRecurring) startSchedule(expense, rule, until);
+        cout << "\n";
     }
     
     // Quick add for frequent expenses
@@ -526,18 +6878,67 @@ public:
         if (category.empty()) category = defaultCategory;
         
         Expense expense(description, amount, category);
-        expenses.push_back(expense);
+        store.insert(expense);
         updateCategoryStats();
         
         cout << "* Quick expense added! ID: " << expense.getId() << "\n\n";
-        saveToFile();
+        persistExpense(expense);
+    }
+    
+    // Return rows [offset, offset + limit) of the expenses ordered by key
+    // (limit 0 means to the end). Only pointers are sorted, and only far
+    // enough to produce the requested page: nth_element discards the rows
+    // before the page and partial_sort orders the page itself. Ties are
+    // broken by ID so every page is deterministic.
+    vector<const Expense*> listExpenses(SortKey key, size_t offset, size_t limit) const {
+        vector<const Expense*> page;
+        if (offset >= store.size()) return page;
+        if (key == SortKey::Id && limit > 0 && store.pageById(offset, limit, page)) return page;
+        
+        // The full pointer array only lives for the sort
+        QueryArena arena;
+        ExpenseRefs rows(arena.get());
+        rows.reserve(store.size());
+        store.forEach([&rows](const Expense& expense) { rows.push_back(&expense); });
+        
+        auto compare = [key](const Expense* a, const Expense* b) {
+            switch (key) {
+                case SortKey::Date:
+                    if (a->getDate() != b->getDate()) return a->getDate() > b->getDate();
+                    break;
+                case SortKey::Amount:
+                    if (a->getAmount() != b->getAmount()) return a->getAmount() > b->getAmount();
+                    break;
+                case SortKey::Category: {
+                    int order = a->getCategory().compare(b->getCategory());
+                    if (order != 0) return order < 0;
+                    break;
+                }
+                case SortKey::Id:
+                    break;
+            }
+            return a->getId() < b->getId();
+        };
+        
+        size_t end = (limit == 0) ? rows.size() : min(rows.size(), offset + limit);
+        if (offset > 0) {
+            nth_element(rows.begin(), rows.begin() + offset, rows.end(), compare);
+        }
+        if (end == rows.size()) {
+            sort(rows.begin() + offset, rows.end(), compare);
+        } else {
+            partial_sort(rows.begin() + offset, rows.begin() + end, rows.end(), compare);
+        }
+        
+        page.assign(rows.begin() + offset, rows.begin() + end);
+        return page;
     }
     
     // Enhanced view with sorting options
     void viewAllExpenses() {
         cout << "\n=== All Expenses ===\n";
         
-        if (expenses.empty()) {
+        if (store.empty()) {
             cout << "No expenses found.\n\n";
             return;
         }
@@ -545,45 +6946,15 @@ public:
         cout << "Sort by: 1) Date  2) Amount  3) Category  4) ID (default)\n";
         int sortChoice = getIntInput("Choose sort option (1-4): ", 1, 4);
         
-        vector<Expense> sortedExpenses = expenses;
-        
-        switch (sortChoice) {
-            case 1: // Sort by date
-                sort(sortedExpenses.begin(), sortedExpenses.end(),
-                    [](const Expense& a, const Expense& b) {
-                        return a.getDate() > b.getDate(); // Most recent first
-                    });
-                break;
-            case 2: // Sort by amount
-                sort(sortedExpenses.begin(), sortedExpenses.end(),
-                    [](const Expense& a, const Expense& b) {
-                        return a.getAmount() > b.getAmount(); // Highest first
-                    });
-                break;
-            case 3: // Sort by category
-                sort(sortedExpenses.begin(), sortedExpenses.end(),
-                    [](const Expense& a, const Expense& b) {
-                        return a.getCategory() < b.getCategory(); // Alphabetical
-                    });
-                break;
-            default: // Sort by ID (already in order)
-                break;
-        }
-        
-        cout << "\n" << left << setw(5) << "ID" 
-             << setw(20) << "Description" 
-             << setw(10) << "Amount"
-             << setw(12) << "Category" 
-             << setw(12) << "Date"
-             << setw(8) << "Payment"
-             << setw(3) << "Rec" << endl;
-        cout << string(70, '-') << endl;
+        const SortKey keys[] = {SortKey::Date, SortKey::Amount, SortKey::Category, SortKey::Id};
+        pair<size_t, size_t> range = listing.window(store.size());
+        vector<const Expense*> page = listExpenses(keys[sortChoice - 1], range.first,
+                                                   range.second - range.first);
         
-        for (const auto& expense : sortedExpenses) {
-            expense.display();
-        }
+        cout << "\n";
+        renderPage(page, store.size());
         
-        cout << "\nTotal expenses: " << expenses.size() << endl;
+        cout << "\nTotal expenses: " << store.size() << endl;
         cout << "Total amount: " << Validator::formatCurrency(getTotalAmount()) << "\n\n";
     }
     
@@ -591,100 +6962,254 @@ public:
     void viewExpenseDetails() {
         cout << "\n=== View Expense Details ===\n";
         
-        if (expenses.empty()) {
+        if (store.empty()) {
             cout << "No expenses found.\n\n";
             return;
         }
         
         int id = getIntInput("Enter expense ID to view: ");
         
-        auto it = find_if(expenses.begin(), expenses.end(),
-            [id](const Expense& e) { return e.getId() == id; });
-        
-        if (it == expenses.end()) {
+        const Expense* found = store.find(id);
+        if (found == nullptr) {
             cout << "Expense with ID " << id << " not found.\n\n";
             return;
         }
         
-        it->displayDetailed();
+        found->displayDetailed();
     }
     
     // Enhanced category view with statistics
     void viewExpensesByCategory() {
         cout << "\n=== Expenses by Category ===\n";
         
-        if (expenses.empty()) {
+        if (store.empty()) {
             cout << "No expenses found.\n\n";
             return;
         }
         
-        map<string, vector<Expense>> categoryMap;
-        map<string, double> categoryTotals;
-        
-        for (const auto& expense : expenses) {
-            categoryMap[expense.getCategory()].push_back(expense);
-            categoryTotals[expense.getCategory()] += expense.getAmount();
-        }
+        AllocationScope allocations("expenses by category");
+        struct CategoryRows {
+            vector<const Expense*> rows;
+            double total = 0;
+        };
+        typedef map<string_view, CategoryRows> CategoryGroups;
+        
+        // Morsels are grouped in parallel; merging in scan order keeps each
+        // category's rows in the same order as a sequential pass
+        CategoryGroups categoryMap = store.parallelScan<CategoryGroups>(ScanBounds(),
+            [](CategoryGroups& groups, const Expense& expense) {
+                CategoryRows& group = groups[expense.getCategory()];
+                group.rows.push_back(&expense);
+                group.total += expense.getAmount();
+            },
+            [](CategoryGroups& into, CategoryGroups& from) {
+                for (auto& entry : from) {
+                    CategoryRows& group = into[entry.first];
+                    group.rows.insert(group.rows.end(), entry.second.rows.begin(), entry.second.rows.end());
+                    group.total += entry.second.total;
+                }
+            });
         
         double grandTotal = getTotalAmount();
         
+        TableRenderer table({
+            {"ID", 5, false},
+            {"Description", 20, true},
+            {"Amount", 10, false},
+            {"Date", 12, false},
+            {"Payment", 8, true}
+        });
+        
         for (const auto& pair : categoryMap) {
-            double percentage = (categoryTotals[pair.first] / grandTotal) * 100;
+            double percentage = (pair.second.total / grandTotal) * 100;
             
-            cout << "\n[*] Category: " << pair.first 
-                 << " (Total: " << Validator::formatCurrency(categoryTotals[pair.first])
-                 << " - " << fixed << setprecision(1) << percentage << "%)\n";
-            cout << string(60, '-') << endl;
+            stringstream title;
+            title << "\n[*] Category: " << pair.first 
+                  << " (Total: " << Validator::formatCurrency(pair.second.total)
+                  << " - " << fixed << setprecision(1) << percentage << "%)\n"
+                  << string(60, '-') << "\n";
+            table.text(title.str());
+            table.header();
             
-            cout << left << setw(5) << "ID" 
-                 << setw(20) << "Description" 
-                 << setw(10) << "Amount"
-                 << setw(12) << "Date"
-                 << setw(8) << "Payment" << endl;
-            
-            for (const auto& expense : pair.second) {
-                cout << left << setw(5) << expense.getId()
-                     << setw(20) << expense.getDescription().substr(0, 19)
-                     << setw(10) << Validator::formatCurrency(expense.getAmount())
-                     << setw(12) << expense.getDate()
-                     << setw(8) << expense.getPaymentMethod().substr(0, 7) << endl;
+            // Paging applies within each category section
+            std::pair<size_t, size_t> range = listing.window(pair.second.rows.size());
+            for (size_t i = range.first; i < range.second; i++) {
+                const Expense& expense = *pair.second.rows[i];
+                table.cell(expense.getId())
+                     .cell(expense.getDescription())
+                     .currency(expense.getAmount())
+                     .cell(expense.getDate())
+                     .cell(expense.getPaymentMethod());
+                table.endRow();
             }
+            table.text(listing.describe(pair.second.rows.size()));
+        }
+        table.text("\n");
+        table.flush();
+    }
+    
+    // Spending over a chosen period, overall and by category and payment
+    // method, against the period of the same length just before it. Every
+    // figure is two lookups in the daily series.
+    void showTrends() {
+        cout << "\n=== Spending Trends ===\n";
+        
+        if (store.empty()) {
+            cout << "No expenses found.\n\n";
+            return;
+        }
+        
+        const LedgerTimeSeries& series = store.timeSeries();
+        int anchor = trendAnchor(series);
+        cout << "Press Enter at the start date for the 30 days to " << Validator::dateOf(anchor) << ".\n";
+        string start = getOptionalDateInput("Start date");
+        int from = anchor - 29, to = anchor;
+        if (!start.empty()) {
+            from = Validator::dayNumber(start);
+            string end = getOptionalDateInput("End date (Enter for " + Validator::dateOf(max(anchor, from)) + ")");
+            to = end.empty() ? max(anchor, from) : Validator::dayNumber(end);
+            if (to < from) swap(from, to);
         }
+        
+        int days = to - from + 1;
+        long long now = series.total.sum(from, to), before = series.total.sum(from - days, from - 1);
+        cout << "\nPeriod: " << Validator::dateOf(from) << " to " << Validator::dateOf(to) << " (" << days
+             << " days)\n";
+        cout << "Total: " << cents(now) << " (previous " << days << " days: " << cents(before) << ", "
+             << change(before, now) << ")\n";
+        cout << "Daily average: " << Validator::formatCurrency(now / 100.0 / days) << endl;
+        showPeriodTable("By Category", series.categories, from, to);
+        showPeriodTable("By Payment Method", series.payments, from, to);
         cout << endl;
     }
     
+    static string cents(long long value) {
+        return Validator::formatCurrency(value / 100.0);
+    }
+    
+    // Change from one total to the next, e.g. "+12.5%"
+    static string change(long long before, long long after) {
+        if (before == 0) return after == 0 ? "no change" : "new";
+        char text[32];
+        snprintf(text, sizeof(text), "%+.1f%%", (after - before) * 100.0 / before);
+        return text;
+    }
+    
+    // Day the rolling windows end on: today, or the last day with expenses
+    // if the ledger stops earlier
+    static int trendAnchor(const LedgerTimeSeries& series) {
+        int today = Validator::dayNumber(Validator::getCurrentDate());
+        int last = series.total.lastDay();
+        return last == INT_MIN ? today : min(today, last);
+    }
+    
+    // Each series' total over from..to next to the window of the same
+    // length just before it; series with nothing in either are left out
+    static void showPeriodTable(const string& title, const map<string, DailySeries>& all, int from, int to) {
+        int days = to - from + 1;
+        cout << "\n[*] " << title << ":\n";
+        cout << left << setw(15) << "Name" << setw(14) << "This period" << setw(14) << "Previous" << "Change\n";
+        cout << string(53, '-') << endl;
+        for (const auto& entry : all) {
+            long long now = entry.second.sum(from, to), before = entry.second.sum(from - days, from - 1);
+            if (now == 0 && before == 0) continue;
+            cout << left << setw(15) << entry.first.substr(0, 14) << setw(14) << cents(now) << setw(14)
+                 << cents(before) << change(before, now) << endl;
+        }
+    }
+    
     // NEW: View recurring expenses
     void viewRecurringExpenses() {
         cout << "\n=== Recurring Expenses ===\n";
         
-        vector<Expense> recurringExpenses;
-        double totalRecurring = 0;
+        AllocationScope allocations("recurring expenses");
+        shared_ptr<const QueryResult> recurring = cachedSearch("recurring", [&](Selection& rows) {
+            store.select(ScanBounds(), rows, [](const Expense& expense) {
+                return expense.getIsRecurring();
+            });
+        });
         
-        for (const auto& expense : expenses) {
-            if (expense.getIsRecurring()) {
-                recurringExpenses.push_back(expense);
-                totalRecurring += expense.getAmount();
-            }
+        if (recurring->rows.empty()) {
+            cout << "No recurring expenses found.\n";
+        } else {
+            renderSelection(recurring->rows);
+            
+            cout << "\nTotal recurring expenses: " << recurring->rows.size() << endl;
+            cout << "Amount recorded: " << Validator::formatCurrency(recurring->total) << "\n";
         }
         
-        if (recurringExpenses.empty()) {
-            cout << "No recurring expenses found.\n\n";
+        if (schedules.all().empty()) {
+            cout << "\nNo schedules. Mark an expense as recurring to say when it repeats.\n\n";
             return;
         }
+        showSchedules();
         
-        cout << left << setw(5) << "ID" 
-             << setw(20) << "Description" 
-             << setw(10) << "Amount"
-             << setw(12) << "Category" 
-             << setw(12) << "Date" << endl;
-        cout << string(59, '-') << endl;
-        
-        for (const auto& expense : recurringExpenses) {
-            expense.display();
+        cout << "\nEnter a schedule ID to stop it, or press Enter to keep them all: ";
+        string input;
+        getline(cin, input);
+        int id = atoi(Validator::trim(input).c_str());
+        if (id <= 0) {
+            cout << "\n";
+        } else if (!schedules.remove(id)) {
+            cout << "No schedule " << id << ".\n\n";
+        } else {
+            if (!schedules.save()) {
+                cout << "Warning: Could not write " << RecurringSchedules::fileFor(filename) << ".\n";
+            }
+            cout << "* Schedule " << id << " stopped; expenses it recorded stay in the ledger.\n\n";
         }
-        
-        cout << "\nTotal recurring expenses: " << recurringExpenses.size() << endl;
-        cout << "Monthly recurring amount: " << Validator::formatCurrency(totalRecurring) << "\n\n";
+    }
+    
+    // Scheduled occurrences not yet recorded between two days: count and total
+    pair<size_t, double> projectSchedules(int from, int to) const {
+        pair<size_t, double> projection(0, 0.0);
+        schedules.project(from, to, [&](const RecurringSchedules::Schedule& schedule, int) {
+            projection.first++;
+            projection.second += schedule.pattern.getAmount();
+        });
+        return projection;
+    }
+    
+    // Every schedule, then what they will cost month by month over the
+    // next year, counting each occurrence
+    void showSchedules() const {
+        cout << "\n=== Schedules ===\n";
+        TableRenderer table({
+            {"ID", 4, false},
+            {"Description", 20, true},
+            {"Amount", 10, false},
+            {"Repeats", 16, true},
+            {"Next due", 12, false},
+            {"Until", 12, false}
+        }, schedules.all().size());
+        table.header(74);
+        for (const auto& entry : schedules.all()) {
+            const RecurringSchedules::Schedule& schedule = entry.second;
+            table.cell(schedule.id)
+                 .cell(schedule.pattern.getDescription())
+                 .currency(schedule.pattern.getAmount())
+                 .cell(schedule.rule.describe())
+                 .cell(schedule.nextDue == INT_MAX ? "ended" : Validator::dateOf(schedule.nextDue))
+                 .cell(schedule.until == INT_MAX ? "-" : Validator::dateOf(schedule.until));
+            table.endRow();
+        }
+        table.flush();
+        
+        int today = Validator::dayNumber(Validator::getCurrentDate());
+        map<string, pair<size_t, double>> months;
+        schedules.project(today + 1, today + 365, [&](const RecurringSchedules::Schedule& schedule, int day) {
+            pair<size_t, double>& month = months[Validator::dateOf(day).substr(0, 7)];
+            month.first++;
+            month.second += schedule.pattern.getAmount();
+        });
+        cout << "\nProjected over the next 12 months:\n";
+        double total = 0;
+        for (const auto& month : months) {
+            cout << month.first << ": " << Validator::formatCurrency(month.second.second) << " ("
+                 << month.second.first << " occurrence(s))\n";
+            total += month.second.second;
+        }
+        cout << "Total: " << Validator::formatCurrency(total) << "\n";
     }
     
     // Enhanced search with multiple criteria
@@ -713,13 +7238,14 @@ public:
         string searchTerm = getStringInput("Enter description to search: ");
         searchTerm = Validator::toLower(searchTerm);
         
-        vector<Expense> results;
-        for (const auto& expense : expenses) {
-            string desc = Validator::toLower(expense.getDescription());
-            if (desc.find(searchTerm) != string::npos) {
-                results.push_back(expense);
-            }
-        }
+        AllocationScope allocations("search by description");
+        LatencyScope latency(Metric::SearchDescription);
+        TRACE_SPAN("search: description");
+        auto results = cachedSearch("description:" + searchTerm, [&](Selection& rows) {
+            store.select(ScanBounds(), rows, [&](const Expense& expense) {
+                return Validator::containsIgnoreCase(expense.getDescription(), searchTerm);
+            });
+        });
         
         displaySearchResults(results, "Description containing: " + searchTerm);
     }
@@ -733,12 +7259,14 @@ public:
         
         string category = getStringInput("Enter category to search: ");
         
-        vector<Expense> results;
-        for (const auto& expense : expenses) {
-            if (Validator::toLower(expense.getCategory()) == Validator::toLower(category)) {
-                results.push_back(expense);
-            }
-        }
+        AllocationScope allocations("search by category");
+        LatencyScope latency(Metric::SearchCategory);
+        TRACE_SPAN("search: category");
+        auto results = cachedSearch("category:" + Validator::toLower(category), [&](Selection& rows) {
+            store.select(ScanBounds(), rows, [&](const Expense& expense) {
+                return Validator::equalsIgnoreCase(expense.getCategory(), category);
+            });
+        });
         
         displaySearchResults(results, "Category: " + category);
     }
@@ -752,12 +7280,13 @@ public:
             cout << "Note: Date range corrected (start < end)\n";
         }
         
-        vector<Expense> results;
-        for (const auto& expense : expenses) {
-            if (expense.getDate() >= startDate && expense.getDate() <= endDate) {
-                results.push_back(expense);
-            }
-        }
+        // Only partitions overlapping the range are scanned
+        AllocationScope allocations("search by date range");
+        LatencyScope latency(Metric::SearchDateRange);
+        TRACE_SPAN("search: date range");
+        auto results = cachedSearch("dates:" + startDate + ":" + endDate, [&](Selection& rows) {
+            store.select(ScanBounds::dates(startDate, endDate), rows);
+        });
         
         displaySearchResults(results, "Date range: " + startDate + " to " + endDate);
     }
@@ -772,12 +7301,13 @@ public:
             cout << "Note: Amount range corrected (min < max)\n";
         }
         
-        vector<Expense> results;
-        for (const auto& expense : expenses) {
-            if (expense.getAmount() >= minAmount && expense.getAmount() <= maxAmount) {
-                results.push_back(expense);
-            }
-        }
+        AllocationScope allocations("search by amount range");
+        LatencyScope latency(Metric::SearchAmountRange);
+        TRACE_SPAN("search: amount range");
+        string range = Validator::formatCurrency(minAmount) + ":" + Validator::formatCurrency(maxAmount);
+        auto results = cachedSearch("amounts:" + range, [&](Selection& rows) {
+            store.select(ScanBounds::amounts(minAmount, maxAmount), rows);
+        });
         
         stringstream criteria;
         criteria << "Amount range: " << Validator::formatCurrency(minAmount) 
@@ -787,25 +7317,23 @@ public:
     
     // NEW: Search by payment method
     void searchByPaymentMethod() {
-        set<string> paymentMethods;
-        for (const auto& expense : expenses) {
-            paymentMethods.insert(expense.getPaymentMethod());
-        }
-        
+        // The aggregates already know every payment method in use
         cout << "Available payment methods: ";
-        for (const auto& method : paymentMethods) {
-            cout << method << " ";
+        for (const auto& method : store.aggregates().payments) {
+            cout << method.first << " ";
         }
         cout << endl;
         
         string paymentMethod = getStringInput("Enter payment method to search: ");
         
-        vector<Expense> results;
-        for (const auto& expense : expenses) {
-            if (Validator::toLower(expense.getPaymentMethod()) == Validator::toLower(paymentMethod)) {
-                results.push_back(expense);
-            }
-        }
+        AllocationScope allocations("search by payment method");
+        LatencyScope latency(Metric::SearchPaymentMethod);
+        TRACE_SPAN("search: payment method");
+        auto results = cachedSearch("payment:" + Validator::toLower(paymentMethod), [&](Selection& rows) {
+            store.select(ScanBounds(), rows, [&](const Expense& expense) {
+                return Validator::equalsIgnoreCase(expense.getPaymentMethod(), paymentMethod);
+            });
+        });
         
         displaySearchResults(results, "Payment method: " + paymentMethod);
     }
@@ -815,121 +7343,80 @@ public:
         cout << "\n=== Advanced Search ===\n";
         cout << "Enter search criteria (leave empty to skip):\n";
         
-        string description = getStringInput("Description contains: ", true);
-        string category = getStringInput("Category: ", true);
-        string paymentMethod = getStringInput("Payment method: ", true);
+        SearchCriteria search;
+        search.description = getStringInput("Description contains: ", true);
+        search.category = getStringInput("Category: ", true);
+        search.paymentMethod = getStringInput("Payment method: ", true);
         
-        double minAmount = 0, maxAmount = DBL_MAX;
         string amountInput = getStringInput("Minimum amount (or empty): ", true);
         if (!amountInput.empty() && Validator::isValidAmount(amountInput)) {
-            minAmount = stod(amountInput);
+            search.minAmount = stod(amountInput);
         }
         
         amountInput = getStringInput("Maximum amount (or empty): ", true);
         if (!amountInput.empty() && Validator::isValidAmount(amountInput)) {
-            maxAmount = stod(amountInput);
+            search.maxAmount = stod(amountInput);
         }
         
-        string startDate = "", endDate = "";
         string dateInput = getStringInput("Start date (YYYY-MM-DD or empty): ", true);
         if (!dateInput.empty() && Validator::isValidDate(dateInput)) {
-            startDate = dateInput;
+            search.startDate = dateInput;
         }
         
         dateInput = getStringInput("End date (YYYY-MM-DD or empty): ", true);
         if (!dateInput.empty() && Validator::isValidDate(dateInput)) {
-            endDate = dateInput;
+            search.endDate = dateInput;
         }
         
-        vector<Expense> results;
-        for (const auto& expense : expenses) {
-            bool matches = true;
-            
-            // Check description
-            if (!description.empty()) {
-                if (Validator::toLower(expense.getDescription()).find(Validator::toLower(description)) == string::npos) {
-                    matches = false;
-                }
-            }
-            // Check category
-            if (!category.empty() && Validator::toLower(expense.getCategory()) != Validator::toLower(category)) {
-                matches = false;
-            }
-            // Check payment method
-            if (!paymentMethod.empty() && Validator::toLower(expense.getPaymentMethod()) != Validator::toLower(paymentMethod)) {
-                matches = false;
-            }
-            // Check amount range
-            if (expense.getAmount() < minAmount || expense.getAmount() > maxAmount) {
-                matches = false;
-            }
-            // Check date range
-            if (!startDate.empty() && expense.getDate() < startDate) {
-                matches = false;
-            }   
-            if (!endDate.empty() && expense.getDate() > endDate) {
-                matches = false;
-            }
-            
-            if (matches) {
-                results.push_back(expense);
-            }
-        }
+        AllocationScope allocations("advanced search");
+        LatencyScope latency(Metric::AdvancedSearch);
+        TRACE_SPAN("search: advanced");
+        shared_ptr<const QueryResult> results = runSearch(search);
         
         stringstream criteria;
         criteria << "Advanced search with " << 
-                    (!description.empty() ? "description, " : "") <<
-                    (!category.empty() ? "category, " : "") <<
-                    (!paymentMethod.empty() ? "payment method, " : "") <<
-                    (minAmount > 0 ? "min amount, " : "") <<
-                    (maxAmount < DBL_MAX ? "max amount, " : "") <<
-                    (!startDate.empty() ? "start date, " : "") <<
-                    (!endDate.empty() ? "end date" : "");
+                    (!search.description.empty() ? "description, " : "") <<
+                    (!search.category.empty() ? "category, " : "") <<
+                    (!search.paymentMethod.empty() ? "payment method, " : "") <<
+                    (search.minAmount > 0 ? "min amount, " : "") <<
+                    (search.maxAmount < DBL_MAX ? "max amount, " : "") <<
+                    (!search.startDate.empty() ? "start date, " : "") <<
+                    (!search.endDate.empty() ? "end date" : "");
         
         displaySearchResults(results, criteria.str());
     }
     
     // Display search results in a formatted table
-    void displaySearchResults(const vector<Expense>& results, const string& criteria) {
+    void displaySearchResults(shared_ptr<const QueryResult> results, const string& criteria) {
         cout << "\n=== Search Results (" << criteria << ") ===\n";
         
-        if (results.empty()) {
+        // Kept for "Export to CSV" until the ledger changes
+        lastSearch = results;
+        lastCriteria = criteria;
+        const Selection& rows = results->rows;
+        RuntimeMetrics::add(RuntimeMetrics::rowsReturned, rows.size());
+        
+        if (rows.empty()) {
             cout << "No expenses found matching the criteria.\n\n";
             return;
         }
         
-        cout << left << setw(5) << "ID" 
-             << setw(20) << "Description" 
-             << setw(10) << "Amount"
-             << setw(12) << "Category" 
-             << setw(12) << "Date"
-             << setw(8) << "Payment" << endl;
-        cout << string(67, '-') << endl;
-        
-        double total = 0;
-        for (const auto& expense : results) {
-            expense.display();
-            total += expense.getAmount();
-        }
+        renderSelection(rows);
         
-        cout << "\nFound " << results.size() << " expenses" << endl;
-        cout << "Total amount: " << Validator::formatCurrency(total) << "\n\n";
+        cout << "\nFound " << rows.size() << " expenses" << endl;
+        cout << "Total amount: " << Validator::formatCurrency(results->total) << "\n\n";
     }
     
     // Calculate total amount of all expenses
     double getTotalAmount() const {
-        double total = 0;
-        for (const auto& expense : expenses) {
-            total += expense.getAmount();
-        }
-        return total;
+        return store.totalAmount();
     }
     
     // Enhanced update expense with more options
     void updateExpense() {
         cout << "\n=== Update Expense ===\n";
         
-        if (expenses.empty()) {
+        if (store.empty()) {
             cout << "No expenses to update.\n\n";
             return;
         }
@@ -938,16 +7425,22 @@ public:
         
         int id = getIntInput("Enter expense ID to update: ");
         
-        auto it = find_if(expenses.begin(), expenses.end(),
-            [id](const Expense& e) { return e.getId() == id; });
-        
-        if (it == expenses.end()) {
+        const Expense* found = store.find(id);
+        if (found == nullptr) {
             cout << "Expense with ID " << id << " not found.\n\n";
             return;
         }
         
         cout << "\nCurrent expense details:\n";
-        it->displayDetailed();
+        found->displayDetailed();
+        
+        if (!store.isHot(id)) {
+            cout << "\nThis expense is in a sealed archive and cannot be changed.\n\n";
+            return;
+        }
+        
+        // Edit a copy; the store re-files it if the date moves to another period
+        Expense edited = *found;
         
         cout << "\nWhat would you like to update?\n";
         cout << "1. Description\n2. Amount\n3. Category\n4. Date\n";
@@ -958,43 +7451,43 @@ public:
         switch (choice) {
             case 1: {
                 string newDesc = getStringInput("Enter new description: ");
-                it->setDescription(newDesc);
+                edited.setDescription(newDesc);
                 break;
             }
             case 2: {
                 double newAmount = getAmountInput("Enter new amount: $");
-                it->setAmount(newAmount);
+                edited.setAmount(newAmount);
                 break;
             }
             case 3: {
                 showCategorySuggestions();
                 string newCategory = getStringInput("Enter new category: ");
-                it->setCategory(newCategory);
+                edited.setCategory(newCategory);
                 break;
             }
             case 4: {
                 string newDate = getDateInput("Enter new date");
-                it->setDate(newDate);
+                edited.setDate(newDate);
                 break;
             }
             case 5: {
                 string newNotes = getStringInput("Enter new notes: ", true);
-                it->setNotes(newNotes);
+                edited.setNotes(newNotes);
                 break;
             }
             case 6: {
                 string newPayment = getStringInput("Enter new payment method: ");
-                it->setPaymentMethod(newPayment);
+                edited.setPaymentMethod(newPayment);
                 break;
             }
             case 7: {
                 string newLocation = getStringInput("Enter new location: ", true);
-                it->setLocation(newLocation);
+                edited.setLocation(newLocation);
                 break;
             }
             case 8: {
                 bool newRecurring = getBoolInput("Is this a recurring expense?");
-                it->setIsRecurring(newRecurring);
+                edited.setIsRecurring(newRecurring);
                 break;
             }
             case 9: {
@@ -1008,28 +7501,41 @@ public:
                 string newLocation = getStringInput("Enter new location: ", true);
                 bool newRecurring = getBoolInput("Is this a recurring expense?");
                 
-                it->setDescription(newDesc);
-                it->setAmount(newAmount);
-                it->setCategory(newCategory);
-                it->setDate(newDate);
-                it->setNotes(newNotes);
-                it->setPaymentMethod(newPayment);
-                it->setLocation(newLocation);
-                it->setIsRecurring(newRecurring);
+                edited.setDescription(newDesc);
+                edited.setAmount(newAmount);
+                edited.setCategory(newCategory);
+                edited.setDate(newDate);
+                edited.setNotes(newNotes);
+                edited.setPaymentMethod(newPayment);
+                edited.setLocation(newLocation);
+                edited.setIsRecurring(newRecurring);
                 break;
             }
         }
         
+        // Newly marked recurring: ask when it repeats
+        bool scheduled = edited.getIsRecurring() && !found->getIsRecurring();
+        RecurrenceRule rule;
+        int until = INT_MAX;
+        if (scheduled) {
+            rule = getRecurrenceInput();
+            until = getEndDateInput(edited.getDate());
+        }
+        
+        string previousKey = store.keyOf(edited.getId());
+        store.replace(edited);
         updateCategoryStats();
-        cout << "\n* Expense updated successfully!\n\n";
-        saveToFile();
+        cout << "\n* Expense updated successfully!\n";
+        persistExpense(edited, previousKey);
+        if (scheduled) startSchedule(edited, rule, until);
+        cout << "\n";
     }
     
     // Enhanced delete with confirmation
     void deleteExpense() {
         cout << "\n=== Delete Expense ===\n";
         
-        if (expenses.empty()) {
+        if (store.empty()) {
             cout << "No expenses to delete.\n\n";
             return;
         }
@@ -1038,24 +7544,30 @@ public:
         
         int id = getIntInput("Enter expense ID to delete: ");
         
-        auto it = find_if(expenses.begin(), expenses.end(),
-            [id](const Expense& e) { return e.getId() == id; });
-        
-        if (it == expenses.end()) {
+        const Expense* found = store.find(id);
+        if (found == nullptr) {
             cout << "Expense with ID " << id << " not found.\n\n";
             return;
         }
         
         cout << "\nExpense to be deleted:\n";
-        it->displayDetailed();
+        found->displayDetailed();
+        
+        if (!store.isHot(id)) {
+            cout << "\nThis expense is in a sealed archive and cannot be deleted.\n\n";
+            return;
+        }
         
         bool confirm = getBoolInput("\nAre you sure you want to delete this expense?");
         
         if (confirm) {
-            expenses.erase(it);
+            string key = store.keyOf(id);
+            store.erase(id);
             updateCategoryStats();
-            cout << "* Expense deleted successfully!\n\n";
-            saveToFile();
+            cout << "* Expense deleted successfully!\n";
+            reconcileSchedules();
+            cout << "\n";
+            writer->enqueue(ChangeRecord::erase(id, key));
         } else {
             cout << "Delete operation cancelled.\n\n";
         }
@@ -1065,7 +7577,7 @@ public:
     void duplicateExpense() {
         cout << "\n=== Duplicate Expense ===\n";
         
-        if (expenses.empty()) {
+        if (store.empty()) {
             cout << "No expenses to duplicate.\n\n";
             return;
         }
@@ -1074,163 +7586,274 @@ public:
         
         int id = getIntInput("Enter expense ID to duplicate: ");
         
-        auto it = find_if(expenses.begin(), expenses.end(),
-            [id](const Expense& e) { return e.getId() == id; });
-        
-        if (it == expenses.end()) {
+        const Expense* found = store.find(id);
+        if (found == nullptr) {
             cout << "Expense with ID " << id << " not found.\n\n";
             return;
         }
         
-        Expense duplicate = it->createCopy();
-        expenses.push_back(duplicate);
+        Expense duplicate = found->createCopy();
+        store.insert(duplicate);
         updateCategoryStats();
         
         cout << "* Expense duplicated successfully! New ID: " << duplicate.getId() << "\n\n";
-        saveToFile();
+        persistExpense(duplicate);
     }
     
     // NEW: Undo last operation
     void undoLastOperation() {
-        if (undoStack.empty()) {
+        if (undoStack.empty() && undoLog.undoCount() == 0) {
             cout << "No operations to undo.\n\n";
             return;
         }
         
-        redoStack.push(expenses);
-        expenses = undoStack.top();
-        undoStack.pop();
+        LedgerStore::Snapshot state;
+        if (!undoStack.empty()) {
+            state = move(undoStack.back());
+            undoStack.pop_back();
+        } else if (!undoLog.popUndo(state)) {
+            cout << "Error: " << UndoLog::fileFor(filename)
+                 << " could not be read; older undo history was discarded.\n\n";
+            return;
+        }
+        redoStack.push_back(store.snapshot());
+        writer->enqueue(ChangeRecord::replace(store.restore(state)));
         updateCategoryStats();
-        saveToFile();
+        spillHistory(undoMemory);
         
-        cout << "* Last operation undone successfully!\n\n";
+        cout << "* Last operation undone successfully!\n";
+        reconcileSchedules();
+        cout << "\n";
     }
     
     // NEW: Redo last undone operation
     void redoLastOperation() {
-        if (redoStack.empty()) {
+        if (redoStack.empty() && undoLog.redoCount() == 0) {
             cout << "No operations to redo.\n\n";
             return;
         }
         
-        undoStack.push(expenses);
-        expenses = redoStack.top();
-        redoStack.pop();
+        LedgerStore::Snapshot state;
+        if (!redoStack.empty()) {
+            state = move(redoStack.back());
+            redoStack.pop_back();
+        } else if (!undoLog.popRedo(state)) {
+            cout << "Error: " << UndoLog::fileFor(filename)
+                 << " could not be read; the remaining redo history was discarded.\n\n";
+            return;
+        }
+        undoStack.push_back(store.snapshot());
+        writer->enqueue(ChangeRecord::replace(store.restore(state)));
         updateCategoryStats();
-        saveToFile();
+        spillHistory(undoMemory);
         
-        cout << "* Last operation redone successfully!\n\n";
+        cout << "* Last operation redone successfully!\n";
+        reconcileSchedules();
+        cout << "\n";
     }
     
     // Enhanced summary with detailed analytics
     void generateSummary() {
         cout << "\n=== Expense Summary & Analytics ===\n";
         
-        if (expenses.empty()) {
+        if (store.empty()) {
             cout << "No expenses found.\n\n";
             return;
         }
         
-        double total = getTotalAmount();
+        LatencyScope latency(Metric::Summary);
+        TRACE_SPAN("summary");
+        shared_ptr<const QueryResult> summary;
+        {
+            TRACE_SPAN("summary: totals");
+            summary = summaryTotals();
+        }
+        const LedgerAggregates& totals = summary->totals;
+        const LedgerSketches& sketches = summary->sketches;
+        double total = totals.total;
         cout << "[*] Overall Statistics:\n";
-        cout << "Total expenses: " << expenses.size() << endl;
+        cout << "Total expenses: " << totals.count << endl;
         cout << "Total amount: " << Validator::formatCurrency(total) << endl;
-        cout << "Average expense: " << Validator::formatCurrency(total / expenses.size()) << endl;
-        
-        // Find highest and lowest expenses
-        auto maxExpense = max_element(expenses.begin(), expenses.end(),
-            [](const Expense& a, const Expense& b) { return a.getAmount() < b.getAmount(); });
-        auto minExpense = min_element(expenses.begin(), expenses.end(),
-            [](const Expense& a, const Expense& b) { return a.getAmount() < b.getAmount(); });
-        
-        cout << "Highest expense: " << Validator::formatCurrency(maxExpense->getAmount()) 
-             << " (" << maxExpense->getDescription() << ")\n";
-        cout << "Lowest expense: " << Validator::formatCurrency(minExpense->getAmount()) 
-             << " (" << minExpense->getDescription() << ")\n";
-        
-        // Category breakdown
-        map<string, double> categoryTotals;
-        map<string, int> categoryCount;
-        for (const auto& expense : expenses) {
-            categoryTotals[expense.getCategory()] += expense.getAmount();
-            categoryCount[expense.getCategory()]++;
+        cout << "Average expense: " << Validator::formatCurrency(total / totals.count) << endl;
+        
+        // Highest and lowest expenses
+        cout << "Highest expense: " << Validator::formatCurrency(totals.maxAmount) 
+             << " (" << totals.maxDescription << ")\n";
+        cout << "Lowest expense: " << Validator::formatCurrency(totals.minAmount) 
+             << " (" << totals.minDescription << ")\n";
+        cout << "Median expense: ~" << Validator::formatCurrency(sketches.amounts.quantile(0.5)) << endl;
+        cout << "Distinct merchants (descriptions): ~" << sketches.descriptions.estimate() << endl;
+        cout << "Distinct locations: ~" << sketches.locations.estimate() << endl;
+        if (!store.allArchives().empty()) {
+            cout << "Archived: " << (totals.count - store.hotSize()) << " expenses in "
+                 << store.allArchives().size() << " sealed year(s)\n";
         }
         
+        // Category breakdown
+        TRACE_SPAN("summary: report");
         cout << "\n[*] Category Breakdown:\n";
         cout << left << setw(15) << "Category" << setw(10) << "Count" 
              << setw(12) << "Total" << setw(10) << "Avg" << "Percentage" << endl;
         cout << string(65, '-') << endl;
         
-        for (const auto& pair : categoryTotals) {
-            double percentage = (pair.second / total) * 100;
-            double average = pair.second / categoryCount[pair.first];
+        for (const auto& pair : totals.categories) {
+            double percentage = (pair.second.total / total) * 100;
+            double average = pair.second.total / pair.second.count;
             cout << left << setw(15) << pair.first.substr(0, 14)
-                 << setw(10) << categoryCount[pair.first]
-                 << setw(12) << Validator::formatCurrency(pair.second).substr(0, 11)
+                 << setw(10) << pair.second.count
+                 << setw(12) << Validator::formatCurrency(pair.second.total).substr(0, 11)
                  << setw(10) << Validator::formatCurrency(average).substr(0, 9)
                  << fixed << setprecision(1) << percentage << "%" << endl;
         }
         
-        // Payment method breakdown
-        map<string, double> paymentTotals;
-        for (const auto& expense : expenses) {
-            paymentTotals[expense.getPaymentMethod()] += expense.getAmount();
+        // Percentiles, estimated from the sketches rather than by sorting
+        cout << "\n[*] Amount Percentiles (estimated):\n";
+        cout << left << setw(15) << "Category" << setw(12) << "Median" << setw(12) << "p90" << "p99" << endl;
+        cout << string(50, '-') << endl;
+        auto percentiles = [](const string& name, const QuantileSketch& sketch) {
+            cout << left << setw(15) << name.substr(0, 14)
+                 << setw(12) << Validator::formatCurrency(sketch.quantile(0.5)).substr(0, 11)
+                 << setw(12) << Validator::formatCurrency(sketch.quantile(0.9)).substr(0, 11)
+                 << Validator::formatCurrency(sketch.quantile(0.99)) << endl;
+        };
+        for (const auto& pair : sketches.categories) {
+            percentiles(pair.first, pair.second);
         }
+        percentiles("All", sketches.amounts);
         
+        // Payment method breakdown
         cout << "\n[*] Payment Method Breakdown:\n";
-        for (const auto& pair : paymentTotals) {
-            double percentage = (pair.second / total) * 100;
+        for (const auto& pair : totals.payments) {
+            double percentage = (pair.second.total / total) * 100;
             cout << left << setw(15) << pair.first << ": " 
-                 << Validator::formatCurrency(pair.second) 
+                 << Validator::formatCurrency(pair.second.total) 
                  << " (" << fixed << setprecision(1) << percentage << "%)" << endl;
         }
         
         // Monthly breakdown
-        map<string, double> monthlyTotals;
-        for (const auto& expense : expenses) {
-            string month = expense.getDate().substr(0, 7); // YYYY-MM
-            monthlyTotals[month] += expense.getAmount();
-        }
-        
-        if (monthlyTotals.size() > 1) {
+        if (totals.months.size() > 1) {
             cout << "\n[*] Monthly Breakdown:\n";
-            for (const auto& pair : monthlyTotals) {
+            for (const auto& pair : totals.months) {
                 cout << pair.first << ": " << Validator::formatCurrency(pair.second) << endl;
             }
         }
         
-        // Recurring expenses summary
-        double recurringTotal = 0;
-        int recurringCount = 0;
-        for (const auto& expense : expenses) {
-            if (expense.getIsRecurring()) {
-                recurringTotal += expense.getAmount();
-                recurringCount++;
+        // Weeks and rolling windows, from the daily series
+        const LedgerTimeSeries& series = store.timeSeries();
+        if (series.total.lastDay() != INT_MIN) {
+            int anchor = trendAnchor(series);
+            int monday = anchor - (Validator::weekday(anchor) + 6) % 7;
+            cout << "\n[*] Weekly Breakdown (last 8 weeks):\n";
+            for (int week = 7; week >= 0; week--) {
+                int start = monday - 7 * week;
+                cout << "Week of " << Validator::dateOf(start) << ": " << cents(series.total.sum(start, start + 6))
+                     << endl;
             }
+            
+            cout << "\n[*] Rolling Windows (to " << Validator::dateOf(anchor) << "):\n";
+            const pair<int, const char*> windows[] = {{7, "week over week"}, {30, "month over month"},
+                                                      {90, "quarter over quarter"}};
+            for (const auto& window : windows) {
+                int days = window.first;
+                long long now = series.total.sum(anchor - days + 1, anchor);
+                long long before = series.total.sum(anchor - 2 * days + 1, anchor - days);
+                cout << "Last " << days << " days: " << cents(now) << " (previous " << days << ": "
+                     << cents(before) << ", " << window.second << " " << change(before, now) << ")\n";
+            }
+            showPeriodTable("Category Trends (last 30 days against the 30 before)", series.categories,
+                            anchor - 29, anchor);
         }
         
-        if (recurringCount > 0) {
+        // Recurring expenses summary
+        if (totals.recurringCount > 0 || !schedules.all().empty()) {
             cout << "\n[*] Recurring Expenses:\n";
-            cout << "Count: " << recurringCount << endl;
-            cout << "Monthly total: " << Validator::formatCurrency(recurringTotal) << endl;
-            cout << "Annual projection: " << Validator::formatCurrency(recurringTotal * 12) << endl;
+            cout << "Count: " << totals.recurringCount << endl;
+            cout << "Amount recorded: " << Validator::formatCurrency(totals.recurringTotal) << endl;
+            if (schedules.all().empty()) {
+                cout << "Projection: no schedules (mark an expense as recurring to set one)\n";
+            } else {
+                // Exact: every scheduled occurrence in the window is counted
+                int today = Validator::dayNumber(Validator::getCurrentDate());
+                pair<size_t, double> month = projectSchedules(today + 1, today + 30);
+                pair<size_t, double> year = projectSchedules(today + 1, today + 365);
+                cout << "Schedules: " << schedules.all().size() << endl;
+                cout << "Due in the next 30 days: " << Validator::formatCurrency(month.second) << " ("
+                     << month.first << " occurrence(s))\n";
+                cout << "Annual projection: " << Validator::formatCurrency(year.second) << " ("
+                     << year.first << " occurrence(s) in the next 12 months)\n";
+            }
         }
         
         cout << endl;
     }
     
+    // Seal closed years into compressed, immutable archives. Their totals
+    // stay available to summaries; rows are decompressed only on demand.
+    void archivePastYears() {
+        cout << "\n=== Archive Past Years ===\n";
+        
+        int currentYear = atoi(Validator::getCurrentDate().c_str());
+        set<string> years = store.hotYearsBefore(currentYear);
+        if (years.empty()) {
+            cout << "No closed years with unarchived expenses.\n\n";
+            return;
+        }
+        
+        cout << "Closed years with unarchived expenses: ";
+        for (const auto& year : years) {
+            cout << year << " ";
+        }
+        cout << endl;
+        int lastYear = getIntInput("Archive all years up to and including: ",
+                                   atoi(years.begin()->c_str()), currentYear - 1);
+        
+        cout << "Archived expenses can no longer be edited or deleted, and the\n"
+             << "undo/redo history is cleared.\n";
+        if (!getBoolInput("Continue?")) {
+            cout << "Archive operation cancelled.\n\n";
+            return;
+        }
+        
+        for (const auto& year : years) {
+            if (atoi(year.c_str()) > lastYear) break;
+            SegmentInfo info;
+            size_t rawBytes = 0, compressedBytes = 0;
+            string error;
+            if (!store.seal(year, info, rawBytes, compressedBytes, error)) {
+                cout << "Error: Could not archive " << year << ": " << error << "\n";
+                continue;
+            }
+            writer->enqueue(ChangeRecord::seal(info));
+            cout << "* Archived " << year << ": " << info.rows << " expenses, "
+                 << rawBytes << " -> " << compressedBytes << " bytes\n";
+        }
+        
+        // Hot-row snapshots taken before sealing would resurrect archived rows
+        clearHistory();
+        cout << "\n";
+    }
+    
     // Export expenses to CSV
     void exportToCSV() {
         cout << "\n=== Export to CSV ===\n";
         
-        if (expenses.empty()) {
+        if (store.empty()) {
             cout << "No expenses to export.\n\n";
             return;
         }
         
+        bool searchOnly = false;
+        if (lastSearch && !lastSearch->rows.empty() && store.isCurrent(lastSearch->rows)) {
+            cout << "1) All expenses  2) Last search results (" << lastSearch->rows.size()
+                 << " rows, " << lastCriteria << ")\n";
+            searchOnly = getIntInput("Choose what to export (1-2): ", 1, 2) == 2;
+        }
+        
         string csvFilename = getStringInput("Enter CSV filename (without .csv extension): ");
         csvFilename += ".csv";
         
+        LatencyScope latency(Metric::Export);
+        TRACE_SPAN("export: csv");
         ofstream csvFile(csvFilename);
         if (!csvFile.is_open()) {
             cout << "Error: Could not create CSV file.\n\n";
@@ -1241,7 +7864,7 @@ public:
         csvFile << "ID,Description,Amount,Category,Date,Notes,Recurring,PaymentMethod,Location\n";
         
         // Write data
-        for (const auto& expense : expenses) {
+        auto writeRow = [&](const Expense& expense) {
             csvFile << expense.getId() << ","
                     << "\"" << expense.getDescription() << "\","
                     << fixed << setprecision(2) << expense.getAmount() << ","
@@ -1251,28 +7874,247 @@ public:
                     << (expense.getIsRecurring() ? "Yes" : "No") << ","
                     << "\"" << expense.getPaymentMethod() << "\","
                     << "\"" << expense.getLocation() << "\"\n";
+        };
+        if (searchOnly) {
+            store.forEachSelected(lastSearch->rows, writeRow);
+        } else {
+            store.forEach(writeRow);
         }
         
+        RuntimeMetrics::add(RuntimeMetrics::bytesWritten, (unsigned long long)csvFile.tellp());
         csvFile.close();
         cout << "* Expenses exported to " << csvFilename << " successfully!\n\n";
     }
     
-    // Backup and restore
+    // Latency percentiles per operation, counters and memory gauges
+    void showRuntimeStats() {
+        cout << "\n=== Runtime Statistics ===\n";
+        
+        auto millis = [](uint64_t nanos) {
+            stringstream text;
+            text << fixed << setprecision(3) << nanos / 1e6;
+            return text.str();
+        };
+        cout << left << setw(23) << "Operation" << right << setw(8) << "Count" << setw(11) << "Mean ms"
+             << setw(11) << "p50 ms" << setw(11) << "p90 ms" << setw(11) << "p99 ms" << setw(11) << "Max ms" << endl;
+        cout << string(86, '-') << endl;
+        bool any = false;
+        for (size_t m = 0; m < (size_t)Metric::Count; m++) {
+            LatencyHistogram::Snapshot histogram = RuntimeMetrics::latency[m].snapshot();
+            if (histogram.count == 0) continue;
+            any = true;
+            cout << left << setw(23) << RuntimeMetrics::name((Metric)m) << right << setw(8) << histogram.count
+                 << setw(11) << millis((uint64_t)histogram.mean()) << setw(11) << millis(histogram.quantile(0.5))
+                 << setw(11) << millis(histogram.quantile(0.9)) << setw(11) << millis(histogram.quantile(0.99))
+                 << setw(11) << millis(histogram.highest) << endl;
+        }
+        if (!any) cout << "No operations recorded yet.\n";
+        cout << left;
+        
+        QueryCache::Stats cache = queryCache.stats();
+        pair<unsigned long long, unsigned long long> resident = RuntimeMetrics::residentBytes();
+        cout << "\nRows scanned: " << RuntimeMetrics::rowsScanned.load() << endl;
+        cout << "Rows returned: " << RuntimeMetrics::rowsReturned.load() << endl;
+        cout << "Bytes written: " << RuntimeMetrics::bytesWritten.load() << endl;
+        cout << "Query cache: " << cache.hits << " hit(s), " << cache.misses << " miss(es), "
+             << cache.entries << " entries, " << cache.bytes << " bytes\n";
+        cout << "Heap allocations: " << AllocationCounters::calls.load() << " ("
+             << AllocationCounters::bytes.load() << " bytes)\n";
+        if (resident.second > 0) {
+            cout << "Resident memory: " << resident.first / 1024 << " KB (peak " << resident.second / 1024 << " KB)\n";
+        }
+        cout << endl;
+    }
+    
+    // Bring the heap under --memory-budget between operations: drop cached
+    // results first, then unchanged rows (reloaded from disk on demand),
+    // then move undo history, oldest first, and redo history to disk
+    void enforceBudget() {
+        if (memoryBudget == 0) return;
+        auto over = [this] { return AllocationCounters::liveTotal() > (long long)memoryBudget; };
+        while (over() && queryCache.evictOldest()) {}
+        if (lastSearch && over()) lastSearch.reset();
+        if (over()) store.trimToBudget();
+        
+        while (over() && spillOldest()) {}
+    }
+    
+    // Live heap bytes by owner, from the allocator's own accounting
+    void showMemoryReport() {
+        cout << "\n=== Memory Report ===\n";
+        
+        pair<size_t, size_t> text = store.loadedTextBytes();
+        long long rows = AllocationCounters::liveBytes(MemoryTag::Rows);
+        long long total = AllocationCounters::liveTotal();
+        long long headers = AllocationCounters::liveBlocks.load() * (long long)sizeof(AllocationCounters::Header);
+        stringstream undo, loaded;
+        undo << undoStack.size() << " undo, " << redoStack.size() << " redo";
+        if (undoLog.undoCount() + undoLog.redoCount() > 0) {
+            undo << " (+" << undoLog.undoCount() << "/" << undoLog.redoCount() << " on disk)";
+        }
+        loaded << text.second << " of " << store.allPartitions().size() << " partitions loaded";
+        
+        struct Line {
+            string owner;
+            long long bytes;
+            string detail;
+        };
+        vector<Line> lines = {
+            {"Row data", rows - (long long)text.first, loaded.str()},
+            {"String heap", (long long)text.first, "descriptions, categories, notes..."},
+            {"ID index", AllocationCounters::liveBytes(MemoryTag::Index), ""},
+            {"Undo & snapshots", AllocationCounters::liveBytes(MemoryTag::Snapshots), undo.str()},
+            {"Caches", AllocationCounters::liveBytes(MemoryTag::Cache), "query results, archives"},
+            {"Categories", AllocationCounters::liveBytes(MemoryTag::Categories), ""},
+            {"Write queue", AllocationCounters::liveBytes(MemoryTag::Persistence), ""},
+            {"Other", AllocationCounters::liveBytes(MemoryTag::Other), ""}
+        };
+        
+        auto kilobytes = [](long long bytes) {
+            stringstream value;
+            value << fixed << setprecision(1) << bytes / 1024.0 << " KB";
+            return value.str();
+        };
+        cout << left << setw(20) << "Owner" << right << setw(14) << "Size" << setw(9) << "Share" << "  " << endl;
+        cout << string(70, '-') << endl;
+        for (const auto& line : lines) {
+            double share = total > 0 ? 100.0 * line.bytes / total : 0;
+            cout << left << setw(20) << line.owner << right << setw(14) << kilobytes(line.bytes)
+                 << setw(8) << fixed << setprecision(1) << share << "%  " << line.detail << endl;
+        }
+        cout << string(70, '-') << endl;
+        cout << left << setw(20) << "Heap in use" << right << setw(14) << kilobytes(total) << endl;
+        cout << left << "Accounting headers: " << kilobytes(headers) << " ("
+             << AllocationCounters::liveBlocks.load() << " blocks)\n";
+        
+        pair<unsigned long long, unsigned long long> resident = RuntimeMetrics::residentBytes();
+        if (resident.second > 0) {
+            cout << "Resident memory: " << kilobytes((long long)resident.first) << " (peak "
+                 << kilobytes((long long)resident.second) << ")\n";
+        }
+        if (memoryBudget > 0) {
+            cout << "Memory budget: " << kilobytes((long long)memoryBudget)
+                 << (total > (long long)memoryBudget ? " (exceeded)" : "") << "\n";
+        } else {
+            cout << "Memory budget: none (set one with --memory-budget MB)\n";
+        }
+        cout << endl;
+    }
+    
+    // Dump the spans recorded so far as Chrome trace-event JSON
+    void writeTrace() {
+#ifdef EXPENSE_TRACKER_TRACING
+        string path = traceFile.empty() ? "trace.json" : traceFile;
+        size_t spans = 0;
+        if (TraceLog::write(path, spans)) {
+            cout << "* Trace of " << spans << " span(s) written to " << path
+                 << " (open it in chrome://tracing or ui.perfetto.dev)\n\n";
+        } else {
+            cout << "Error: Could not write trace file " << path << ".\n\n";
+        }
+#else
+        cout << "Tracing is not compiled in; rebuild with -DEXPENSE_TRACKER_TRACING.\n\n";
+#endif
+    }
+    
+    // Backup and restore: full copy to start a chain, journal increments after
     void backupData() {
-        string backupFile = filename + ".backup." + to_string(time(0));
-        ofstream backup(backupFile);
+        BackupStore backups(filename);
+        BackupStore::Entry entry = backups.prepare(backups.needsFullBackup());
+        bool ok = false;
+        bool unchanged = false;
+        
+        writer->withJournal([&](const string& journalFile) {
+            if (entry.full) {
+                LedgerFile::Encoder encoder;
+                store.forEach([&](const Expense& expense) {
+                    encoder.add(expense.toString());
+                });
+                entry.records = store.size();
+                ok = LedgerFile::writeAtomic(entry.file, encoder.finish());
+                if (ok) remove(journalFile.c_str());
+                return;
+            }
+            
+            string journal;
+            if (!LedgerFile::readAll(journalFile, journal) || journal.empty()) {
+                unchanged = true;
+                return;
+            }
+            entry.records = (size_t)count(journal.begin(), journal.end(), '\n');
+            ok = rename(journalFile.c_str(), entry.file.c_str()) == 0;
+        });
+        
+        if (unchanged) {
+            cout << "* No changes since the last backup; nothing to do.\n\n";
+            return;
+        }
+        if (!ok || !backups.commit(entry)) {
+            cout << "Error: Could not create backup file.\n\n";
+            return;
+        }
+        
+        cout << "* Data backed up to: " << entry.file << " ("
+             << (entry.full ? "full, " + to_string(entry.records) + " expenses"
+                            : "incremental, " + to_string(entry.records) + " changes")
+             << ")\n";
+        size_t pruned = backups.prune();
+        if (pruned > 0) {
+            cout << "* Pruned " << pruned << " old backup file(s).\n";
+        }
+        cout << "\n";
+    }
+    
+    // Restore the ledger as it was at any backup in the catalog
+    void restoreBackup() {
+        cout << "\n=== Restore from Backup ===\n";
+        
+        BackupStore backups(filename);
+        const vector<BackupStore::Entry>& entries = backups.list();
+        if (entries.empty()) {
+            cout << "No backups found.\n\n";
+            return;
+        }
+        
+        for (size_t i = 0; i < entries.size(); i++) {
+            char created[32];
+            strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime(&entries[i].created));
+            cout << setw(3) << right << (i + 1) << left << ". " << created << "  "
+                 << (entries[i].full ? "full        " : "incremental ")
+                 << entries[i].records << (entries[i].full ? " expenses" : " changes") << "\n";
+        }
         
-        if (!backup.is_open()) {
-            cout << "Error: Could not create backup file.\n\n";
+        int choice = getIntInput("Choose backup to restore (1-" + to_string(entries.size()) + "): ",
+                                 1, (int)entries.size());
+        
+        map<int, string> rows;
+        string error;
+        if (!backups.rebuild((size_t)choice - 1, rows, error)) {
+            cout << "Error: Could not restore backup: " << error << "\n\n";
             return;
         }
         
-        for (const auto& expense : expenses) {
-            backup << expense.toString() << endl;
+        vector<Expense> restored;
+        restored.reserve(rows.size());
+        for (const auto& row : rows) {
+            Expense expense = Expense::fromString(row.second);
+            if (expense.getId() > 0) restored.push_back(expense);
+        }
+        
+        if (!getBoolInput("Replace the current " + to_string(store.size()) +
+                          " expenses with " + to_string(restored.size()) + " from the backup?")) {
+            cout << "Restore cancelled.\n\n";
+            return;
         }
-        backup.close();
         
-        cout << "* Data backed up to: " << backupFile << "\n\n";
+        unsealArchives();
+        saveState(); // Save for undo
+        store.assignHot(restored);
+        updateCategoryStats();
+        persistAll();
+        cout << "* Restored " << store.size() << " expenses.\n";
+        reconcileSchedules();
+        cout << "\n";
     }
     
     void clearAllData() {
@@ -1282,11 +8124,14 @@ public:
         string confirmation = getStringInput("Type 'DELETE ALL' to confirm: ");
         
         if (confirmation == "DELETE ALL") {
+            unsealArchives();
             saveState(); // Save for undo
-            expenses.clear();
+            store.clear();
             updateCategoryStats();
-            saveToFile();
-            cout << "* All expenses have been deleted.\n\n";
+            persistAll();
+            cout << "* All expenses have been deleted.\n";
+            reconcileSchedules();
+            cout << "\n";
         } else {
             cout << "Operation cancelled.\n\n";
         }
@@ -1345,6 +8190,12 @@ private:
         cout << "  UTILITIES                             \n";
         cout << "  15. Backup Data                       \n";
         cout << "  16. Clear All Data                    \n";
+        cout << "  17. Restore from Backup               \n";
+        cout << "  18. Archive Past Years                \n";
+        cout << "  19. Runtime Statistics                \n";
+        cout << "  20. Export Trace                      \n";
+        cout << "  21. Memory Report                     \n";
+        cout << "  22. Spending Trends                   \n";
         cout << "                                        \n";
         cout << "  0.  Exit Application                  \n";
         cout << "========================================\n";
@@ -1353,15 +8204,15 @@ private:
     int getMenuChoice() {
         string input;
         while (true) {
-            cout << "\nEnter your choice (0-16): ";
+            cout << "\nEnter your choice (0-22): ";
             getline(cin, input);
             
             try {
                 int choice = stoi(input);
-                if (choice >= 0 && choice <= 16) {
+                if (choice >= 0 && choice <= 22) {
                     return choice;
                 }
-                cout << "Error: Please enter a number between 0 and 16.\n";
+                cout << "Error: Please enter a number between 0 and 22.\n";
             } catch (const exception&) {
                 cout << "Error: Please enter a valid number.\n";
             }
@@ -1369,7 +8220,8 @@ private:
     }
     
 public:
-    ExpenseTrackerApp() : running(true) {
+    ExpenseTrackerApp(const AppOptions& options = AppOptions())
+        : manager("expenses.txt", options), running(true) {
         cout << "========================================\n";
         cout << "     Welcome to Enhanced Expense       \n";
         cout << "           Tracker v2.0!               \n";
@@ -1452,7 +8304,32 @@ public:
                     manager.clearAllData();
                     pauseScreen();
                     break;
+                case 17:
+                    manager.restoreBackup();
+                    pauseScreen();
+                    break;
+                case 18:
+                    manager.archivePastYears();
+                    pauseScreen();
+                    break;
+                case 19:
+                    manager.showRuntimeStats();
+                    pauseScreen();
+                    break;
+                case 20:
+                    manager.writeTrace();
+                    pauseScreen();
+                    break;
+                case 21:
+                    manager.showMemoryReport();
+                    pauseScreen();
+                    break;
+                case 22:
+                    manager.showTrends();
+                    pauseScreen();
+                    break;
                 case 0:
+                    manager.saveToFile();
                     cout << "\n========================================\n";
                     cout << "     Thank you for using Enhanced      \n";
                     cout << "          Expense Tracker!             \n";
@@ -1468,14 +8345,1061 @@ public:
                     cout << "Invalid choice. Please try again.\n\n";
                     pauseScreen();
             }
+            if (running) {
+                manager.reportSaveErrors();
+                manager.catchUpSchedules();     // A day may have passed while the menu was open
+                manager.enforceBudget();
+            }
+        }
+    }
+};
+
+#ifdef __linux__
+// Little-endian encoding of server frames. Strings are a u16 length and
+// the bytes; doubles travel as their IEEE-754 bit pattern.
+class FrameWriter {
+private:
+    string& out;
+    
+    void raw(uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; i++) out.push_back((char)(value >> (8 * i)));
+    }
+    
+public:
+    explicit FrameWriter(string& buffer) : out(buffer) {}
+    
+    void u8(uint8_t value) { raw(value, 1); }
+    void u16(uint16_t value) { raw(value, 2); }
+    void u32(uint32_t value) { raw(value, 4); }
+    void u64(uint64_t value) { raw(value, 8); }
+    void i32(int32_t value) { raw((uint32_t)value, 4); }
+    
+    void f64(double value) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        raw(bits, 8);
+    }
+    
+    void str(const string& value) {
+        size_t length = min(value.size(), (size_t)UINT16_MAX);
+        u16((uint16_t)length);
+        out.append(value.data(), length);
+    }
+    
+    void expense(const Expense& expense) {
+        i32(expense.getId());
+        str(expense.getDescription());
+        f64(expense.getAmount());
+        str(expense.getCategory());
+        str(expense.getDate());
+        str(expense.getNotes());
+        u8(expense.getIsRecurring() ? 1 : 0);
+        str(expense.getPaymentMethod());
+        str(expense.getLocation());
+    }
+};
+
+// Reads fields back out of a frame; a read past the end marks the frame
+// bad and returns zeros instead of throwing
+class FrameReader {
+private:
+    const char* data;
+    size_t size;
+    size_t at = 0;
+    bool ok = true;
+    
+    uint64_t raw(int bytes) {
+        if (!ok || size - at < (size_t)bytes) {
+            ok = false;
+            return 0;
+        }
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; i++) value |= (uint64_t)(uint8_t)data[at + i] << (8 * i);
+        at += bytes;
+        return value;
+    }
+    
+public:
+    FrameReader(const char* bytes, size_t length) : data(bytes), size(length) {}
+    
+    uint8_t u8() { return (uint8_t)raw(1); }
+    uint16_t u16() { return (uint16_t)raw(2); }
+    uint32_t u32() { return (uint32_t)raw(4); }
+    uint64_t u64() { return raw(8); }
+    int32_t i32() { return (int32_t)u32(); }
+    
+    double f64() {
+        uint64_t bits = raw(8);
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    
+    string str() {
+        size_t length = u16();
+        if (!ok || size - at < length) {
+            ok = false;
+            return "";
+        }
+        string value(data + at, length);
+        at += length;
+        return value;
+    }
+    
+    // Every field read and nothing left over
+    bool complete() const { return ok && at == size; }
+};
+
+// Serves the ledger over a Unix domain socket (--serve PATH).
+//
+// Frames are a u32 byte count followed by that many bytes. Requests carry
+// a u32 tag chosen by the client, an op byte and its fields; responses echo
+// the tag and add a status byte. Non-Ok responses carry a message string.
+//
+//   1 Add      desc, f64 amount, category, date, notes, payment, location,
+//              u8 recurring                    -> i32 id
+//   2 Get      i32 id                          -> expense
+//   3 Query    desc, category, payment, f64 min, f64 max, start, end,
+//              u32 offset, u32 limit           -> u32 matches, f64 total,
+//                                                 u32 count, count x expense
+//   4 Summary                                  -> u64 count, f64 total,
+//              u32 recurring count, f64 recurring total, categories and
+//              payments (u32 n, n x {str, u32 count, f64 total}),
+//              months (u32 n, n x {str, f64 total})
+//
+// An expense is i32 id, desc, f64 amount, category, date, notes,
+// u8 recurring, payment, location.
+//
+// One thread runs the epoll loop and does all socket I/O; handler threads
+// run the requests. A connection's requests run one at a time in the order
+// sent, so clients may pipeline and still read their own writes; requests
+// from different connections run concurrently. Reads work on the latest
+// published version of the ledger and never wait for adds. Adds go through
+// the lock-free ingest queue and are applied in batches by one thread; an
+// Add is answered once applied, so later requests on the connection see it.
+class LedgerServer {
+public:
+    enum Op : uint8_t { OP_ADD = 1, OP_GET = 2, OP_QUERY = 3, OP_SUMMARY = 4 };
+    enum Status : uint8_t {
+        STATUS_OK = 0,
+        STATUS_BAD_REQUEST = 1,     // Unknown op or malformed fields
+        STATUS_NOT_FOUND = 2,
+        STATUS_INVALID = 3,         // Well-formed but rejected values
+        STATUS_FAILED = 4           // Unexpected error while serving
+    };
+    
+    static const size_t MAX_FRAME = 1 << 20;
+    static const uint32_t MAX_RESULTS = 10000;      // Rows per Query response
+    
+private:
+    static const size_t MAX_OUTPUT = 8 << 20;       // Unsent bytes before a connection is paused
+    static const size_t MAX_QUEUED = 1024;          // Queued requests before a connection is paused
+    
+    // epoll tags below FIRST_CONNECTION; connections count up from it
+    static const uint64_t LISTEN_TAG = 0, WAKE_TAG = 1, SIGNAL_TAG = 2, FIRST_CONNECTION = 16;
+    
+    struct Connection {
+        int fd;
+        string input;               // Bytes received, not yet framed
+        string output;              // Responses, sent up to 'sent'
+        size_t sent = 0;
+        deque<string> requests;     // Framed requests waiting their turn
+        bool busy = false;          // A request is with the handlers
+        bool peerClosed = false;    // No more requests will arrive
+        uint32_t events = 0;        // Current epoll interest, 0 = not registered
+    };
+    
+    struct Job {
+        uint64_t connection;
+        string request;
+    };
+    
+    struct Completion {
+        uint64_t connection;
+        string response;
+    };
+    
+    ExpenseManager& manager;
+    string path;
+    size_t handlerCount;
+    bool bound = false;
+    int listenFd = -1, epollFd = -1, wakeFd = -1, signalFd = -1;
+    
+    unordered_map<uint64_t, unique_ptr<Connection>> connections;
+    uint64_t nextConnection = FIRST_CONNECTION;
+    
+    ExpenseIngest* ingest = nullptr;
+    mutex jobLock;
+    condition_variable jobReady;
+    deque<Job> jobs;
+    bool stopping = false;
+    vector<thread> handlers;
+    mutex completionLock;
+    deque<Completion> completions;
+    
+    static sigset_t stopSignals() {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGTERM);
+#ifdef EXPENSE_TRACKER_TRACING
+        sigaddset(&set, SIGUSR1);
+#endif
+        return set;
+    }
+    
+    bool fail(const string& what) {
+        cout << "Error: " << what << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    
+    // Drain the signalfd; false once a stop signal has arrived. In
+    // tracing builds SIGUSR1 writes the trace and serving goes on.
+    bool signalled() {
+        signalfd_siginfo info;
+        bool keepServing = true;
+        while (read(signalFd, &info, sizeof(info)) == (ssize_t)sizeof(info)) {
+#ifdef EXPENSE_TRACKER_TRACING
+            if (info.ssi_signo == SIGUSR1) {
+                manager.writeTrace();
+                cout << flush;
+                continue;
+            }
+#endif
+            keepServing = false;
+        }
+        return keepServing;
+    }
+    
+    bool watch(int fd, uint64_t tag, uint32_t events) {
+        epoll_event event = {};
+        event.events = events;
+        event.data.u64 = tag;
+        return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+    }
+    
+    bool open() {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+            cout << "Error: socket path must be 1 to " << sizeof(address.sun_path) - 1 << " characters.\n";
+            return false;
+        }
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        
+        // A leftover socket file is reused unless a server still answers on it
+        struct stat info;
+        if (lstat(path.c_str(), &info) == 0) {
+            if (!S_ISSOCK(info.st_mode)) {
+                cout << "Error: " << path << " exists and is not a socket.\n";
+                return false;
+            }
+            int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            bool live = probe >= 0 && connect(probe, (sockaddr*)&address, sizeof(address)) == 0;
+            if (probe >= 0) close(probe);
+            if (live) {
+                cout << "Error: another server is listening on " << path << ".\n";
+                return false;
+            }
+            unlink(path.c_str());
+        }
+        
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) return fail("cannot create socket");
+        if (bind(listenFd, (sockaddr*)&address, sizeof(address)) != 0) return fail("cannot bind " + path);
+        bound = true;
+        if (listen(listenFd, SOMAXCONN) != 0) return fail("cannot listen on " + path);
+        
+        sigset_t signals = stopSignals();
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (epollFd < 0 || wakeFd < 0 || signalFd < 0) return fail("cannot set up the event loop");
+        if (!watch(listenFd, LISTEN_TAG, EPOLLIN) || !watch(wakeFd, WAKE_TAG, EPOLLIN) ||
+            !watch(signalFd, SIGNAL_TAG, EPOLLIN)) {
+            return fail("cannot set up the event loop");
+        }
+        return true;
+    }
+    
+    // Request handling, on handler threads
+    
+    uint8_t reject(FrameWriter& out, uint8_t status, const string& message) {
+        out.str(message);
+        return status;
+    }
+    
+    uint8_t add(FrameReader& in, FrameWriter& out, ExpenseIngest::Producer& producer) {
+        string description = in.str();
+        double amount = in.f64();
+        string category = in.str();
+        string date = in.str();
+        string notes = in.str();
+        string paymentMethod = in.str();
+        string location = in.str();
+        bool recurring = in.u8() != 0;
+        if (!in.complete()) return reject(out, STATUS_BAD_REQUEST, "malformed Add request");
+        
+        Expense expense;
+        string error;
+        if (!ExpenseManager::makeExpense(producer.allocateId(), description, amount, category, date, notes,
+                                         paymentMethod, location, recurring, expense, error)) {
+            return reject(out, STATUS_INVALID, error);
+        }
+        int id = expense.getId();
+        ingest->waitApplied(producer.submit(move(expense)));
+        out.i32(id);
+        return STATUS_OK;
+    }
+    
+    uint8_t get(FrameReader& in, FrameWriter& out) {
+        int id = in.i32();
+        if (!in.complete()) return reject(out, STATUS_BAD_REQUEST, "malformed Get request");
+        
+        LedgerStore::PinnedVersion version = manager.pinVersion();
+        const Expense* expense = version->find(id);
+        if (expense == nullptr) return reject(out, STATUS_NOT_FOUND, "no expense with ID " + to_string(id));
+        out.expense(*expense);
+        return STATUS_OK;
+    }
+    
+    uint8_t query(FrameReader& in, FrameWriter& out) {
+        SearchCriteria search;
+        search.description = in.str();
+        search.category = in.str();
+        search.paymentMethod = in.str();
+        search.minAmount = in.f64();
+        search.maxAmount = in.f64();
+        search.startDate = in.str();
+        search.endDate = in.str();
+        size_t offset = in.u32();
+        size_t limit = in.u32();
+        if (!in.complete()) return reject(out, STATUS_BAD_REQUEST, "malformed Query request");
+        if ((!search.startDate.empty() && !Validator::isValidDate(search.startDate)) ||
+            (!search.endDate.empty() && !Validator::isValidDate(search.endDate))) {
+            return reject(out, STATUS_INVALID, "dates must be valid YYYY-MM-DD dates");
+        }
+        if (limit == 0 || limit > MAX_RESULTS) limit = MAX_RESULTS;
+        
+        LedgerStore::PinnedVersion version = manager.pinVersion();
+        shared_ptr<const QueryResult> result = manager.search(*version, search);
+        size_t matches = result->rows.size();
+        size_t from = min(offset, matches);
+        size_t to = from + min(limit, matches - from);
+        out.u32((uint32_t)matches);
+        out.f64(result->total);
+        out.u32((uint32_t)(to - from));
+        RuntimeMetrics::add(RuntimeMetrics::rowsReturned, to - from);
+        manager.forEachResult(*version, *result, from, to, [&out](const Expense& expense) {
+            out.expense(expense);
+        });
+        return STATUS_OK;
+    }
+    
+    uint8_t summary(FrameReader& in, FrameWriter& out) {
+        if (!in.complete()) return reject(out, STATUS_BAD_REQUEST, "malformed Summary request");
+        
+        LedgerStore::PinnedVersion version = manager.pinVersion();
+        const LedgerAggregates& totals = version->totals;
+        out.u64(totals.count);
+        out.f64(totals.total);
+        out.u32((uint32_t)totals.recurringCount);
+        out.f64(totals.recurringTotal);
+        for (const auto* buckets : {&totals.categories, &totals.payments}) {
+            out.u32((uint32_t)buckets->size());
+            for (const auto& entry : *buckets) {
+                out.str(entry.first);
+                out.u32((uint32_t)entry.second.count);
+                out.f64(entry.second.total);
+            }
+        }
+        out.u32((uint32_t)totals.months.size());
+        for (const auto& entry : totals.months) {
+            out.str(entry.first);
+            out.f64(entry.second);
+        }
+        return STATUS_OK;
+    }
+    
+    // Run one request (tag, op, fields) and build its response frame
+    string handle(const string& request, ExpenseIngest::Producer& producer) {
+        LatencyScope latency(Metric::ServerRequest);
+        TRACE_SPAN("server: request");
+        FrameReader in(request.data(), request.size());
+        uint32_t tag = in.u32();
+        uint8_t op = in.u8();
+        
+        string body;
+        FrameWriter out(body);
+        uint8_t status;
+        try {
+            switch (op) {
+                case OP_ADD: status = add(in, out, producer); break;
+                case OP_GET: status = get(in, out); break;
+                case OP_QUERY: status = query(in, out); break;
+                case OP_SUMMARY: status = summary(in, out); break;
+                default: status = reject(out, STATUS_BAD_REQUEST, "unknown op " + to_string(op)); break;
+            }
+        } catch (const exception& e) {
+            body.clear();
+            status = reject(out, STATUS_FAILED, e.what());
+        }
+        
+        string frame;
+        FrameWriter header(frame);
+        header.u32((uint32_t)(5 + body.size()));
+        header.u32(tag);
+        header.u8(status);
+        frame += body;
+        return frame;
+    }
+    
+    void handlerLoop() {
+        ExpenseIngest::Producer producer(*ingest);
+        while (true) {
+            Job job;
+            {
+                unique_lock<mutex> guard(jobLock);
+                jobReady.wait(guard, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty()) return;
+                job = move(jobs.front());
+                jobs.pop_front();
+            }
+            string response = handle(job.request, producer);
+            {
+                lock_guard<mutex> guard(completionLock);
+                completions.push_back({job.connection, move(response)});
+            }
+            uint64_t one = 1;
+            ssize_t ignored = write(wakeFd, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+    
+    // Connection handling, on the event loop thread
+    
+    bool paused(const Connection& connection) const {
+        return connection.output.size() - connection.sent > MAX_OUTPUT ||
+               connection.requests.size() >= MAX_QUEUED;
+    }
+    
+    bool finished(const Connection& connection) const {
+        return connection.peerClosed && !connection.busy && connection.requests.empty() &&
+               connection.sent == connection.output.size();
+    }
+    
+    void accept() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) fail("cannot accept a connection");
+                return;
+            }
+            unique_ptr<Connection> connection(new Connection());
+            connection->fd = fd;
+            connection->events = EPOLLIN | EPOLLRDHUP;
+            uint64_t id = nextConnection++;
+            if (!watch(fd, id, connection->events)) {
+                close(fd);
+                continue;
+            }
+            connections[id] = move(connection);
+        }
+    }
+    
+    void disconnect(uint64_t id) {
+        auto it = connections.find(id);
+        if (it == connections.end()) return;
+        // A request still with the handlers completes into the void
+        close(it->second->fd);
+        connections.erase(it);
+    }
+    
+    // Read what has arrived and split it into requests; false on a broken
+    // connection or an invalid frame
+    bool receive(Connection& connection) {
+        char buffer[65536];
+        while (!connection.peerClosed && !paused(connection)) {
+            ssize_t received = recv(connection.fd, buffer, sizeof(buffer), 0);
+            if (received < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return false;
+            }
+            if (received == 0) {
+                connection.peerClosed = true;
+                break;
+            }
+            connection.input.append(buffer, received);
+            
+            size_t at = 0;
+            while (connection.input.size() - at >= 4) {
+                FrameReader header(connection.input.data() + at, 4);
+                size_t size = header.u32();
+                if (size < 5 || size > MAX_FRAME) return false;
+                if (connection.input.size() - at - 4 < size) break;
+                connection.requests.push_back(connection.input.substr(at + 4, size));
+                at += 4 + size;
+            }
+            connection.input.erase(0, at);
+        }
+        return true;
+    }
+    
+    // Send as much pending output as the socket takes; false when broken
+    bool transmit(Connection& connection) {
+        while (connection.sent < connection.output.size()) {
+            ssize_t written = send(connection.fd, connection.output.data() + connection.sent,
+                                   connection.output.size() - connection.sent, MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return false;
+            }
+            connection.sent += written;
+        }
+        if (connection.sent == connection.output.size()) {
+            connection.output.clear();
+            connection.sent = 0;
+        } else if (connection.sent > MAX_FRAME) {
+            connection.output.erase(0, connection.sent);
+            connection.sent = 0;
+        }
+        return true;
+    }
+    
+    // Hand the connection's next request to the handlers if none is running
+    void dispatch(uint64_t id, Connection& connection) {
+        if (connection.busy || connection.requests.empty()) return;
+        connection.busy = true;
+        {
+            lock_guard<mutex> guard(jobLock);
+            jobs.push_back({id, move(connection.requests.front())});
+        }
+        connection.requests.pop_front();
+        jobReady.notify_one();
+    }
+    
+    // Dispatch, then close the connection or update what epoll watches.
+    // A closed peer keeps reporting hang-up, so once it has gone quiet the
+    // connection leaves epoll until there is output to send.
+    void settle(uint64_t id, Connection& connection) {
+        dispatch(id, connection);
+        if (finished(connection)) {
+            disconnect(id);
+            return;
+        }
+        uint32_t events = 0;
+        if (!connection.peerClosed && !paused(connection)) events |= EPOLLIN | EPOLLRDHUP;
+        if (connection.sent < connection.output.size()) events |= EPOLLOUT;
+        if (events == connection.events) return;
+        
+        epoll_event event = {};
+        event.events = events;
+        event.data.u64 = id;
+        int op = (events == 0) ? EPOLL_CTL_DEL : (connection.events == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        if (epoll_ctl(epollFd, op, connection.fd, &event) != 0) {
+            disconnect(id);
+            return;
+        }
+        connection.events = events;
+    }
+    
+    void service(uint64_t id, uint32_t events) {
+        auto it = connections.find(id);
+        if (it == connections.end()) return;
+        Connection& connection = *it->second;
+        
+        if (events & EPOLLERR) {
+            disconnect(id);
+            return;
+        }
+        if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) && !receive(connection)) {
+            disconnect(id);
+            return;
+        }
+        if ((events & EPOLLHUP) && !(events & EPOLLIN)) connection.peerClosed = true;
+        if ((events & EPOLLOUT) && !transmit(connection)) {
+            disconnect(id);
+            return;
+        }
+        settle(id, connection);
+    }
+    
+    // Queue finished responses on their connections
+    void deliver() {
+        uint64_t count;
+        ssize_t ignored = read(wakeFd, &count, sizeof(count));
+        (void)ignored;
+        
+        deque<Completion> finished;
+        {
+            lock_guard<mutex> guard(completionLock);
+            finished.swap(completions);
+        }
+        for (auto& completion : finished) {
+            auto it = connections.find(completion.connection);
+            if (it == connections.end()) continue;
+            Connection& connection = *it->second;
+            connection.busy = false;
+            connection.output += completion.response;
+            if (!transmit(connection)) {
+                disconnect(completion.connection);
+                continue;
+            }
+            // Reading may have been paused on this connection
+            if (!connection.peerClosed && !paused(connection) && !(connection.events & EPOLLIN)) {
+                if (!receive(connection)) {
+                    disconnect(completion.connection);
+                    continue;
+                }
+            }
+            settle(completion.connection, connection);
+        }
+    }
+    
+    void stopHandlers() {
+        {
+            lock_guard<mutex> guard(jobLock);
+            stopping = true;
+        }
+        jobReady.notify_all();
+        for (auto& handler : handlers) handler.join();
+        handlers.clear();
+    }
+    
+public:
+    LedgerServer(ExpenseManager& ledger, const string& socketPath, size_t threads)
+        : manager(ledger), path(socketPath), handlerCount(max((size_t)1, threads)) {}
+    
+    LedgerServer(const LedgerServer&) = delete;
+    LedgerServer& operator=(const LedgerServer&) = delete;
+    
+    ~LedgerServer() {
+        stopHandlers();
+        for (auto& entry : connections) close(entry.second->fd);
+        for (int fd : {listenFd, epollFd, wakeFd, signalFd}) {
+            if (fd >= 0) close(fd);
+        }
+        if (bound) unlink(path.c_str());
+    }
+    
+    // SIGINT and SIGTERM stop the server through a signalfd, so they must
+    // be blocked before any thread starts
+    static void blockSignals() {
+        sigset_t signals = stopSignals();
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    }
+    
+    // Serve until SIGINT or SIGTERM; returns the process exit code
+    int run() {
+        if (!open()) return 1;
+        
+        // Load the whole ledger and publish the first version for readers
+        manager.shareReads();
+        ingest = &manager.startIngest();
+        for (size_t i = 0; i < handlerCount; i++) handlers.emplace_back(&LedgerServer::handlerLoop, this);
+        cout << "* Serving the ledger on " << path << " (" << handlerCount << " handler thread"
+             << (handlerCount == 1 ? "" : "s") << ")\n" << flush;
+        
+        epoll_event events[64];
+        bool running = true;
+        while (running) {
+            int ready = epoll_wait(epollFd, events, 64, -1);
+            if (ready < 0) {
+                if (errno == EINTR) continue;
+                fail("event loop failed");
+                break;
+            }
+            for (int i = 0; i < ready; i++) {
+                uint64_t tag = events[i].data.u64;
+                if (tag == LISTEN_TAG) accept();
+                else if (tag == WAKE_TAG) deliver();
+                else if (tag == SIGNAL_TAG) running = signalled();
+                else service(tag, events[i].events);
+            }
         }
+        
+        // Let requests already handed out finish, then flush the ledger
+        stopHandlers();
+        manager.saveToFile();
+        cout << "* Server stopped.\n";
+        return 0;
     }
 };
+#endif
+
+// Stress test of multi-version reads. One writer adds expenses and moves
+// earlier ones to other partitions, publishing after each step; readers
+// meanwhile check that every version they pin agrees with its own totals,
+// holds each expense exactly once and never goes backwards.
+bool checkSnapshots(size_t readers) {
+    const int WRITES = 10000;
+    LedgerStore store;
+    store.shareReads();
+    
+    atomic<bool> writing{true};
+    atomic<size_t> checked{0};
+    mutex failureLock;
+    string failure;
+    auto fail = [&](const string& what) {
+        lock_guard<mutex> guard(failureLock);
+        if (failure.empty()) failure = what;
+    };
+    
+    // Returns the version's row count, or 0 after reporting a failure
+    auto check = [&](const LedgerStore::Version& version) -> size_t {
+        size_t count = 0;
+        double total = 0;
+        vector<int> ids;
+        for (const auto& segment : version.segments) {
+            for (const auto& expense : *segment.rows) {
+                count++;
+                total += expense.getAmount();
+                ids.push_back(expense.getId());
+            }
+        }
+        string where = "version " + to_string(version.revision) + ": ";
+        if (count != version.totals.count || total != version.totals.total) {
+            fail(where + "totals do not match the rows");
+            return 0;
+        }
+        sort(ids.begin(), ids.end());
+        if (adjacent_find(ids.begin(), ids.end()) != ids.end()) {
+            fail(where + "an expense appears twice");
+            return 0;
+        }
+        if (!ids.empty() && (size_t)(ids.back() - ids.front() + 1) != ids.size()) {
+            fail(where + "an expense is missing");
+            return 0;
+        }
+        Selection all;
+        store.select(version, ScanBounds(), all);
+        if (all.size() != count) {
+            fail(where + "a scan found " + to_string(all.size()) + " of " + to_string(count) + " rows");
+            return 0;
+        }
+        return count;
+    };
+    
+    vector<thread> checkers;
+    for (size_t r = 0; r < readers; r++) {
+        checkers.emplace_back([&, r] {
+            unsigned long long lastRevision = 0;
+            size_t lastCount = 0;
+            bool more;
+            do {
+                more = writing.load();
+                LedgerStore::PinnedVersion version = store.pin();
+                if (version->revision < lastRevision) fail("a reader saw an older version after a newer one");
+                size_t count = check(*version);
+                if (count < lastCount) fail("a reader saw expenses disappear");
+                lastRevision = version->revision;
+                lastCount = count;
+                checked++;
+                // The first reader holds its versions a little longer
+                if (r == 0) this_thread::sleep_for(chrono::milliseconds(1));
+            } while (more);
+        });
+    }
+    
+    // IDs 1..WRITES, so every version must hold a contiguous range
+    char date[16];
+    for (int i = 0; i < WRITES; i++) {
+        int month = i % 24;
+        snprintf(date, sizeof(date), "%04d-%02d-15", 2023 + month / 12, month % 12 + 1);
+        store.insert(Expense(i + 1, "Check " + to_string(i), 1, "Check", date));
+        if (i % 2 == 1) {
+            // Moved in the same step: no version may show it twice or not at all
+            const Expense* earlier = store.find(1 + (int)((size_t)i * 7919 % (i + 1)));
+            month = (month + 5) % 24;
+            snprintf(date, sizeof(date), "%04d-%02d-15", 2023 + month / 12, month % 12 + 1);
+            store.replace(Expense(earlier->getId(), earlier->getDescription(), 1, "Check", date));
+        }
+        store.publish();
+    }
+    writing = false;
+    for (auto& checker : checkers) checker.join();
+    
+    size_t count = check(*store.pin());
+    if (count != (size_t)WRITES) fail("the final version has " + to_string(count) + " of " + to_string(WRITES) + " expenses");
+    store.publish();
+    if (store.retiredVersions() != 0) fail(to_string(store.retiredVersions()) + " versions were never reclaimed");
+    
+    if (!failure.empty()) {
+        cout << "Error: snapshot check failed: " << failure << "\n";
+        return false;
+    }
+    cout << "* Snapshot check passed: " << WRITES << " writes, " << checked.load() << " versions checked by "
+         << readers << " readers.\n";
+    return true;
+}
+
+// Stress test of concurrent submission. Producers queue expenses numbered
+// 1, 2, 3... each; the applier checks that every producer's expenses
+// arrive complete and in order, and that no ID is handed out twice.
+bool checkIngest(size_t producers) {
+    const int PER_PRODUCER = 250000;
+    LedgerStore store;
+    vector<int> received(producers, 0);
+    string failure;
+    
+    auto start = chrono::steady_clock::now();
+    {
+        ExpenseIngest ingest([&](vector<Expense>& batch) {
+            for (const auto& expense : batch) {
+                size_t producer = (size_t)atoi(expense.getCategory().c_str() + 1);
+                if (producer >= producers || (int)expense.getAmount() != ++received[producer]) {
+                    if (failure.empty()) failure = "expenses of producer " + expense.getCategory() + " arrived out of order";
+                }
+                store.insert(expense);
+            }
+        });
+        vector<thread> threads;
+        for (size_t p = 0; p < producers; p++) {
+            threads.emplace_back([&ingest, p] {
+                ExpenseIngest::Producer producer(ingest);
+                string category = "P" + to_string(p);
+                char date[16];
+                for (int i = 1; i <= PER_PRODUCER; i++) {
+                    int month = i % 24;
+                    snprintf(date, sizeof(date), "%04d-%02d-15", 2023 + month / 12, month % 12 + 1);
+                    producer.submit(Expense(producer.allocateId(), "Ingest", i, category, date));
+                }
+            });
+        }
+        for (auto& producer : threads) producer.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    
+    size_t total = producers * PER_PRODUCER;
+    vector<Expense> rows = store.all();
+    vector<int> ids;
+    ids.reserve(rows.size());
+    for (const auto& expense : rows) ids.push_back(expense.getId());
+    sort(ids.begin(), ids.end());
+    if (failure.empty() && rows.size() != total) {
+        failure = to_string(rows.size()) + " of " + to_string(total) + " expenses were applied";
+    }
+    if (failure.empty() && adjacent_find(ids.begin(), ids.end()) != ids.end()) failure = "an ID was handed out twice";
+    
+    if (!failure.empty()) {
+        cout << "Error: ingest check failed: " << failure << "\n";
+        return false;
+    }
+    cout << "* Ingest check passed: " << total << " expenses from " << producers << " producers in "
+         << fixed << setprecision(2) << seconds << " s (" << setprecision(0) << total / seconds
+         << " adds/s).\n";
+    cout.unsetf(ios::fixed);
+    cout << setprecision(6);
+    return true;
+}
+
+// Round trip of the archive codec over the inputs its edge cases live in:
+// nothing, blocks too short to hold a match, matches longer than 255 bytes
+// (extended lengths) and copies that overlap their own output
+bool checkLz4() {
+    vector<pair<string, string>> cases;
+    cases.emplace_back("empty", "");
+    cases.emplace_back("1 byte", "a");
+    cases.emplace_back("12 bytes", "abcabcabcabc");
+    cases.emplace_back("13 bytes", "aaaaaaaaaaaaa");
+    cases.emplace_back("run of 1 byte", string(5000, 'x'));
+    string pattern;
+    for (int i = 0; i < 2000; i++) pattern += "abc"[i % 3];
+    cases.emplace_back("3-byte pattern", pattern);
+    string rows;
+    for (int i = 0; i < 2000; i++) {
+        rows += to_string(i) + "|Groceries|" + to_string(i % 97) + ".50|Food|2024-03-" + to_string(10 + i % 18) + "\n";
+    }
+    cases.emplace_back("ledger rows", rows);
+    string block;
+    for (int i = 0; i < 300; i++) block += (char)('A' + i % 26 + i / 26);
+    cases.emplace_back("repeated 300-byte block", block + block + block + "tail");
+    string noise;
+    uint32_t state = 2463534242u;
+    for (int i = 0; i < 4096; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        noise += (char)(state & 0xFF);
+    }
+    cases.emplace_back("incompressible", noise);
+    cases.emplace_back("incompressible, then a run", noise + string(1000, '\0') + "end");
+    
+    for (const auto& test : cases) {
+        string compressed = Lz4Block::compress(test.second);
+        string output;
+        if (!Lz4Block::decompress(compressed, test.second.size(), output) || output != test.second) {
+            cout << "Error: LZ4 check failed: " << test.first << " did not round-trip\n";
+            return false;
+        }
+    }
+    cout << "* LZ4 check passed: " << cases.size() << " inputs round-tripped.\n";
+    return true;
+}
+
+// Self-tests (--self-check): the archive codec, then concurrency stress
+// tests. All run in memory, so no files are touched
+int runSelfCheck(size_t threads) {
+    bool passed = checkLz4();
+    passed = checkSnapshots(threads) && passed;
+    passed = checkIngest(threads) && passed;
+    return passed ? 0 : 1;
+}
+
+// Parse command line flags; returns false (after printing usage) on bad input
+bool parseArguments(int argc, char* argv[], AppOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if ((arg == "--page" || arg == "--limit") && i + 1 < argc) {
+            try {
+                long value = stol(argv[++i]);
+                if (value < (arg == "--page" ? 1 : 0)) throw invalid_argument(arg);
+                if (arg == "--page") options.listing.page = (size_t)value;
+                else options.listing.limit = (size_t)value;
+                continue;
+            } catch (const exception&) {
+                cout << "Error: " << arg << " expects a number ("
+                     << (arg == "--page" ? ">= 1" : ">= 0") << ").\n";
+                return false;
+            }
+        }
+        if (arg == "--partition" && i + 1 < argc) {
+            if (PartitionScheme::parse(argv[++i], options.partitioning)) {
+                options.repartition = true;
+                continue;
+            }
+            cout << "Error: --partition expects month, quarter or year.\n";
+            return false;
+        }
+        if (arg == "--alloc-stats") {
+            options.allocationStats = true;
+            continue;
+        }
+        if (arg == "--cache-stats") {
+            options.cacheStats = true;
+            continue;
+        }
+        if (arg == "--threads" && i + 1 < argc) {
+            try {
+                long value = stol(argv[++i]);
+                if (value < 1 || value > 256) throw invalid_argument(arg);
+                options.threads = (size_t)value;
+                continue;
+            } catch (const exception&) {
+                cout << "Error: --threads expects a number from 1 to 256.\n";
+                return false;
+            }
+        }
+        if (arg == "--self-check") {
+            options.selfCheck = true;
+            continue;
+        }
+        if (arg == "--serve" && i + 1 < argc) {
+            options.socketPath = argv[++i];
+            continue;
+        }
+        if (arg == "--trace" && i + 1 < argc) {
+#ifdef EXPENSE_TRACKER_TRACING
+            options.traceFile = argv[++i];
+            continue;
+#else
+            cout << "Error: --trace needs a build with -DEXPENSE_TRACKER_TRACING.\n";
+            return false;
+#endif
+        }
+        if (arg == "--memory-budget" && i + 1 < argc) {
+            try {
+                long value = stol(argv[++i]);
+                if (value < 1 || value > 1048576) throw invalid_argument(arg);
+                options.memoryBudget = (size_t)value * 1024 * 1024;
+                continue;
+            } catch (const exception&) {
+                cout << "Error: --memory-budget expects a size in MB from 1 to 1048576.\n";
+                return false;
+            }
+        }
+        if ((arg == "--undo-depth" || arg == "--undo-memory") && i + 1 < argc) {
+            try {
+                long value = stol(argv[++i]);
+                if (value < (arg == "--undo-depth" ? 1 : 0) || value > 1048576) throw invalid_argument(arg);
+                if (arg == "--undo-depth") options.undoDepth = (size_t)value;
+                else options.undoMemory = (size_t)value * 1024 * 1024;
+                continue;
+            } catch (const exception&) {
+                cout << "Error: " << arg << (arg == "--undo-depth" ? " expects a number of steps from 1"
+                                                                  : " expects a size in MB from 0")
+                     << " to 1048576.\n";
+                return false;
+            }
+        }
+        if (arg == "--metrics" && i + 1 < argc) {
+            options.metricsFile = argv[++i];
+            continue;
+        }
+        if (arg == "--metrics-interval" && i + 1 < argc) {
+            try {
+                long value = stol(argv[++i]);
+                if (value < 1 || value > 86400) throw invalid_argument(arg);
+                options.metricsInterval = (unsigned)value;
+                continue;
+            } catch (const exception&) {
+                cout << "Error: --metrics-interval expects a number of seconds from 1 to 86400.\n";
+                return false;
+            }
+        }
+        cout << "Usage: " << argv[0] << " [--page N] [--limit N] [--partition PERIOD] [--alloc-stats]"
+             << " [--cache-stats] [--threads N] [--serve PATH] [--self-check] [--metrics FILE]"
+             << " [--metrics-interval N] [--trace FILE] [--memory-budget MB] [--undo-depth N]"
+             << " [--undo-memory MB]\n";
+        cout << "  --page N             Page of table listings to show (default 1)\n";
+        cout << "  --limit N            Rows per page in table listings (default 0 = all)\n";
+        cout << "  --partition PERIOD   Store the ledger in month, quarter or year segments\n";
+        cout << "  --alloc-stats        Report heap allocations made by loads, searches and reports\n";
+        cout << "  --cache-stats        Report query cache hits and misses\n";
+        cout << "  --threads N          Threads used by scans (default one per core)\n";
+        cout << "  --serve PATH         Serve the ledger on a Unix domain socket instead of the menu\n";
+        cout << "  --self-check         Check the archive codec, stress-test snapshot reads against writes\n"
+             << "                       and concurrent ingest, then exit\n";
+        cout << "  --metrics FILE       Write runtime metrics to FILE in Prometheus text format\n";
+        cout << "  --metrics-interval N Seconds between metrics dumps (default 10)\n";
+        cout << "  --trace FILE         Write trace spans to FILE on exit (builds with tracing)\n";
+        cout << "  --memory-budget MB   Evict caches, unchanged rows and undo history above MB of heap\n";
+        cout << "  --undo-depth N       Undo steps kept, in memory and in the undo file (default 1000)\n";
+        cout << "  --undo-memory MB     Undo history kept in memory before older steps go to disk (default 64)\n";
+        return false;
+    }
+    return true;
+}
 
-// Main function with error handling
-int main() {
+// Main function with error handling. Builds that embed the tracker, such
+// as benchmark.c++, define EXPENSE_TRACKER_NO_MAIN and bring their own.
+#ifndef EXPENSE_TRACKER_NO_MAIN
+int main(int argc, char* argv[]) {
+    AppOptions options;
+    if (!parseArguments(argc, argv, options)) {
+        return 1;
+    }
+    
     try {
-        ExpenseTrackerApp app;
+        if (options.selfCheck) {
+            return runSelfCheck(max((size_t)2, options.threads ? options.threads : thread::hardware_concurrency()));
+        }
+        if (!options.socketPath.empty()) {
+#ifdef __linux__
+            LedgerServer::blockSignals();
+            ExpenseManager manager("expenses.txt", options);
+            size_t handlers = options.threads ? options.threads : thread::hardware_concurrency();
+            LedgerServer server(manager, options.socketPath, handlers);
+            return server.run();
+#else
+            cout << "Error: --serve is only available on Linux.\n";
+            return 1;
+#endif
+        }
+        ExpenseTrackerApp app(options);
         app.run();
     } catch (const exception& e) {
         cout << "\nFatal error: " << e.what() << endl;
@@ -1488,4 +9412,5 @@ int main() {
     }
     
     return 0;
-}
\ No newline at end of file
+}
+#endif